@@ -0,0 +1,81 @@
+// backend.c: the mmap engine, and the list of engines
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "backend.h"
+#include "blocks.h"
+
+static int mmap_init(int fd) {
+  (void) fd;
+  return 0;
+}
+
+static void mmap_free() {}
+
+static void *mmap_get(uint32_t bnum, uint32_t n) {
+  (void) n;
+  return blocks_get_block(bnum);
+}
+
+static int mmap_put(void *data, uint32_t bnum, uint32_t n, int dirty) {
+  (void) data;
+  (void) bnum;
+  (void) n;
+  (void) dirty;
+  return 0;
+}
+
+static int mmap_read(const blocks_io_t *io, int n) {
+  for (int i = 0; i < n; i++) {
+    memcpy(io[i].buf, (char *) blocks_get_block(io[i].bnum) + io[i].off,
+           io[i].len);
+  }
+  return 0;
+}
+
+static int mmap_write(const blocks_io_t *io, int n) {
+  for (int i = 0; i < n; i++) {
+    char *dst = (char *) blocks_get_block(io[i].bnum) + io[i].off;
+    if (io[i].buf) {
+      memcpy(dst, io[i].buf, io[i].len);
+    } else {
+      memset(dst, 0, io[i].len);
+    }
+  }
+  return 0;
+}
+
+static int mmap_flush(const blocks_io_t *io, int n) {
+  int rv = 0;
+  for (int i = 0; i < n; i++) {
+    // the ranges start on block, so page, boundaries
+    if (msync(blocks_get_block(io[i].bnum), io[i].len, MS_SYNC) < 0) {
+      rv = -errno;
+    }
+  }
+  return rv;
+}
+
+const backend_t backend_mmap = {
+    .name = "mmap",
+    .mapped = 1,
+    .init = mmap_init,
+    .free = mmap_free,
+    .get = mmap_get,
+    .put = mmap_put,
+    .read = mmap_read,
+    .write = mmap_write,
+    .flush = mmap_flush,
+};
+
+static const backend_t *backends[] = {&backend_mmap, &backend_uring};
+
+const backend_t *backend_find(const char *name) {
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    if (strcmp(backends[i]->name, name) == 0) {
+      return backends[i];
+    }
+  }
+  return NULL;
+}
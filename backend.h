@@ -0,0 +1,68 @@
+/**
+ * Engines that move file data between memory and the image.
+ *
+ * Metadata is reached through the mapping whatever the engine: the
+ * journal works on it in place (see journal.h), and so does everything
+ * that lives in blocks of its own, including the fragments small files
+ * share (see frag.h). File data goes through the engine NUFS_ENGINE
+ * picks when the image is opened:
+ *
+ *   mmap   Data is read and written in the shared mapping, and
+ *          blocks_get hands out pointers into it. The kernel does the
+ *          I/O as page faults, one page or readahead window at a time, on
+ *          whichever thread touched it. Writeback is msync.
+ *   uring  Data moves in io_uring requests on the image file. A
+ *          blocks_read or blocks_write call submits a request per range
+ *          and waits for them together, so a fragmented read has as many
+ *          in flight as it has extents. Each thread has its own ring, and
+ *          buffers registered with it for blocks_get and for writing
+ *          zeros. Writeback starts every run at once, then waits for them
+ *          together. Where io_uring isn't available (before Linux 5.6, or
+ *          blocked by a sandbox) the same calls fall back to pread and
+ *          pwrite.
+ *
+ * Both engines go through the page cache, so they, the mapping, and FUSE
+ * splicing straight from the image file all see the same data.
+ */
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stdint.h>
+
+#include "blocks.h"
+
+typedef struct backend {
+  const char *name;
+  int mapped; // whether data written through the mapping counts
+
+  /**
+   * Set up for the image open as fd. Returns 0, or a negative errno if
+   * the engine can't run here.
+   */
+  int (*init)(int fd);
+  void (*free)();
+
+  // as blocks_get, blocks_put, blocks_read and blocks_write
+  void *(*get)(uint32_t bnum, uint32_t n);
+  int (*put)(void *data, uint32_t bnum, uint32_t n, int dirty);
+  int (*read)(const blocks_io_t *io, int n);
+  int (*write)(const blocks_io_t *io, int n);
+
+  /**
+   * Write the ranges (buf unused) to the disk and wait until they are
+   * there. Returns 0, or a negative errno if a write failed.
+   */
+  int (*flush)(const blocks_io_t *io, int n);
+} backend_t;
+
+extern const backend_t backend_mmap;
+extern const backend_t backend_uring;
+
+/**
+ * Find an engine by name.
+ *
+ * @return The engine, or NULL if there is none by that name.
+ */
+const backend_t *backend_find(const char *name);
+
+#endif
@@ -4,6 +4,7 @@
  */
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "bitmap.h"
 
@@ -32,6 +33,37 @@ void bitmap_put(void *bm, int i, int v) {
   }
 }
 
+// Find the first clear bit in [start, end).
+int bitmap_next_free(void *bm, int start, int end) {
+  uint8_t *base = (uint8_t *) bm;
+  int i = start;
+
+  // walk bit by bit up to a word boundary
+  while (i < end && i % 64 != 0) {
+    if (!bitmap_get(bm, i)) {
+      return i;
+    }
+    i++;
+  }
+
+  // then skip full words
+  while (i + 64 <= end) {
+    uint64_t word;
+    memcpy(&word, base + byte_index(i), sizeof(word));
+    if (word != UINT64_MAX) {
+      return i + __builtin_ctzll(~word);
+    }
+    i += 64;
+  }
+
+  for (; i < end; i++) {
+    if (!bitmap_get(bm, i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
 // Pretty-print the bitmap (with the given no. of bits).
 void bitmap_print(void *bm, int size) {
 
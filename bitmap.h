@@ -24,6 +24,20 @@ int bitmap_get(void *bm, int i);
  */
 void bitmap_put(void *bm, int i, int v);
 
+/**
+ * Find the first clear bit in [start, end).
+ *
+ * Whole 64-bit words of set bits are skipped at once, so scanning a mostly
+ * full bitmap costs one load per 64 entries.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start First bit index to consider.
+ * @param end One past the last bit index to consider.
+ *
+ * @return The index of the first clear bit, or -1 if there is none.
+ */
+int bitmap_next_free(void *bm, int start, int end);
+
 /**
  * Pretty-print a bitmap. 
  *
@@ -8,30 +8,143 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "backend.h"
 #include "bitmap.h"
 #include "blocks.h"
+#include "dedup.h"
+#include "inode.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 
-const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
 const int BLOCK_SIZE = 4096; // = 4K
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // = 1MB
+const int NUFS_DEFAULT_SIZE = 1024 * 1024; // = 1MB
 
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
-// Note: assumes block count is divisible by 8
+// number of bits that fit in one bitmap block
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+// number of block refcounts that fit in one refcount table block
+#define REFS_PER_BLOCK (BLOCK_SIZE / (int) sizeof(uint16_t))
 
 static int blocks_fd = -1;
 static void *blocks_base = 0;
+static size_t blocks_size = 0; // bytes mapped
+static const backend_t *engine = &backend_mmap; // moves file data
+
+// The on-disk block bitmap is the source of truth for which blocks are in
+// use. To avoid scanning it on every allocation, the free space is also
+// kept in memory as a treap of free extents ordered by start block, where
+// every node knows the largest extent in its subtree. That answers both
+// "which free extent holds block b" and "first extent at or after b with
+// at least n blocks" in O(log extents), however full the disk is.
+typedef struct free_extent {
+  uint32_t start;   // first free block
+  uint32_t len;     // number of free blocks
+  uint32_t max_len; // largest len in this subtree
+  uint32_t prio;    // heap priority (random)
+  struct free_extent *left, *right;
+} free_extent_t;
+
+static free_extent_t *free_root = 0;
+static uint32_t alloc_cursor = 0; // next-fit: where the last allocation ended
+static uint32_t meta_cursor = 0;  // same, in the metadata zone
+static uint32_t fx_seed = 2463534242u;
+
+// Data blocks freed by transactions that may not have committed yet. The
+// committed metadata can still point at them, so they stay out of the
+// treap until blocks_release_frees. Those a zero-copy read still holds
+// (see read_hold_t) wait for it as well.
+typedef struct pending_free {
+  uint32_t start;
+  uint32_t len;
+  uint64_t tid; // transaction that freed them
+} pending_free_t;
+
+static pending_free_t *pending;
+static int pending_n, pending_cap;
+static uint64_t released_tid; // last transaction blocks_release_frees got
+
+// The image ranges a thread's last zero-copy read handed out. FUSE splices
+// them into the reply after the read returns and the file's lock is
+// dropped, and replies before the thread takes another request, so they
+// are held until the thread's next read or write (blocks_unhold) or its
+// exit.
+typedef struct hold_range {
+  uint32_t start;
+  uint32_t len;
+} hold_range_t;
+
+typedef struct read_hold {
+  hold_range_t *ranges;
+  int n, cap;
+  struct read_hold *prev, *next;
+} read_hold_t;
+
+static read_hold_t *holds; // every thread's
+static pthread_key_t hold_key; // destructor drops the thread's holds
+static pthread_once_t hold_once = PTHREAD_ONCE_INIT;
+static __thread read_hold_t *my_hold;
+
+// Guards the block bitmap, the free-extent treap, the cursors, fx_seed,
+// the pending frees and the holds
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// File data sits in the page cache, written through the mapping or the
+// engine, until the kernel writes the pages back or the engine's flush
+// forces it. Runs of data blocks written since their last flush are
+// remembered per inode, so fsync can flush one file's blocks and the
+// writeback thread can flush the oldest ones in the background. Entries
+// sit on an age list, oldest first, and keep their place when written to
+// again (as the kernel's dirty inode list does).
+#define DIRTY_BUCKETS 1024
+#define DIRTY_RUNS 32 // runs per entry before they are merged
+
+typedef struct dirty_run {
+  uint32_t start;
+  uint32_t len;
+} dirty_run_t;
+
+typedef struct dirty_inode {
+  int inum;
+  uint64_t when;    // stats_now() when its first block was dirtied
+  uint64_t seq;     // order in which flushes took entries; 0 while open
+  uint32_t blocks;  // blocks in runs (may count overlaps twice)
+  int n;
+  dirty_run_t runs[DIRTY_RUNS];
+  struct dirty_inode *hnext;       // hash chain
+  struct dirty_inode *prev, *next; // age list
+} dirty_inode_t;
+
+static dirty_inode_t *dirty_table[DIRTY_BUCKETS];
+static dirty_inode_t *dirty_oldest, *dirty_newest;
+static uint64_t dirty_blocks; // blocks in entries not yet taken by a flush
+static uint64_t dirty_seq;    // last seq handed out
+
+static pthread_t wb_thread;
+static int wb_running, wb_stopping;
+static uint64_t wb_expire_ns = 30000000000ULL; // NUFS_DIRTY_EXPIRE_MS
+static uint64_t wb_limit;                       // NUFS_DIRTY_RATIO of data
+static int wb_interval_ms = 5000;
+
+// Guards everything above. An entry taken by a flush (seq != 0) is off
+// the age list but stays in the hash until its flush is done.
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;    // wakes the thread
+static pthread_cond_t flush_done = PTHREAD_COND_INITIALIZER; // an entry finished
 
 // Get the number of blocks needed to store the given number of bytes.
-int bytes_to_blocks(int bytes) {
-  int quo = bytes / BLOCK_SIZE;
-  int rem = bytes % BLOCK_SIZE;
+int64_t bytes_to_blocks(int64_t bytes) {
+  int64_t quo = bytes / BLOCK_SIZE;
+  int64_t rem = bytes % BLOCK_SIZE;
   if (rem == 0) {
     return quo;
   } else {
@@ -39,64 +152,952 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
+// Pseudo-random treap priority (xorshift32).
+static uint32_t fx_rand() {
+  fx_seed ^= fx_seed << 13;
+  fx_seed ^= fx_seed >> 17;
+  fx_seed ^= fx_seed << 5;
+  return fx_seed;
+}
+
+static uint32_t fx_max(free_extent_t *t) { return t ? t->max_len : 0; }
+
+// Recompute a node's max_len from its children.
+static void fx_update(free_extent_t *t) {
+  uint32_t m = t->len;
+  if (fx_max(t->left) > m) {
+    m = fx_max(t->left);
+  }
+  if (fx_max(t->right) > m) {
+    m = fx_max(t->right);
+  }
+  t->max_len = m;
+}
+
+// Join two treaps where every start in a is below every start in b.
+static free_extent_t *fx_merge(free_extent_t *a, free_extent_t *b) {
+  if (!a) {
+    return b;
+  }
+  if (!b) {
+    return a;
+  }
+  if (a->prio > b->prio) {
+    a->right = fx_merge(a->right, b);
+    fx_update(a);
+    return a;
+  }
+  b->left = fx_merge(a, b->left);
+  fx_update(b);
+  return b;
+}
+
+// Split a treap into extents starting below key (*l) and the rest (*r).
+static void fx_split(free_extent_t *t, uint32_t key, free_extent_t **l,
+                     free_extent_t **r) {
+  if (!t) {
+    *l = *r = 0;
+  } else if (t->start < key) {
+    fx_split(t->right, key, &t->right, r);
+    fx_update(t);
+    *l = t;
+  } else {
+    fx_split(t->left, key, l, &t->left);
+    fx_update(t);
+    *r = t;
+  }
+}
+
+// Find the free extent containing block b, or NULL.
+static free_extent_t *fx_containing(uint32_t b) {
+  free_extent_t *t = free_root;
+  while (t) {
+    if (b < t->start) {
+      t = t->left;
+    } else if (b >= t->start + t->len) {
+      t = t->right;
+    } else {
+      return t;
+    }
+  }
+  return 0;
+}
+
+// Find the lowest extent starting at or after goal with at least n blocks.
+static free_extent_t *fx_first_fit(free_extent_t *t, uint32_t goal,
+                                   uint32_t n) {
+  if (!t || t->max_len < n) {
+    return 0;
+  }
+  if (t->start < goal) {
+    return fx_first_fit(t->right, goal, n);
+  }
+  free_extent_t *found = fx_first_fit(t->left, goal, n);
+  if (found) {
+    return found;
+  }
+  if (t->len >= n) {
+    return t;
+  }
+  return fx_first_fit(t->right, goal, n);
+}
+
+// Find the largest free extent, or NULL if the disk is full.
+static free_extent_t *fx_largest() {
+  free_extent_t *t = free_root;
+  while (t && t->len != t->max_len) {
+    t = fx_max(t->left) == t->max_len ? t->left : t->right;
+  }
+  return t;
+}
+
+// Insert an extent that does not touch any other free extent.
+static void fx_insert(uint32_t start, uint32_t len) {
+  free_extent_t *node = malloc(sizeof(free_extent_t));
+  node->start = start;
+  node->len = len;
+  node->max_len = len;
+  node->prio = fx_rand();
+  node->left = node->right = 0;
+  free_extent_t *l, *r;
+  fx_split(free_root, start, &l, &r);
+  free_root = fx_merge(fx_merge(l, node), r);
+}
+
+// Remove the extent starting exactly at start.
+static void fx_delete(uint32_t start) {
+  free_extent_t *l, *m, *r;
+  fx_split(free_root, start, &l, &m);
+  fx_split(m, start + 1, &m, &r);
+  free(m);
+  free_root = fx_merge(l, r);
+}
+
+// Add newly freed blocks, coalescing with the free extents next to them.
+static void fx_add(uint32_t start, uint32_t len) {
+  free_extent_t *before = start > 0 ? fx_containing(start - 1) : 0;
+  if (before) {
+    start = before->start;
+    len += before->len;
+    fx_delete(before->start);
+  }
+  free_extent_t *after = fx_containing(start + len);
+  if (after) {
+    len += after->len;
+    fx_delete(after->start);
+  }
+  fx_insert(start, len);
+}
+
+// Remove [start, start+len) from the free extent that contains it.
+static void fx_take(free_extent_t *e, uint32_t start, uint32_t len) {
+  uint32_t e_start = e->start, e_end = e->start + e->len;
+  fx_delete(e_start);
+  if (e_start < start) {
+    fx_insert(e_start, start - e_start);
+  }
+  if (start + len < e_end) {
+    fx_insert(start + len, e_end - start - len);
+  }
+}
+
+// Free a treap.
+static void fx_free(free_extent_t *t) {
+  if (t) {
+    fx_free(t->left);
+    fx_free(t->right);
+    free(t);
+  }
+}
+
+// Build the free extent index from the on-disk block bitmap.
+static void alloc_init() {
+  superblock_t *sb = blocks_get_superblock();
+  void *bbm = get_blocks_bitmap();
+  uint32_t ii = sb->data_start;
+  while (ii < sb->block_count) {
+    int start = bitmap_next_free(bbm, ii, sb->block_count);
+    if (start < 0) {
+      break;
+    }
+    uint32_t end = start + 1;
+    while (end < sb->block_count && !bitmap_get(bbm, end)) {
+      end++;
+    }
+    fx_insert(start, end - start);
+    ii = end;
+  }
+  alloc_cursor = sb->data_start;
+  meta_cursor = sb->meta_start;
+}
+
+// Add the bitmap blocks holding bits [start, start+n) to the journal.
+static void bitmap_dirty(void *bm, uint32_t start, uint32_t n) {
+  for (uint32_t b = start / BITS_PER_BLOCK; b <= (start + n - 1) / BITS_PER_BLOCK;
+       b++) {
+    journal_dirty((uint8_t *) bm + (size_t) b * BLOCK_SIZE);
+  }
+}
+
+// Hand every pending free from transactions up to tid, freed no later
+// than before, to the treap. Caller holds alloc_lock.
+// Does a zero-copy read still hold any of [start, start+len)?
+static int held_locked(uint32_t start, uint32_t len) {
+  for (read_hold_t *h = holds; h; h = h->next) {
+    for (int i = 0; i < h->n; i++) {
+      if (h->ranges[i].start < start + len &&
+          start < h->ranges[i].start + h->ranges[i].len) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static void release_frees_locked(uint64_t tid) {
+  int kept = 0;
+  for (int i = 0; i < pending_n; i++) {
+    if (pending[i].tid <= tid &&
+        !held_locked(pending[i].start, pending[i].len)) {
+      fx_add(pending[i].start, pending[i].len);
+    } else {
+      pending[kept++] = pending[i];
+    }
+  }
+  pending_n = kept;
+}
+
+// Is the given block entirely zero?
+static int block_is_zero(const uint8_t *block) {
+  for (int ii = 0; ii < BLOCK_SIZE; ++ii) {
+    if (block[ii]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Blocks in the metadata zone of an image of block_count blocks
+static uint32_t meta_zone_for(uint32_t block_count) {
+  uint32_t n = block_count / 32;
+  return n < 16 ? 16 : n;
+}
+
+// Lay out a fresh superblock, bitmaps and inode table for block_count blocks.
+static void blocks_format(uint32_t block_count) {
+  superblock_t *sb = blocks_get_superblock();
+  memset(sb, 0, sizeof(superblock_t));
+
+  uint32_t inode_count = inode_count_for(block_count);
+
+  sb->block_size = BLOCK_SIZE;
+  sb->block_count = block_count;
+  sb->block_bitmap_start = 1;
+  sb->block_bitmap_blocks = (block_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+  sb->inode_bitmap_start = sb->block_bitmap_start + sb->block_bitmap_blocks;
+  sb->inode_bitmap_blocks = (inode_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+  sb->inode_table_start = sb->inode_bitmap_start + sb->inode_bitmap_blocks;
+  sb->inode_table_blocks = inode_count / (BLOCK_SIZE / INODE_SIZE);
+  sb->inode_count = inode_count;
+  sb->refcount_start = sb->inode_table_start + sb->inode_table_blocks;
+  sb->refcount_blocks = (block_count + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK;
+  sb->journal_start = sb->refcount_start + sb->refcount_blocks;
+  sb->journal_blocks = journal_size_for(block_count);
+  sb->meta_start = sb->journal_start + sb->journal_blocks;
+  sb->data_start = sb->meta_start + meta_zone_for(block_count);
+  sb->inode_hint = 1;
+  assert(sb->data_start < block_count);
+
+  // the metadata area may hold garbage if the image was reused; only touch
+  // blocks that need it so a sparse image stays sparse
+  for (uint32_t ii = 1; ii < sb->data_start; ++ii) {
+    if (!block_is_zero(blocks_get_block(ii))) {
+      memset(blocks_get_block(ii), 0, BLOCK_SIZE);
+    }
+  }
+
+  // the superblock, bitmaps, inode and refcount tables and journal are
+  // never handed out
+  void *bbm = get_blocks_bitmap();
+  for (uint32_t ii = 0; ii < sb->meta_start; ++ii) {
+    bitmap_put(bbm, ii, 1);
+  }
+
+  // write the magic last so a half-formatted image is never mounted
+  sb->version = NUFS_VERSION;
+  sb->magic = NUFS_MAGIC;
+  printf("+ formatted image: %u blocks, %u inodes\n", block_count, inode_count);
+}
+
 // Load and initialize the given disk image.
 void blocks_init(const char *image_path) {
   blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
   assert(blocks_fd != -1);
+  // one nufs per image; a remount waits for the previous one to finish
+  // its last commit and exit
+  int rv = flock(blocks_fd, LOCK_EX);
+  assert(rv == 0);
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  struct stat st;
+  rv = fstat(blocks_fd, &st);
   assert(rv == 0);
 
+  // a new (or empty) image gets the default size
+  if (st.st_size < NUFS_DEFAULT_SIZE) {
+    rv = ftruncate(blocks_fd, NUFS_DEFAULT_SIZE);
+    assert(rv == 0);
+    st.st_size = NUFS_DEFAULT_SIZE;
+  }
+
   // map the image to memory
+  blocks_size = (size_t) (st.st_size / BLOCK_SIZE) * BLOCK_SIZE;
   blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
+      mmap(0, blocks_size, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
   assert(blocks_base != MAP_FAILED);
 
-  // block 0 stores the block bitmap and the inode bitmap
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, 0, 1);
+  superblock_t *sb = blocks_get_superblock();
+  if (sb->magic != NUFS_MAGIC) {
+    if (!block_is_zero(blocks_base)) {
+      fprintf(stderr, "nufs: %s is not a nufs image\n", image_path);
+      exit(1);
+    }
+    blocks_format(blocks_size / BLOCK_SIZE);
+  }
+
+  if (sb->version != NUFS_VERSION || sb->block_size != (uint32_t) BLOCK_SIZE ||
+      (size_t) sb->block_count * BLOCK_SIZE > blocks_size) {
+    fprintf(stderr, "nufs: %s has an unsupported layout\n", image_path);
+    exit(1);
+  }
+  journal_init(blocks_fd);
+
+  // from here on metadata reaches the image only through the journal; a
+  // private mapping keeps the kernel from writing it back on its own
+  void *meta = mmap(blocks_base, (size_t) sb->data_start * BLOCK_SIZE,
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, blocks_fd, 0);
+  assert(meta == blocks_base);
+  alloc_init();
+
+  const char *name = getenv("NUFS_ENGINE");
+  engine = backend_find(name && *name ? name : "mmap");
+  if (!engine) {
+    fprintf(stderr, "nufs: no engine called %s (mmap or uring)\n", name);
+    exit(1);
+  }
+  rv = engine->init(blocks_fd);
+  assert(rv == 0);
+  printf("+ mounted image: %u blocks (%zu MB), data starts at block %u, "
+         "%s engine\n",
+         sb->block_count, blocks_size >> 20, sb->data_start, engine->name);
 }
 
 // Close the disk image.
 void blocks_free() {
-  int rv = munmap(blocks_base, NUFS_SIZE);
+  engine->free();
+  int rv = munmap(blocks_base, blocks_size);
   assert(rv == 0);
+  close(blocks_fd);
+  // the free space index is rebuilt from the bitmap by the next
+  // blocks_init
+  fx_free(free_root);
+  free_root = 0;
+  free(pending);
+  pending = 0;
+  pending_n = pending_cap = 0;
+  released_tid = 0;
+  // threads outlive the image; their holds were for this one
+  for (read_hold_t *h = holds; h; h = h->next) {
+    h->n = 0;
+  }
 }
 
+// The image file, for I/O that doesn't go through the mapping.
+int blocks_get_fd() { return blocks_fd; }
+
+// Return a pointer to the superblock.
+superblock_t *blocks_get_superblock() { return (superblock_t *) blocks_base; }
+
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) {
+  return (uint8_t *) blocks_base + (size_t) BLOCK_SIZE * bnum;
+}
+
+// File data, through the engine.
+void *blocks_get(uint32_t bnum, uint32_t n) { return engine->get(bnum, n); }
+
+int blocks_put(void *data, uint32_t bnum, uint32_t n, int dirty) {
+  return engine->put(data, bnum, n, dirty);
+}
+
+int blocks_read(const blocks_io_t *io, int n) {
+  return n > 0 ? engine->read(io, n) : 0;
+}
+
+int blocks_write(const blocks_io_t *io, int n) {
+  return n > 0 ? engine->write(io, n) : 0;
+}
+
+int blocks_data_mapped() { return engine->mapped; }
+
+// Get the number of the block ptr points into.
+int blocks_get_bnum(const void *ptr) {
+  return ((const uint8_t *) ptr - (uint8_t *) blocks_base) / BLOCK_SIZE;
+}
 
 // Return a pointer to the beginning of the block bitmap.
-// The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+// The size is superblock->block_bitmap_blocks blocks.
+void *get_blocks_bitmap() {
+  return blocks_get_block(blocks_get_superblock()->block_bitmap_start);
+}
 
 // Return a pointer to the beginning of the inode table bitmap.
 void *get_inode_bitmap() {
-  uint8_t *block = blocks_get_block(0);
-
-  // The inode bitmap is stored immediately after the block bitmap
-  return (void *) (block + BLOCK_BITMAP_SIZE);
+  return blocks_get_block(blocks_get_superblock()->inode_bitmap_start);
 }
 
 // Allocate a new block and return its index.
+// Next-fit: continues from where the previous allocation ended.
 int alloc_block() {
-  void *bbm = get_blocks_bitmap();
+  int got;
+  return alloc_blocks(1, -1, &got); // no goal: continue at the cursor
+}
+
+// Allocate up to n contiguous blocks, as close to goal as possible.
+int alloc_blocks(int n, int goal, int *got) {
+  superblock_t *sb = blocks_get_superblock();
+  pthread_mutex_lock(&alloc_lock);
+  if (goal < (int) sb->data_start || goal >= (int) sb->block_count) {
+    goal = alloc_cursor;
+  }
 
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
-      printf("+ alloc_block() -> %d\n", ii);
-      return ii;
+  // extend right at the goal if it is free, else the first run after it
+  // that is big enough, else wrap around, else the largest run left
+  uint32_t start;
+  free_extent_t *e = fx_containing(goal);
+  if (e) {
+    start = goal;
+  } else {
+    e = fx_first_fit(free_root, goal, n);
+    if (!e) {
+      e = fx_first_fit(free_root, 0, n);
+    }
+    if (!e) {
+      e = fx_largest();
     }
+    if (!e) {
+      pthread_mutex_unlock(&alloc_lock);
+      TRACE(TRACE_ALLOC, TR_ALLOC, -1, goal, n, -1);
+      return -1;
+    }
+    start = e->start;
+  }
+
+  uint32_t len = e->start + e->len - start;
+  if (len > (uint32_t) n) {
+    len = n;
+  }
+  fx_take(e, start, len);
+
+  void *bbm = get_blocks_bitmap();
+  bitmap_dirty(bbm, start, len);
+  for (uint32_t ii = start; ii < start + len; ++ii) {
+    bitmap_put(bbm, ii, 1);
   }
+  alloc_cursor = start + len;
+  pthread_mutex_unlock(&alloc_lock);
+  *got = len;
+  stats_add(ST_BLOCKS_ALLOCATED, len);
+  TRACE(TRACE_ALLOC, TR_ALLOC, -1, start, len, n);
+  return start;
+}
 
-  return -1;
+// Allocate a block for directory or extent-tree contents.
+// Next-fit within the metadata zone. The data area is shared with the page
+// cache and so not write-ahead, so a full zone is a full disk.
+int alloc_meta_block() {
+  superblock_t *sb = blocks_get_superblock();
+  void *bbm = get_blocks_bitmap();
+  pthread_mutex_lock(&alloc_lock);
+  int bnum = bitmap_next_free(bbm, meta_cursor, sb->data_start);
+  if (bnum < 0) {
+    bnum = bitmap_next_free(bbm, sb->meta_start, meta_cursor);
+  }
+  if (bnum < 0) {
+    pthread_mutex_unlock(&alloc_lock);
+    return -1;
+  }
+  bitmap_dirty(bbm, bnum, 1);
+  bitmap_put(bbm, bnum, 1);
+  meta_cursor = bnum + 1;
+  pthread_mutex_unlock(&alloc_lock);
+  stats_add(ST_BLOCKS_ALLOCATED, 1);
+  TRACE(TRACE_ALLOC, TR_ALLOC, -1, bnum, 1, 1);
+  return bnum;
 }
 
 // Deallocate the block with the given index.
 void free_block(int bnum) {
-  printf("+ free_block(%d)\n", bnum);
+  free_blocks(bnum, 1);
+}
+
+// The refcount table: for each block, its references beyond the first.
+static uint16_t *get_refcounts() {
+  return blocks_get_block(blocks_get_superblock()->refcount_start);
+}
+
+// Add references to blocks a file is about to share.
+int blocks_ref(int start, int n) {
+  uint16_t *refs = get_refcounts();
+  pthread_mutex_lock(&alloc_lock);
+  for (int ii = start; ii < start + n; ++ii) {
+    assert(bitmap_get(get_blocks_bitmap(), ii));
+    if (refs[ii] == UINT16_MAX) {
+      pthread_mutex_unlock(&alloc_lock);
+      return -EMLINK;
+    }
+  }
+  for (int ii = start; ii < start + n; ++ii) {
+    journal_dirty(&refs[ii]);
+    __atomic_fetch_add(&refs[ii], 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return 0;
+}
+
+// References to a block beyond the first. Read without alloc_lock: the
+// file asking holds one reference, so the block stays in use, and a count
+// another file is just dropping at worst costs a needless copy.
+int blocks_shared(int bnum) {
+  return __atomic_load_n(&get_refcounts()[bnum], __ATOMIC_RELAXED);
+}
+
+// Free a run of blocks nothing else refers to. Caller holds alloc_lock.
+static void free_run_locked(int start, int n) {
+  superblock_t *sb = blocks_get_superblock();
   void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
-}
\ No newline at end of file
+  // images from before the zone was enforced have directory and tree
+  // blocks in the data area, so one extent can map the last zone block
+  // and a data block after it; only the data part is tracked
+  int data = start > (int) sb->data_start ? start : (int) sb->data_start;
+  bitmap_dirty(bbm, start, n);
+  for (int ii = start; ii < start + n; ++ii) {
+    bitmap_put(bbm, ii, 0);
+  }
+  if (data < start + n) {
+    if (pending_n == pending_cap) {
+      pending_cap = pending_cap ? pending_cap * 2 : 64;
+      pending = realloc(pending, pending_cap * sizeof(pending_free_t));
+    }
+    pending[pending_n].start = data;
+    pending[pending_n].len = start + n - data;
+    pending[pending_n].tid = journal_tid();
+    pending_n++;
+    journal_forget(data, start + n - data);
+  }
+  stats_add(ST_BLOCKS_FREED, n);
+  TRACE(TRACE_ALLOC, TR_FREE, -1, start, n, 0);
+}
+
+// Deallocate n contiguous blocks starting at start. Shared blocks in the
+// run just lose a reference.
+void free_blocks(int start, int n) {
+  assert(start >= (int) blocks_get_superblock()->meta_start);
+  // no longer a candidate for sharing, whether or not it is freed
+  dedup_forget(start, n);
+  uint16_t *refs = get_refcounts();
+  pthread_mutex_lock(&alloc_lock);
+  int ii = start;
+  while (ii < start + n) {
+    int run = ii;
+    while (ii < start + n && refs[ii] == 0) {
+      ii++;
+    }
+    if (ii > run) {
+      free_run_locked(run, ii - run);
+    }
+    for (; ii < start + n && refs[ii] > 0; ++ii) {
+      journal_dirty(&refs[ii]);
+      __atomic_fetch_sub(&refs[ii], 1, __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+int blocks_frees_pending() {
+  pthread_mutex_lock(&alloc_lock);
+  int n = pending_n;
+  pthread_mutex_unlock(&alloc_lock);
+  return n > 0;
+}
+
+// Make blocks freed by committed transactions available again.
+void blocks_release_frees(uint64_t tid) {
+  pthread_mutex_lock(&alloc_lock);
+  released_tid = tid;
+  release_frees_locked(tid);
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+// Drop a thread's holds, letting go of committed frees that waited for
+// them. Caller holds alloc_lock.
+static void unhold_locked(read_hold_t *h) {
+  h->n = 0;
+  if (pending_n > 0) {
+    release_frees_locked(released_tid);
+  }
+}
+
+// Thread exit: its last read has been replied to.
+static void hold_exit(void *arg) {
+  read_hold_t *h = arg;
+  pthread_mutex_lock(&alloc_lock);
+  if (h->prev) {
+    h->prev->next = h->next;
+  } else {
+    holds = h->next;
+  }
+  if (h->next) {
+    h->next->prev = h->prev;
+  }
+  unhold_locked(h);
+  pthread_mutex_unlock(&alloc_lock);
+  free(h->ranges);
+  free(h);
+}
+
+static void hold_key_create() {
+  pthread_key_create(&hold_key, hold_exit);
+}
+
+void blocks_hold(uint32_t start, uint32_t len) {
+  if (!my_hold) {
+    pthread_once(&hold_once, hold_key_create);
+    my_hold = calloc(1, sizeof(read_hold_t));
+    pthread_setspecific(hold_key, my_hold);
+    pthread_mutex_lock(&alloc_lock);
+    my_hold->next = holds;
+    if (holds) {
+      holds->prev = my_hold;
+    }
+    holds = my_hold;
+    pthread_mutex_unlock(&alloc_lock);
+  }
+  read_hold_t *h = my_hold;
+  pthread_mutex_lock(&alloc_lock);
+  if (h->n == h->cap) {
+    h->cap = h->cap ? h->cap * 2 : 4;
+    h->ranges = realloc(h->ranges, h->cap * sizeof(hold_range_t));
+  }
+  h->ranges[h->n].start = start;
+  h->ranges[h->n].len = len;
+  h->n++;
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+void blocks_unhold() {
+  // only the owning thread adds to its holds, so n can be read unlocked
+  if (my_hold && my_hold->n > 0) {
+    pthread_mutex_lock(&alloc_lock);
+    unhold_locked(my_hold);
+    pthread_mutex_unlock(&alloc_lock);
+  }
+}
+
+// The open (not yet taken) dirty entry for inum, or NULL.
+static dirty_inode_t *dirty_find(int inum) {
+  for (dirty_inode_t *e = dirty_table[inum % DIRTY_BUCKETS]; e; e = e->hnext) {
+    if (e->inum == inum && e->seq == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static int run_cmp(const void *a, const void *b) {
+  const dirty_run_t *x = a, *y = b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Make room in a full entry: sort and coalesce its runs, and if that
+// isn't enough, merge the two runs closest together. Flushing a clean
+// gap between them costs only the page lookups.
+static void dirty_compact(dirty_inode_t *e) {
+  qsort(e->runs, e->n, sizeof(dirty_run_t), run_cmp);
+  int n = 0;
+  for (int i = 0; i < e->n; i++) {
+    dirty_run_t *last = n > 0 ? &e->runs[n - 1] : NULL;
+    if (last && e->runs[i].start <= last->start + last->len) {
+      uint32_t end = e->runs[i].start + e->runs[i].len;
+      if (end > last->start + last->len) {
+        last->len = end - last->start;
+      }
+    } else {
+      e->runs[n++] = e->runs[i];
+    }
+  }
+  if (n == DIRTY_RUNS) {
+    int best = 0;
+    for (int i = 1; i < n - 1; i++) {
+      if (e->runs[i + 1].start - e->runs[i].start - e->runs[i].len <
+          e->runs[best + 1].start - e->runs[best].start - e->runs[best].len) {
+        best = i;
+      }
+    }
+    e->runs[best].len = e->runs[best + 1].start + e->runs[best + 1].len -
+                        e->runs[best].start;
+    memmove(&e->runs[best + 1], &e->runs[best + 2],
+            (n - best - 2) * sizeof(dirty_run_t));
+    n--;
+  }
+  uint32_t blocks = 0;
+  for (int i = 0; i < n; i++) {
+    blocks += e->runs[i].len;
+  }
+  dirty_blocks -= e->blocks - blocks;
+  e->blocks = blocks;
+  e->n = n;
+}
+
+// Take e off the age list for a flush. Caller holds dirty_lock.
+static void dirty_take(dirty_inode_t *e) {
+  if (e->prev) {
+    e->prev->next = e->next;
+  } else {
+    dirty_oldest = e->next;
+  }
+  if (e->next) {
+    e->next->prev = e->prev;
+  } else {
+    dirty_newest = e->prev;
+  }
+  e->seq = ++dirty_seq;
+  dirty_blocks -= e->blocks;
+}
+
+// Remove a taken entry from the hash and free it. Caller holds dirty_lock.
+static void dirty_finish(dirty_inode_t *e) {
+  dirty_inode_t **link = &dirty_table[e->inum % DIRTY_BUCKETS];
+  while (*link != e) {
+    link = &(*link)->hnext;
+  }
+  *link = e->hnext;
+  pthread_cond_broadcast(&flush_done);
+  free(e);
+}
+
+// Have the engine write a taken entry's runs, all together, and free it.
+// Called without dirty_lock.
+static int dirty_write(dirty_inode_t *e) {
+  blocks_io_t io[DIRTY_RUNS];
+  for (int i = 0; i < e->n; i++) {
+    blocks_io_t run = {e->runs[i].start, 0,
+                       (size_t) e->runs[i].len * BLOCK_SIZE, NULL};
+    io[i] = run;
+  }
+  int rv = e->n > 0 ? engine->flush(io, e->n) : 0;
+  stats_add(ST_WRITEBACK_BLOCKS, e->blocks);
+  TRACE(TRACE_OPS, TR_WRITEBACK, e->inum, 0, e->blocks, rv);
+
+  pthread_mutex_lock(&dirty_lock);
+  dirty_finish(e);
+  pthread_mutex_unlock(&dirty_lock);
+  return rv;
+}
+
+// Record data blocks written through the mapping.
+void blocks_mark_dirty(int inum, uint32_t start, uint32_t n) {
+  pthread_mutex_lock(&dirty_lock);
+  dirty_inode_t *e = dirty_find(inum);
+  if (!e) {
+    e = calloc(1, sizeof(dirty_inode_t));
+    e->inum = inum;
+    e->when = stats_now();
+    e->hnext = dirty_table[inum % DIRTY_BUCKETS];
+    dirty_table[inum % DIRTY_BUCKETS] = e;
+    e->prev = dirty_newest;
+    if (dirty_newest) {
+      dirty_newest->next = e;
+    } else {
+      dirty_oldest = e;
+    }
+    dirty_newest = e;
+  }
+  // sequential writes extend the last run
+  dirty_run_t *last = e->n > 0 ? &e->runs[e->n - 1] : NULL;
+  if (last && start >= last->start && start <= last->start + last->len) {
+    if (start + n > last->start + last->len) {
+      uint32_t grow = start + n - last->start - last->len;
+      last->len += grow;
+      e->blocks += grow;
+      dirty_blocks += grow;
+    }
+  } else {
+    if (e->n == DIRTY_RUNS) {
+      dirty_compact(e);
+    }
+    e->runs[e->n].start = start;
+    e->runs[e->n].len = n;
+    e->n++;
+    e->blocks += n;
+    dirty_blocks += n;
+  }
+  if (wb_limit > 0 && dirty_blocks > wb_limit) {
+    pthread_cond_signal(&wb_cond);
+  }
+  pthread_mutex_unlock(&dirty_lock);
+}
+
+// Write a file's dirty data blocks to the image and wait for them.
+int blocks_flush_inode(int inum) {
+  pthread_mutex_lock(&dirty_lock);
+  dirty_inode_t *e = dirty_find(inum);
+  if (e) {
+    dirty_take(e);
+  }
+  uint64_t seq = e ? e->seq : dirty_seq + 1;
+  pthread_mutex_unlock(&dirty_lock);
+  int rv = e ? dirty_write(e) : 0;
+
+  // a flush that took this file's earlier blocks may still be running;
+  // waiting only on older flushes can't deadlock
+  pthread_mutex_lock(&dirty_lock);
+  for (;;) {
+    dirty_inode_t *busy = dirty_table[inum % DIRTY_BUCKETS];
+    while (busy && !(busy->inum == inum && busy->seq != 0 && busy->seq < seq)) {
+      busy = busy->hnext;
+    }
+    if (!busy) {
+      break;
+    }
+    pthread_cond_wait(&flush_done, &dirty_lock);
+  }
+  pthread_mutex_unlock(&dirty_lock);
+  return rv;
+}
+
+// Ask the writeback thread to flush a file's dirty blocks soon.
+void blocks_expire_inode(int inum) {
+  pthread_mutex_lock(&dirty_lock);
+  dirty_inode_t *e = dirty_find(inum);
+  if (e && wb_running) {
+    e->when = 0;
+    // move it to the front, so it is the first one taken
+    if (e != dirty_oldest) {
+      e->prev->next = e->next;
+      if (e->next) {
+        e->next->prev = e->prev;
+      } else {
+        dirty_newest = e->prev;
+      }
+      e->prev = NULL;
+      e->next = dirty_oldest;
+      dirty_oldest->prev = e;
+      dirty_oldest = e;
+    }
+    pthread_cond_signal(&wb_cond);
+  }
+  pthread_mutex_unlock(&dirty_lock);
+}
+
+// Drop a freed file's dirty blocks without writing them.
+void blocks_forget_dirty(int inum) {
+  pthread_mutex_lock(&dirty_lock);
+  dirty_inode_t *e = dirty_find(inum);
+  if (e) {
+    dirty_take(e);
+    dirty_finish(e);
+  }
+  pthread_mutex_unlock(&dirty_lock);
+}
+
+// Flush entries, oldest first, while they are past the expire time or
+// the dirty total is over the limit (or everything, if all is set).
+static int writeback(int all) {
+  int rv = 0;
+  pthread_mutex_lock(&dirty_lock);
+  while (dirty_oldest &&
+         (all || dirty_oldest->when + wb_expire_ns <= stats_now() ||
+          (wb_limit > 0 && dirty_blocks > wb_limit))) {
+    dirty_inode_t *e = dirty_oldest;
+    dirty_take(e);
+    pthread_mutex_unlock(&dirty_lock);
+    int err = dirty_write(e);
+    if (err < 0) {
+      rv = err;
+    }
+    pthread_mutex_lock(&dirty_lock);
+  }
+  pthread_mutex_unlock(&dirty_lock);
+  return rv;
+}
+
+// Background writeback: wakes every wb_interval_ms, or when the dirty
+// total crosses the limit or a file is closed, and flushes what is due.
+static void *writeback_thread(void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&dirty_lock);
+  while (!wb_stopping) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += wb_interval_ms / 1000;
+    ts.tv_nsec += (long) (wb_interval_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&wb_cond, &dirty_lock, &ts);
+    if (wb_stopping) {
+      break;
+    }
+    pthread_mutex_unlock(&dirty_lock);
+    writeback(0);
+    pthread_mutex_lock(&dirty_lock);
+  }
+  pthread_mutex_unlock(&dirty_lock);
+  return NULL;
+}
+
+// Start the background writeback thread.
+void blocks_start_writeback() {
+  if (wb_running) {
+    return;
+  }
+  superblock_t *sb = blocks_get_superblock();
+  const char *env = getenv("NUFS_DIRTY_EXPIRE_MS");
+  if (env && atoi(env) > 0) {
+    wb_expire_ns = (uint64_t) atoi(env) * 1000000;
+  }
+  int ratio = 10;
+  env = getenv("NUFS_DIRTY_RATIO");
+  if (env && atoi(env) > 0 && atoi(env) <= 100) {
+    ratio = atoi(env);
+  }
+  // look a few times per expire period, but not more often than every
+  // 100ms
+  wb_interval_ms = (int) (wb_expire_ns / 1000000 / 4);
+  if (wb_interval_ms > 5000) {
+    wb_interval_ms = 5000;
+  } else if (wb_interval_ms < 100) {
+    wb_interval_ms = 100;
+  }
+  pthread_mutex_lock(&dirty_lock);
+  wb_limit = (uint64_t) (sb->block_count - sb->data_start) * ratio / 100;
+  wb_stopping = 0;
+  pthread_mutex_unlock(&dirty_lock);
+  int rv = pthread_create(&wb_thread, NULL, writeback_thread, NULL);
+  assert(rv == 0);
+  wb_running = 1;
+}
+
+// Stop the writeback thread and flush every dirty block.
+int blocks_stop_writeback() {
+  if (wb_running) {
+    pthread_mutex_lock(&dirty_lock);
+    wb_stopping = 1;
+    pthread_cond_signal(&wb_cond);
+    pthread_mutex_unlock(&dirty_lock);
+    pthread_join(wb_thread, NULL);
+    wb_running = 0;
+  }
+  return writeback(1);
+}
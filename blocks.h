@@ -1,18 +1,54 @@
 /**
  * A block-based abstraction over a disk image file.
  *
- * The disk image is mmapped, so block data is accessed using pointers.
+ * The disk image is mmapped, so metadata is accessed using pointers. File
+ * data goes through blocks_get/blocks_put and blocks_read/blocks_write,
+ * which the engine picked when the image is opened carries out (see
+ * backend.h).
+ *
+ * Block 0 of every image holds the superblock, which records the geometry
+ * of the image (block count, where the bitmaps and the inode table live).
+ * Nothing about the layout is fixed at compile time except the block size.
+ *
+ * Everything below data_start is metadata: the superblock, bitmaps, inode
+ * table, block refcount table, journal and a metadata zone that directory
+ * blocks and extent-tree nodes are allocated from. That area is mapped
+ * privately and reaches the image only through the journal (see
+ * journal.h); file data is mapped shared.
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
 #include <stdio.h>
 
-extern const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
 extern const int BLOCK_SIZE;  // default = 4K
-extern const int NUFS_SIZE;   // default = 1MB
+extern const int NUFS_DEFAULT_SIZE; // size of a freshly created image (1MB)
 
-extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 10
+
+typedef struct superblock {
+  uint32_t magic;               // NUFS_MAGIC
+  uint32_t version;             // NUFS_VERSION
+  uint32_t block_size;          // bytes per block
+  uint32_t block_count;         // total number of blocks in the image
+  uint32_t block_bitmap_start;  // first block of the block bitmap
+  uint32_t block_bitmap_blocks; // length of the block bitmap in blocks
+  uint32_t inode_bitmap_start;  // first block of the inode bitmap
+  uint32_t inode_bitmap_blocks; // length of the inode bitmap in blocks
+  uint32_t inode_table_start;   // first block of the inode table
+  uint32_t inode_table_blocks;  // length of the inode table in blocks
+  uint32_t inode_count;         // number of inodes in the inode table
+  uint32_t data_start;          // first block available for file data
+  uint32_t inode_hint;          // next inode number alloc_inode tries
+  uint32_t journal_start;       // first block of the journal
+  uint32_t journal_blocks;      // length of the journal in blocks
+  uint32_t meta_start;          // first block of the metadata zone, which
+                                // runs up to data_start
+  uint32_t refcount_start;      // first block of the block refcount table
+  uint32_t refcount_blocks;     // length of the refcount table in blocks
+} superblock_t;
 
 /** 
  * Compute the number of blocks needed to store the given number of bytes.
@@ -21,11 +57,17 @@ extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
  *
  * @return Number of blocks needed to store the given number of bytes.
  */
-int bytes_to_blocks(int bytes);
+int64_t bytes_to_blocks(int64_t bytes);
 
 /**
  * Load and initialize the given disk image.
  *
+ * An empty or missing image is created with NUFS_DEFAULT_SIZE bytes and
+ * formatted. An existing image that is all zeros in block 0 (e.g. made with
+ * `truncate -s 64G`) is formatted to its current size. Otherwise the
+ * geometry is read from the superblock. NUFS_ENGINE names the engine for
+ * file data, "mmap" (the default) or "uring".
+ *
  * @param image_path Path to the disk image file.
  */
 void blocks_init(const char *image_path);
@@ -35,6 +77,22 @@ void blocks_init(const char *image_path);
  */
 void blocks_free();
 
+/**
+ * Return the open image file. Reading or writing file data through it
+ * sees the same pages as the mapping; metadata must not be written
+ * through it.
+ *
+ * @return The file descriptor.
+ */
+int blocks_get_fd();
+
+/**
+ * Return a pointer to the superblock of the loaded image.
+ *
+ * @return A pointer to the superblock (block 0).
+ */
+superblock_t *blocks_get_superblock();
+
 /**
  * Get the block with the given index, returning a pointer to its start.
  *
@@ -44,9 +102,86 @@ void blocks_free();
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Get the number of the block a pointer into the image points into.
+ *
+ * @param ptr Pointer into the mapped image.
+ *
+ * @return The block number.
+ */
+int blocks_get_bnum(const void *ptr);
+
+/**
+ * A byte range of the image holding file data, and the memory it is read
+ * into or written from.
+ */
+typedef struct blocks_io {
+  uint32_t bnum; // block the range starts in
+  uint32_t off;  // bytes into that block
+  size_t len;    // bytes; may run on into the blocks after it
+  void *buf;     // for a write, NULL writes zeros
+} blocks_io_t;
+
+/**
+ * Get n blocks of file data in memory, to read or change. Only for blocks
+ * the caller's file alone may write: a block other files share
+ * (blocks_ref) is only read, and fragments stay in the mapping.
+ *
+ * @param bnum The first block.
+ * @param n Number of blocks.
+ *
+ * @return Their data: the mapping itself, or a copy read from the image.
+ *         NULL if reading failed.
+ */
+void *blocks_get(uint32_t bnum, uint32_t n);
+
+/**
+ * Give back data from blocks_get. Changes made to a copy reach the image
+ * here; the blocks still need blocks_mark_dirty for writeback.
+ *
+ * @param data What blocks_get returned.
+ * @param bnum The first block.
+ * @param n Number of blocks.
+ * @param dirty Whether the data was changed.
+ *
+ * @return 0, or a negative errno if writing it back failed.
+ */
+int blocks_put(void *data, uint32_t bnum, uint32_t n, int dirty);
+
+/**
+ * Read ranges of file data, all in one go: the engine may have them all
+ * in flight at once.
+ *
+ * @param io The ranges.
+ * @param n Number of ranges.
+ *
+ * @return 0, or a negative errno if a read failed.
+ */
+int blocks_read(const blocks_io_t *io, int n);
+
+/**
+ * Write ranges of file data, all in one go. The blocks still need
+ * blocks_mark_dirty for writeback.
+ *
+ * @param io The ranges.
+ * @param n Number of ranges.
+ *
+ * @return 0, or a negative errno if a write failed.
+ */
+int blocks_write(const blocks_io_t *io, int n);
+
+/**
+ * Whether file data can be reached through the mapping too: true for the
+ * mmap engine. Other engines leave it to the page cache, where
+ * blocks_write and writes to blocks_get_fd() land the same.
+ */
+int blocks_data_mapped();
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
+ * The bitmap spans superblock->block_bitmap_blocks consecutive blocks.
+ *
  * @return A pointer to the beginning of the free blocks bitmap.
  */
 void *get_blocks_bitmap();
@@ -54,6 +189,8 @@ void *get_blocks_bitmap();
 /**
  * Return a pointer to the beginning of the inode table bitmap.
  *
+ * The bitmap spans superblock->inode_bitmap_blocks consecutive blocks.
+ *
  * @return A pointer to the beginning of the free inode bitmap.
  */
 void *get_inode_bitmap();
@@ -61,12 +198,63 @@ void *get_inode_bitmap();
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Next-fit: grabs the first unused data block at or after the place the
+ * previous allocation ended, wrapping around at the end of the disk.
  *
- * @return The index of the newly allocated block.
+ * @return The index of the newly allocated block, or -1 if the disk is full.
  */
 int alloc_block();
 
+/**
+ * Allocate a contiguous run of up to n blocks near a goal block.
+ *
+ * If the goal is free the run starts there. Otherwise the run is taken from
+ * the first free extent after the goal that can hold all n blocks, and if
+ * no extent is that large, from the largest one left.
+ *
+ * @param n Number of blocks wanted.
+ * @param goal Preferred first block, e.g. the block after a file's last one.
+ *             Out-of-range goals fall back to the next-fit cursor.
+ * @param got Set to the number of blocks allocated (1 to n).
+ *
+ * @return The first block of the run, or -1 if the disk is full.
+ */
+int alloc_blocks(int n, int goal, int *got);
+
+/**
+ * Allocate a block for directory entries or an extent-tree node.
+ *
+ * Comes from the metadata zone, which is journaled. The data area is never
+ * used: writes there reach the image before their transaction commits.
+ *
+ * @return The index of the newly allocated block, or -1 if the zone is full.
+ */
+int alloc_meta_block();
+
+/**
+ * Add a reference to each of a run of data blocks, which another file
+ * (or another place in the same file) is about to map as well. Call
+ * inside a journal handle.
+ *
+ * @param start The first block; every block of the run must be in use.
+ * @param n Number of blocks.
+ *
+ * @return 0, or -EMLINK if a block already has as many references as the
+ *         table can count; then none is added.
+ */
+int blocks_ref(int start, int n);
+
+/**
+ * How many references a data block has beyond the first. A block with
+ * any is shared, and must be copied before one of its files writes it.
+ *
+ * @param bnum The block number.
+ *
+ * @return The number of extra references, 0 for a block only one file
+ *         maps.
+ */
+int blocks_shared(int bnum);
+
 /**
  * Deallocate the block with the given number.
  *
@@ -74,4 +262,105 @@ int alloc_block();
  */
 void free_block(int bnum);
 
-#endif
\ No newline at end of file
+/**
+ * Deallocate a contiguous run of blocks.
+ *
+ * A shared block (see blocks_ref) only loses a reference; it is freed
+ * when its last one goes. Data blocks are marked free at once but are
+ * not handed out again until the transaction that freed them has
+ * committed (see blocks_release_frees) and no zero-copy read holds them
+ * (see blocks_hold), even if that leaves the disk full. Call inside a
+ * journal handle.
+ *
+ * @param start The first block to deallocate.
+ * @param n Number of blocks.
+ */
+void free_blocks(int start, int n);
+
+/**
+ * Whether freed data blocks are waiting to become available again. An
+ * allocation that failed may then succeed once the running transaction
+ * commits (see storage_fwrite).
+ *
+ * @return 1 if any are waiting, else 0.
+ */
+int blocks_frees_pending();
+
+/**
+ * Make the data blocks freed by transactions up to tid available again.
+ * The journal calls this once they have committed; blocks a zero-copy
+ * read holds wait until blocks_unhold.
+ *
+ * @param tid Id of the last committed transaction.
+ */
+void blocks_release_frees(uint64_t tid);
+
+/**
+ * Keep a run of data blocks from being handed out again while a reply
+ * still reads them after the file's lock is dropped. Holds belong to the
+ * calling thread and last until its next blocks_unhold, or until it
+ * exits. Call with the file locked, so its blocks can't be freed first.
+ *
+ * @param start The first block.
+ * @param len Number of blocks.
+ */
+void blocks_hold(uint32_t start, uint32_t len);
+
+/**
+ * Drop the calling thread's holds, once whatever read them is done.
+ */
+void blocks_unhold();
+
+/**
+ * Record that a file's data blocks were written.
+ *
+ * The blocks stay dirty until blocks_flush_inode, the writeback thread or
+ * blocks_stop_writeback writes them to the image.
+ *
+ * @param inum The file's inode number.
+ * @param start First block written.
+ * @param n Number of blocks.
+ */
+void blocks_mark_dirty(int inum, uint32_t start, uint32_t n);
+
+/**
+ * Write a file's dirty data blocks to the image and wait until they are
+ * on disk. Only data: metadata reaches the disk through the journal.
+ *
+ * @param inum The file's inode number.
+ *
+ * @return 0, or a negative errno if a write failed.
+ */
+int blocks_flush_inode(int inum);
+
+/**
+ * Have the writeback thread flush a file's dirty blocks now rather than
+ * when they expire.
+ *
+ * @param inum The file's inode number.
+ */
+void blocks_expire_inode(int inum);
+
+/**
+ * Forget a freed file's dirty blocks without writing them.
+ *
+ * @param inum The file's inode number.
+ */
+void blocks_forget_dirty(int inum);
+
+/**
+ * Start the writeback thread. It flushes a file's dirty blocks once they
+ * have been dirty for NUFS_DIRTY_EXPIRE_MS (default 30000), and the
+ * oldest files' blocks whenever more than NUFS_DIRTY_RATIO percent
+ * (default 10) of the data area is dirty.
+ */
+void blocks_start_writeback();
+
+/**
+ * Stop the writeback thread, if it runs, and flush every dirty block.
+ *
+ * @return 0, or a negative errno if a write failed.
+ */
+int blocks_stop_writeback();
+
+#endif
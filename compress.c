@@ -0,0 +1,351 @@
+// compress.c
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "compress.h"
+#include "extent.h"
+#include "inode.h"
+#include "journal.h"
+#include "stats.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+static uint32_t lz_hash(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write the rest of a length whose nibble is 15.
+static uint8_t *lz_put_len(uint8_t *op, size_t n) {
+  if (n < 15) {
+    return op;
+  }
+  for (n -= 15; n >= 255; n -= 255) {
+    *op++ = 255;
+  }
+  *op++ = n;
+  return op;
+}
+
+// Add to n the rest of a length whose nibble is 15.
+static int lz_get_len(const uint8_t **ip, const uint8_t *iend, size_t *n) {
+  if (*n < 15) {
+    return 0;
+  }
+  uint8_t b;
+  do {
+    if (*ip == iend) {
+      return -1;
+    }
+    b = *(*ip)++;
+    *n += b;
+  } while (b == 255);
+  return 0;
+}
+
+// Append one sequence: nlit literals, then a match of mlen bytes at off
+// back (none if mlen is 0). Returns the new end, or NULL if out of room.
+static uint8_t *lz_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+                            size_t nlit, size_t off, size_t mlen) {
+  size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+  size_t need = 1 + nlit / 255 + 1 + nlit + 2 + ml / 255 + 1;
+  if ((size_t) (oend - op) < need) {
+    return NULL;
+  }
+  *op++ = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+  op = lz_put_len(op, nlit);
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (mlen) {
+    *op++ = off & 0xff;
+    *op++ = off >> 8;
+    op = lz_put_len(op, ml);
+  }
+  return op;
+}
+
+// Compress n bytes of src into at most cap bytes of dst. Greedy: the
+// first earlier 4 bytes with the same hash is the match candidate.
+// Returns the compressed length, or 0 if it doesn't fit.
+static size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst,
+                          size_t cap) {
+  assert(n < 0xffff); // positions and offsets fit in 16 bits
+  uint16_t table[1 << LZ_HASH_BITS]; // position + 1, 0 for none
+  memset(table, 0, sizeof(table));
+  const uint8_t *ip = src, *anchor = src, *end = src + n;
+  uint8_t *op = dst, *oend = dst + cap;
+  while (ip + LZ_MIN_MATCH <= end) {
+    uint32_t h = lz_hash(ip);
+    const uint8_t *ref = table[h] ? src + table[h] - 1 : NULL;
+    table[h] = ip - src + 1;
+    if (!ref || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+      ip++;
+      continue;
+    }
+    size_t mlen = LZ_MIN_MATCH;
+    while (ip + mlen < end && ref[mlen] == ip[mlen]) {
+      mlen++;
+    }
+    op = lz_sequence(op, oend, anchor, ip - anchor, ip - ref, mlen);
+    if (!op) {
+      return 0;
+    }
+    ip += mlen;
+    anchor = ip;
+  }
+  op = lz_sequence(op, oend, anchor, end - anchor, 0, 0);
+  return op ? (size_t) (op - dst) : 0;
+}
+
+// Decompress len bytes of src into exactly n bytes of dst. Every length
+// and offset is checked, so a corrupt stream fails instead of overrunning.
+static int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                         size_t n) {
+  const uint8_t *ip = src, *iend = src + len;
+  uint8_t *op = dst, *oend = dst + n;
+  while (ip < iend) {
+    int token = *ip++;
+    size_t nlit = token >> 4;
+    if (lz_get_len(&ip, iend, &nlit) < 0 || nlit > (size_t) (iend - ip) ||
+        nlit > (size_t) (oend - op)) {
+      return -1;
+    }
+    memcpy(op, ip, nlit);
+    op += nlit;
+    ip += nlit;
+    if (ip == iend) {
+      break; // the last sequence has no match
+    }
+    if (iend - ip < 2) {
+      return -1;
+    }
+    size_t off = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t mlen = token & 15;
+    if (lz_get_len(&ip, iend, &mlen) < 0) {
+      return -1;
+    }
+    mlen += LZ_MIN_MATCH;
+    if (off == 0 || off > (size_t) (op - dst) || mlen > (size_t) (oend - op)) {
+      return -1;
+    }
+    // byte by byte: the match may overlap what it produces
+    const uint8_t *ref = op - off;
+    for (size_t i = 0; i < mlen; i++) {
+      op[i] = ref[i];
+    }
+    op += mlen;
+  }
+  return op == oend ? 0 : -1;
+}
+
+int compress_read_cluster(uint32_t pblk, uint16_t flags, char *buf) {
+  assert(flags & EXT_COMPRESSED);
+  uint32_t plen = flags & EXT_PLEN;
+  const uint8_t *data = blocks_get(pblk, plen);
+  if (!data) {
+    return -EIO;
+  }
+  uint32_t clen;
+  memcpy(&clen, data, sizeof(clen));
+  size_t room = (size_t) plen * BLOCK_SIZE - sizeof(clen);
+  int rv = 0;
+  if (clen > room || lz_decompress(data + sizeof(clen), clen, (uint8_t *) buf,
+                                   CLUSTER_SIZE) < 0) {
+    rv = -EIO;
+  }
+  blocks_put((void *) data, pblk, plen, 0);
+  return rv;
+}
+
+// Allocate n blocks in a row near goal, or return -1. alloc_blocks takes
+// a shorter run when the goal is free: look past it, then give it back.
+static int alloc_run(int n, int goal) {
+  int got;
+  int start = alloc_blocks(n, goal, &got);
+  if (start >= 0 && got < n) {
+    int short_start = start, short_got = got;
+    // the block after the short run is in use, so this finds a whole one
+    // if there is any
+    start = alloc_blocks(n, short_start + short_got, &got);
+    free_blocks(short_start, short_got);
+    if (start >= 0 && got < n) {
+      free_blocks(start, got);
+      start = -1;
+    }
+  }
+  return start;
+}
+
+// Compress cluster c of node if it is all plain and that saves a block.
+// buf and out are CLUSTER_SIZE scratch buffers. Nothing changes if
+// anything fails; the cluster just stays plain.
+static void compress_cluster(inode_t *node, uint32_t c, char *buf,
+                             char *out) {
+  uint32_t lblk = c * CLUSTER_BLOCKS;
+  uint32_t mapped = 0, goal = 0;
+  blocks_io_t io[CLUSTER_BLOCKS];
+  int nio = 0;
+  for (uint32_t b = 0; b < CLUSTER_BLOCKS;) {
+    uint32_t run;
+    uint16_t flags;
+    uint32_t bnum = extent_lookup_flags(&node->extents, lblk + b, &run, &flags);
+    if (flags & EXT_COMPRESSED) {
+      return;
+    }
+    if (run > CLUSTER_BLOCKS - b) {
+      run = CLUSTER_BLOCKS - b;
+    }
+    if (bnum == 0) {
+      memset(buf + (size_t) b * BLOCK_SIZE, 0, (size_t) run * BLOCK_SIZE);
+    } else {
+      blocks_io_t r = {bnum, 0, (size_t) run * BLOCK_SIZE,
+                       buf + (size_t) b * BLOCK_SIZE};
+      io[nio++] = r;
+      mapped += run;
+      goal = goal ? goal : bnum;
+    }
+    b += run;
+  }
+  // the length and the stream must fit in fewer blocks than are mapped
+  if (mapped < 2 || blocks_read(io, nio) < 0) {
+    return;
+  }
+  uint32_t clen = lz_compress((uint8_t *) buf, CLUSTER_SIZE,
+                              (uint8_t *) out + sizeof(clen),
+                              (size_t) (mapped - 1) * BLOCK_SIZE - sizeof(clen));
+  if (clen == 0) {
+    return;
+  }
+  memcpy(out, &clen, sizeof(clen));
+  int plen = bytes_to_blocks(sizeof(clen) + clen);
+  memset(out + sizeof(clen) + clen, 0,
+         (size_t) plen * BLOCK_SIZE - sizeof(clen) - clen);
+  int start = alloc_run(plen, goal);
+  if (start < 0) {
+    return;
+  }
+  // the data goes in before the extent points at it
+  blocks_io_t w = {start, 0, (size_t) plen * BLOCK_SIZE, out};
+  extent_t ext = {lblk, start, CLUSTER_BLOCKS, EXT_COMPRESSED | plen};
+  int freed = blocks_write(&w, 1);
+  if (freed == 0) {
+    freed = extent_remap(&node->extents, &ext, 1);
+  }
+  if (freed < 0) {
+    free_blocks(start, plen);
+    return;
+  }
+  blocks_mark_dirty(inode_get_inum(node), start, plen);
+  journal_dirty(node);
+  node->blocks += plen - freed;
+  stats_add(ST_CLUSTERS_COMPRESSED, 1);
+}
+
+// Only clusters wholly inside the file are compressed: the one holding
+// the end waits until it fills up.
+void compress_range(inode_t *node, int64_t offset, int64_t size) {
+  if (!(node->flags & INODE_COMPRESS) || inode_small_data(node) ||
+      size <= 0) {
+    return;
+  }
+  int64_t first = offset / CLUSTER_SIZE;
+  int64_t last = (offset + size - 1) / CLUSTER_SIZE;
+  int64_t full = node->size / CLUSTER_SIZE;
+  if (last >= full) {
+    last = full - 1;
+  }
+  if (first > last) {
+    return;
+  }
+  char *buf = malloc(2 * CLUSTER_SIZE);
+  for (int64_t c = first; c <= last; c++) {
+    compress_cluster(node, c, buf, buf + CLUSTER_SIZE);
+  }
+  free(buf);
+}
+
+// Replace the compressed cluster at lblk with plain blocks holding the
+// same data. The blocks come in as few runs as the free space allows.
+static int expand_cluster(inode_t *node, uint32_t lblk, uint32_t pblk,
+                          uint16_t flags) {
+  char *buf = malloc(CLUSTER_SIZE);
+  int rv = compress_read_cluster(pblk, flags, buf);
+  extent_t runs[CLUSTER_BLOCKS];
+  int n = 0;
+  uint32_t have = 0;
+  int goal = pblk;
+  while (rv == 0 && have < CLUSTER_BLOCKS) {
+    int got;
+    int start = alloc_blocks(CLUSTER_BLOCKS - have, goal, &got);
+    if (start < 0) {
+      rv = -ENOSPC;
+      break;
+    }
+    extent_t run = {lblk + have, start, got, 0};
+    runs[n++] = run;
+    have += got;
+    goal = start + got;
+  }
+  // the data goes in before the extents point at it
+  blocks_io_t io[CLUSTER_BLOCKS];
+  for (int i = 0; i < n; i++) {
+    blocks_io_t w = {runs[i].pblk, 0, (size_t) runs[i].len * BLOCK_SIZE,
+                     buf + (size_t) (runs[i].lblk - lblk) * BLOCK_SIZE};
+    io[i] = w;
+  }
+  if (rv == 0) {
+    rv = blocks_write(io, n);
+  }
+  int freed = rv == 0 ? extent_remap(&node->extents, runs, n) : rv;
+  if (freed < 0) {
+    for (int i = 0; i < n; i++) {
+      free_blocks(runs[i].pblk, runs[i].len);
+    }
+    free(buf);
+    return freed;
+  }
+  int inum = inode_get_inum(node);
+  for (int i = 0; i < n; i++) {
+    blocks_mark_dirty(inum, runs[i].pblk, runs[i].len);
+  }
+  journal_dirty(node);
+  node->blocks += CLUSTER_BLOCKS - freed;
+  stats_add(ST_CLUSTERS_EXPANDED, 1);
+  free(buf);
+  return 0;
+}
+
+int compress_expand(inode_t *node, int64_t offset, int64_t size) {
+  if (inode_small_data(node) || node->blocks == 0 || size <= 0) {
+    return 0;
+  }
+  // compressed extents start on cluster boundaries, and walking extent by
+  // extent from one lands on each of them
+  int64_t b = offset / CLUSTER_SIZE * CLUSTER_BLOCKS;
+  int64_t end = bytes_to_blocks(offset + size);
+  if (end > UINT32_MAX) {
+    end = UINT32_MAX;
+  }
+  while (b < end) {
+    uint32_t run;
+    uint16_t flags;
+    uint32_t pblk = extent_lookup_flags(&node->extents, b, &run, &flags);
+    if (flags & EXT_COMPRESSED) {
+      assert(b % CLUSTER_BLOCKS == 0);
+      int rv = expand_cluster(node, b, pblk, flags);
+      if (rv < 0) {
+        return rv;
+      }
+      b += CLUSTER_BLOCKS;
+    } else {
+      b += run;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,55 @@
+/**
+ * Transparent compression of file data, one cluster at a time.
+ *
+ * A file marked INODE_COMPRESS (chattr +c, or created in a directory that
+ * is) has its data compressed in clusters of CLUSTER_BLOCKS blocks. A
+ * cluster is compressed once a write has filled it, and only if that
+ * saves at least a block; it is then mapped by a single compressed extent
+ * (EXT_COMPRESSED, see extent.h), so the cluster map is the file's extent
+ * tree itself. Reads decompress just the clusters they touch; a write
+ * into a compressed cluster expands it back into plain blocks first.
+ *
+ * On disk a compressed cluster is a 32-bit length followed by that many
+ * bytes of an LZ4-style stream: a token byte with the literal count in
+ * the high nibble and the match length - 4 in the low nibble (15 in
+ * either goes on in 255-byte steps), the literals, then a 2-byte
+ * little-endian match offset. The last sequence has literals only.
+ */
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+#define CLUSTER_BLOCKS 4
+#define CLUSTER_SIZE ((int64_t) CLUSTER_BLOCKS * BLOCK_SIZE)
+
+/**
+ * Decompress a cluster.
+ *
+ * @param pblk First block of the compressed data.
+ * @param flags Flags of the extent mapping it.
+ * @param buf Set to the CLUSTER_SIZE bytes of the cluster.
+ *
+ * @return 0, or -EIO if the data is corrupt.
+ */
+int compress_read_cluster(uint32_t pblk, uint16_t flags, char *buf);
+
+/**
+ * Compress the full clusters of a file that [offset, offset+size)
+ * touches and that would save space. Clusters already compressed are left
+ * alone. Call with the inode locked for writing, inside a journal handle.
+ */
+void compress_range(inode_t *node, int64_t offset, int64_t size);
+
+/**
+ * Turn the compressed clusters [offset, offset+size) touches back into
+ * plain blocks, so the range can be written in place. Call with the
+ * inode locked for writing, inside a journal handle.
+ *
+ * @return 0, -ENOSPC, or -EIO if a cluster is corrupt.
+ */
+int compress_expand(inode_t *node, int64_t offset, int64_t size);
+
+#endif
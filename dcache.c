@@ -0,0 +1,121 @@
+/**
+ * In-memory dentry cache for path resolution.
+ *
+ * A fixed-size, 4-way set-associative table. Each (parent, name) pair can
+ * only live in one set, so a lookup is one hash plus at most four string
+ * compares, and nothing is allocated after startup. When a set is full
+ * the slots are replaced round-robin. Sets are guarded by a smaller array
+ * of mutexes, so threads resolving different names rarely contend.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "directory.h"
+
+#define DCACHE_SETS 16384
+#define DCACHE_WAYS 4
+#define DCACHE_LOCKS 256 // set s is guarded by dcache_locks[s % DCACHE_LOCKS]
+
+typedef struct dcache_entry {
+  uint32_t hash;  // hash of (parent, name); 0 marks an empty slot
+  int parent;     // inode number of the directory
+  int inum;       // child inode number, -1 for a negative entry
+  char name[DIR_NAME_LENGTH];
+  char _reserved[4];
+} dcache_entry_t;
+
+typedef struct dcache_set {
+  dcache_entry_t ways[DCACHE_WAYS];
+} dcache_set_t;
+
+static dcache_set_t dcache[DCACHE_SETS];
+static uint8_t dcache_victim[DCACHE_SETS]; // next way to replace in each set
+static pthread_mutex_t dcache_locks[DCACHE_LOCKS];
+
+// Set up the set locks.
+void dcache_init() {
+  for (int i = 0; i < DCACHE_LOCKS; i++) {
+    pthread_mutex_init(&dcache_locks[i], NULL);
+  }
+}
+
+// Hash a (parent, name) pair; never returns 0.
+static uint32_t dcache_hash(int parent, const char *name) {
+  uint32_t h = 2166136261u ^ (uint32_t) parent * 0x9e3779b1u;
+  for (const unsigned char *p = (const unsigned char *) name; *p; p++) {
+    h ^= *p;
+    h *= 16777619u;
+  }
+  h ^= h >> 15;
+  return h ? h : 1;
+}
+
+// Find the slot holding (parent, name) in its set, or NULL.
+static dcache_entry_t *dcache_find(dcache_set_t *set, uint32_t hash,
+                                   int parent, const char *name) {
+  for (int i = 0; i < DCACHE_WAYS; i++) {
+    dcache_entry_t *e = &set->ways[i];
+    if (e->hash == hash && e->parent == parent && strcmp(e->name, name) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+// Look up a name in the cache.
+int dcache_lookup(int parent, const char *name, int *inum_out) {
+  uint32_t hash = dcache_hash(parent, name);
+  uint32_t idx = hash % DCACHE_SETS;
+  pthread_mutex_lock(&dcache_locks[idx % DCACHE_LOCKS]);
+  dcache_entry_t *e = dcache_find(&dcache[idx], hash, parent, name);
+  if (e) {
+    *inum_out = e->inum;
+  }
+  pthread_mutex_unlock(&dcache_locks[idx % DCACHE_LOCKS]);
+  return e != NULL;
+}
+
+// Record the result of a directory lookup.
+void dcache_insert(int parent, const char *name, int inum) {
+  if (parent < 0 || strlen(name) >= DIR_NAME_LENGTH) {
+    return;
+  }
+  uint32_t hash = dcache_hash(parent, name);
+  uint32_t idx = hash % DCACHE_SETS;
+  dcache_set_t *set = &dcache[idx];
+  pthread_mutex_lock(&dcache_locks[idx % DCACHE_LOCKS]);
+
+  dcache_entry_t *e = dcache_find(set, hash, parent, name);
+  if (!e) {
+    // prefer an empty slot, else evict round-robin
+    for (int i = 0; i < DCACHE_WAYS && !e; i++) {
+      if (set->ways[i].hash == 0) {
+        e = &set->ways[i];
+      }
+    }
+    if (!e) {
+      e = &set->ways[dcache_victim[idx]];
+      dcache_victim[idx] = (dcache_victim[idx] + 1) % DCACHE_WAYS;
+    }
+    e->hash = hash;
+    e->parent = parent;
+    strcpy(e->name, name);
+  }
+  e->inum = inum < 0 ? -1 : inum;
+  pthread_mutex_unlock(&dcache_locks[idx % DCACHE_LOCKS]);
+}
+
+// Drop every entry cached under the given directory.
+void dcache_purge_dir(int parent) {
+  for (int s = 0; s < DCACHE_SETS; s++) {
+    pthread_mutex_lock(&dcache_locks[s % DCACHE_LOCKS]);
+    for (int i = 0; i < DCACHE_WAYS; i++) {
+      if (dcache[s].ways[i].hash && dcache[s].ways[i].parent == parent) {
+        dcache[s].ways[i].hash = 0;
+      }
+    }
+    pthread_mutex_unlock(&dcache_locks[s % DCACHE_LOCKS]);
+  }
+}
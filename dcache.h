@@ -0,0 +1,44 @@
+/**
+ * In-memory dentry cache for path resolution.
+ *
+ * Maps (parent directory inode, name) to the child inode number. Misses
+ * that the directory confirms are cached too, as negative entries, so
+ * repeated lookups of names that don't exist are also cheap.
+ */
+#ifndef DCACHE_H
+#define DCACHE_H
+
+/**
+ * Set up the cache's locks. Call once, before any other thread starts.
+ */
+void dcache_init();
+
+/**
+ * Look up a name in the cache.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Name of the entry.
+ * @param inum_out Set to the cached inode number, or -1 for a negative entry.
+ *
+ * @return 1 on a hit (positive or negative), 0 on a miss.
+ */
+int dcache_lookup(int parent, const char *name, int *inum_out);
+
+/**
+ * Record the result of a directory lookup.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Name of the entry.
+ * @param inum Inode number the name maps to, or -1 if it does not exist.
+ */
+void dcache_insert(int parent, const char *name, int inum);
+
+/**
+ * Drop every entry cached under the given directory, e.g. when it is
+ * removed and its inode number may be reused.
+ *
+ * @param parent Inode number of the directory.
+ */
+void dcache_purge_dir(int parent);
+
+#endif
@@ -0,0 +1,173 @@
+// dedup.c
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "dedup.h"
+#include "extent.h"
+#include "inode.h"
+#include "journal.h"
+#include "stats.h"
+
+#define DEDUP_MAX_SLOTS (1 << 20)
+#define DEDUP_WAYS 4 // entries per bucket, most recently indexed first
+
+typedef struct dedup_entry {
+  uint64_t hash;
+  uint32_t bnum; // 0 for an empty slot
+} dedup_entry_t;
+
+static dedup_entry_t *dd_table; // NULL when dedup is off
+static uint32_t dd_mask;        // buckets - 1
+// A bit per block, set while the block's entry can be trusted to name a
+// file's data block: it is cleared when the block is freed or is about to
+// be written in place. Entries for a block whose bit is clear are stale.
+static uint8_t *dd_indexed;
+// Guards dd_table and dd_indexed, and keeps a block from being written in
+// place between a lookup comparing it and blocks_ref sharing it
+static pthread_mutex_t dd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 64-bit hash of a block's contents: four independent multiply-xor lanes,
+// so the multiplies overlap, folded together at the end.
+static uint64_t block_hash(const void *block) {
+  const uint64_t *w = block;
+  uint64_t h[4] = {0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+                   0x165667b19e3779f9ULL, 0x27d4eb2f165667c5ULL};
+  for (size_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i += 4) {
+    for (int j = 0; j < 4; j++) {
+      uint64_t v;
+      memcpy(&v, &w[i + j], sizeof(v));
+      h[j] = (h[j] ^ v) * 0x100000001b3ULL;
+      h[j] ^= h[j] >> 29;
+    }
+  }
+  uint64_t r = h[0] ^ (h[1] * 31) ^ (h[2] * 961) ^ (h[3] * 29791);
+  r ^= r >> 33;
+  r *= 0xff51afd7ed558ccdULL;
+  return r ^ (r >> 33);
+}
+
+void dedup_init() {
+  const char *env = getenv("NUFS_DEDUP");
+  if (!env || atoi(env) <= 0) {
+    return;
+  }
+  superblock_t *sb = blocks_get_superblock();
+  // a slot per data block, up to DEDUP_MAX_SLOTS
+  uint32_t slots = 1024;
+  while (slots < sb->block_count - sb->data_start && slots < DEDUP_MAX_SLOTS) {
+    slots *= 2;
+  }
+  dd_table = calloc(slots, sizeof(dedup_entry_t));
+  dd_mask = slots / DEDUP_WAYS - 1;
+  dd_indexed = calloc((sb->block_count + 7) / 8, 1);
+  printf("+ dedup on: %u index slots\n", slots);
+}
+
+void dedup_free() {
+  free(dd_table);
+  free(dd_indexed);
+  dd_table = NULL;
+  dd_indexed = NULL;
+}
+
+void dedup_forget(uint32_t start, uint32_t n) {
+  if (!dd_table) {
+    return;
+  }
+  pthread_mutex_lock(&dd_lock);
+  for (uint32_t b = start; b < start + n; b++) {
+    bitmap_put(dd_indexed, b, 0);
+  }
+  pthread_mutex_unlock(&dd_lock);
+}
+
+// Look the block at bnum up in the index. Returns an indexed block with
+// the same contents, with a reference added for the caller, or 0 after
+// indexing bnum itself, in place of its bucket's oldest entry.
+static uint32_t dedup_lookup(uint32_t bnum) {
+  void *data = blocks_get(bnum, 1);
+  if (!data) {
+    return 0;
+  }
+  uint64_t hash = block_hash(data);
+  uint32_t match = 0;
+  pthread_mutex_lock(&dd_lock);
+  dedup_entry_t *bucket = &dd_table[(hash & dd_mask) * DEDUP_WAYS];
+  for (int i = 0; i < DEDUP_WAYS && !match; i++) {
+    dedup_entry_t *e = &bucket[i];
+    if (e->bnum == 0 || e->bnum == bnum || e->hash != hash ||
+        !bitmap_get(dd_indexed, e->bnum)) {
+      continue;
+    }
+    void *other = blocks_get(e->bnum, 1);
+    if (other && memcmp(other, data, BLOCK_SIZE) == 0 &&
+        blocks_ref(e->bnum, 1) == 0) {
+      match = e->bnum;
+    }
+    if (other) {
+      blocks_put(other, e->bnum, 1, 0);
+    }
+  }
+  if (!match) {
+    memmove(&bucket[1], &bucket[0], (DEDUP_WAYS - 1) * sizeof(dedup_entry_t));
+    bucket[0].hash = hash;
+    bucket[0].bnum = bnum;
+    bitmap_put(dd_indexed, bnum, 1);
+  }
+  pthread_mutex_unlock(&dd_lock);
+  blocks_put(data, bnum, 1, 0);
+  return match;
+}
+
+// Map the n blocks at lblk to the blocks at pblk, which already carry a
+// reference for them, freeing the file's own copies.
+static void dedup_remap(inode_t *node, uint32_t lblk, uint32_t pblk,
+                        uint32_t n) {
+  extent_t ext = {lblk, pblk, n, 0};
+  int freed = extent_remap(&node->extents, &ext, 1);
+  if (freed < 0) {
+    // keep the file's copies; the references go back
+    free_blocks(pblk, n);
+    return;
+  }
+  journal_dirty(node);
+  node->blocks += n - freed;
+  stats_add(ST_DEDUP_BLOCKS, n);
+  journal_restart();
+}
+
+// Matches for consecutive blocks that are consecutive on disk too are
+// remapped together, as one extent.
+void dedup_write(inode_t *node, int64_t offset, int64_t size) {
+  if (!dd_table || (node->flags & INODE_COMPRESS) || inode_small_data(node) ||
+      size <= 0) {
+    return;
+  }
+  int64_t b = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  int64_t end = (offset + size) / BLOCK_SIZE;
+  uint32_t run_lblk = 0, run_pblk = 0, run_len = 0;
+  for (; b < end; b++) {
+    uint32_t bnum = extent_lookup(&node->extents, b, NULL);
+    uint32_t match = bnum ? dedup_lookup(bnum) : 0;
+    if (run_len > 0 &&
+        (!match || b != run_lblk + run_len || match != run_pblk + run_len ||
+         run_len == EXT_MAX_LEN)) {
+      dedup_remap(node, run_lblk, run_pblk, run_len);
+      run_len = 0;
+    }
+    if (match) {
+      if (run_len == 0) {
+        run_lblk = b;
+        run_pblk = match;
+      }
+      run_len++;
+    }
+  }
+  if (run_len > 0) {
+    dedup_remap(node, run_lblk, run_pblk, run_len);
+  }
+}
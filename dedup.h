@@ -0,0 +1,52 @@
+/**
+ * Inline deduplication of file data blocks.
+ *
+ * Mounting with NUFS_DEDUP=1 keeps an in-memory index from the content
+ * hash of recently written data blocks to the block holding that content.
+ * Every whole block a write fills is looked up there; when an indexed
+ * block has the same bytes, the file maps that block instead (with one
+ * more reference, see blocks_ref) and its own copy is freed. Otherwise the
+ * block goes into the index. The index is a fixed-size table where a new
+ * entry replaces whatever hashed to the same slot, and starts empty at
+ * every mount: it finds the duplicates among data written close together.
+ *
+ * A shared block is never written in place; a write copies it first
+ * (inode_unshare). A block a file is about to write in place is taken out
+ * of the index, under the same lock lookups hold, so it can't become
+ * shared in the middle of the write.
+ */
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+/**
+ * Set up the index if NUFS_DEDUP asks for it. Call after blocks_init.
+ */
+void dedup_init();
+
+/**
+ * Drop the index, when the image is closed.
+ */
+void dedup_free();
+
+/**
+ * Share the whole blocks [offset, offset+size) of a file has just written
+ * with indexed blocks holding the same data, and index the rest. Call with
+ * the inode locked for writing, inside a journal handle, before anything
+ * else (e.g. compress_range) remaps them.
+ */
+void dedup_write(inode_t *node, int64_t offset, int64_t size);
+
+/**
+ * Take a run of blocks out of the index, because they are about to be
+ * written in place or freed.
+ *
+ * @param start The first block.
+ * @param n Number of blocks.
+ */
+void dedup_forget(uint32_t start, uint32_t n);
+
+#endif
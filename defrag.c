@@ -0,0 +1,255 @@
+// defrag.c
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "compress.h"
+#include "defrag.h"
+#include "extent.h"
+#include "inode.h"
+#include "journal.h"
+#include "stats.h"
+
+// Blocks of the disk an extent takes
+static uint32_t ext_plen(const extent_t *ext) {
+  return ext->flags & EXT_COMPRESSED ? (uint32_t) (ext->flags & EXT_PLEN)
+                                     : ext->len;
+}
+
+void defrag_measure(inode_t *node, uint32_t *extents, uint32_t *frags) {
+  *extents = 0;
+  *frags = 0;
+  if (inode_small_data(node) || node->blocks == 0) {
+    return;
+  }
+  *extents = extent_count(&node->extents);
+  int64_t end = bytes_to_blocks(node->size);
+  uint32_t next = 0; // the block after the previous fragment
+  for (int64_t b = 0; b < end;) {
+    uint32_t run;
+    uint16_t flags;
+    uint32_t pblk = extent_lookup_flags(&node->extents, b, &run, &flags);
+    if (pblk != 0) {
+      if (pblk != next) {
+        (*frags)++;
+      }
+      extent_t ext = {b, pblk, run, flags};
+      next = pblk + ext_plen(&ext);
+    }
+    b += run;
+  }
+}
+
+// Collect the pieces of the span at lblk that defrag_file can move:
+// plain runs and whole compressed clusters that no other file maps, with
+// no hole between them, up to DEFRAG_CHUNK blocks of the disk. Returns
+// how many, and sets *plen to the blocks they take.
+static int movable_span(inode_t *node, uint32_t lblk, int64_t end,
+                        extent_t *piece, uint32_t *plen) {
+  int n = 0;
+  *plen = 0;
+  while (lblk < end && *plen < DEFRAG_CHUNK) {
+    uint32_t run;
+    uint16_t flags;
+    uint32_t pblk = extent_lookup_flags(&node->extents, lblk, &run, &flags);
+    if (pblk == 0) {
+      break;
+    }
+    uint32_t len = run, own = 0;
+    if (flags & EXT_COMPRESSED) {
+      len = flags & EXT_PLEN;
+      if (run != CLUSTER_BLOCKS || *plen + len > DEFRAG_CHUNK) {
+        break;
+      }
+    } else {
+      if (len > end - lblk) {
+        len = end - lblk;
+      }
+      if (len > DEFRAG_CHUNK - *plen) {
+        len = DEFRAG_CHUNK - *plen;
+      }
+    }
+    while (own < len && !blocks_shared(pblk + own)) {
+      own++;
+    }
+    if (own == 0 || ((flags & EXT_COMPRESSED) && own < len)) {
+      break;
+    }
+    extent_t ext = {lblk, pblk, flags & EXT_COMPRESSED ? run : own, flags};
+    piece[n++] = ext;
+    *plen += own;
+    lblk += ext.len;
+    if (own < len) {
+      break; // a shared block
+    }
+  }
+  return n;
+}
+
+// Allocate the longest run of up to n blocks near goal that alloc_blocks
+// can find: a free goal may give a short run when a longer one is free
+// further on.
+static int alloc_longest(uint32_t n, uint32_t goal, int *got) {
+  int start = alloc_blocks(n, goal, got);
+  if (start >= 0 && (uint32_t) *got < n) {
+    int more;
+    int other = alloc_blocks(n, start + *got, &more);
+    if (other >= 0 && more > *got) {
+      free_blocks(start, *got);
+      start = other;
+      *got = more;
+    } else if (other >= 0) {
+      free_blocks(other, more);
+    }
+  }
+  return start;
+}
+
+// Copy the n blocks at from to the run at to.
+static int copy_blocks(uint32_t from, uint32_t to, uint32_t n) {
+  void *data = blocks_get(from, n);
+  if (!data) {
+    return -EIO;
+  }
+  blocks_io_t io = {to, 0, (size_t) n * BLOCK_SIZE, data};
+  int rv = blocks_write(&io, 1);
+  blocks_put(data, from, n, 0);
+  return rv;
+}
+
+// Copy the n pieces, which fit in the run at start, there, write the
+// copies to the image, then map them in place of the originals: a few
+// extents at a time, each batch in one extent_remap.
+static int move_pieces(inode_t *node, extent_t *piece, int n, uint32_t start) {
+  int inum = inode_get_inum(node);
+  uint32_t at = start;
+  int m = 0; // the new extents, adjacent plain pieces merged
+  int rv = 0;
+  for (int i = 0; i < n; i++) {
+    uint32_t plen = ext_plen(&piece[i]);
+    if (rv == 0) {
+      rv = copy_blocks(piece[i].pblk, at, plen);
+    }
+    piece[i].pblk = at;
+    at += plen;
+    if (m > 0 && !(piece[i].flags & EXT_COMPRESSED) &&
+        !(piece[m - 1].flags & EXT_COMPRESSED) &&
+        piece[m - 1].len + piece[i].len <= EXT_MAX_LEN) {
+      piece[m - 1].len += piece[i].len;
+    } else {
+      piece[m++] = piece[i];
+    }
+  }
+  if (rv < 0) {
+    free_blocks(start, at - start);
+    return rv;
+  }
+  blocks_mark_dirty(inum, start, at - start);
+  // a commit must never map blocks whose data is not on disk yet
+  rv = blocks_flush_inode(inum);
+  for (int i = 0; i < m; i += EXT_REMAP_MAX) {
+    int k = m - i < EXT_REMAP_MAX ? m - i : EXT_REMAP_MAX;
+    uint32_t plen = 0;
+    for (int j = i; j < i + k; j++) {
+      plen += ext_plen(&piece[j]);
+    }
+    int freed = rv < 0 ? rv : extent_remap(&node->extents, &piece[i], k);
+    if (freed < 0) {
+      // give back the copies not mapped
+      free_blocks(piece[i].pblk, at - piece[i].pblk);
+      return freed;
+    }
+    journal_dirty(node);
+    node->blocks += plen - freed;
+    stats_add(ST_DEFRAG_BLOCKS, plen);
+    journal_restart();
+  }
+  return 0;
+}
+
+// Spans already in one run are left alone, and so is the start of a span
+// when the free run found for it holds no more than its first run.
+int defrag_file(inode_t *node, uint32_t *moved) {
+  *moved = 0;
+  if (inode_small_data(node) || node->blocks == 0) {
+    return 0;
+  }
+  extent_t *piece = malloc(DEFRAG_CHUNK * sizeof(extent_t));
+  int64_t end = bytes_to_blocks(node->size);
+  uint32_t goal = 0; // where the next run should start to follow on
+  int rv = 0;
+  for (int64_t b = 0; b < end && rv == 0;) {
+    uint32_t plen;
+    int n = movable_span(node, b, end, piece, &plen);
+    if (n == 0) {
+      // a hole, or shared blocks
+      uint32_t run;
+      uint16_t flags;
+      uint32_t pblk = extent_lookup_flags(&node->extents, b, &run, &flags);
+      if (pblk != 0 && !(flags & EXT_COMPRESSED)) {
+        run = 1;
+      }
+      extent_t ext = {b, pblk, run, flags};
+      goal = pblk != 0 ? pblk + ext_plen(&ext) : goal;
+      b += run;
+      continue;
+    }
+    if (goal == 0) {
+      goal = piece[0].pblk;
+    }
+    // runs on the disk the span is in now
+    int frags = 0;
+    for (uint32_t i = 0, next = 0; i < (uint32_t) n; i++) {
+      frags += piece[i].pblk != next;
+      next = piece[i].pblk + ext_plen(&piece[i]);
+    }
+    int got = 0, start = -1, fit = 0;
+    uint32_t used = 0;
+    if (frags > 1) {
+      start = alloc_longest(plen, goal, &got);
+      if (start < 0) {
+        break; // no free space to move into
+      }
+      // take the pieces that fit, cutting the last one if it is plain,
+      // and count again for just those
+      frags = 0;
+      for (uint32_t next = 0; fit < n; fit++) {
+        uint32_t p = ext_plen(&piece[fit]);
+        if (used + p > (uint32_t) got) {
+          if (!(piece[fit].flags & EXT_COMPRESSED) && used < (uint32_t) got) {
+            piece[fit].len = got - used;
+            frags += piece[fit].pblk != next;
+            used = got;
+            fit++;
+          }
+          break;
+        }
+        frags += piece[fit].pblk != next;
+        next = piece[fit].pblk + p;
+        used += p;
+      }
+      if (used < (uint32_t) got) {
+        free_blocks(start + used, got - used);
+      }
+    }
+    if (frags < 2) {
+      // nothing to gain: step past the first piece
+      if (used > 0) {
+        free_blocks(start, used);
+        journal_restart();
+      }
+      b = piece[0].lblk + piece[0].len;
+      goal = piece[0].pblk + ext_plen(&piece[0]);
+      continue;
+    }
+    b = piece[fit - 1].lblk + piece[fit - 1].len;
+    rv = move_pieces(node, piece, fit, start);
+    if (rv == 0) {
+      *moved += used;
+      goal = start + used;
+    }
+  }
+  free(piece);
+  return rv;
+}
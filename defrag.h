@@ -0,0 +1,50 @@
+/**
+ * Defragmentation of file data.
+ *
+ * A file is in fragments when reading it from start to end has to jump
+ * around the disk: each time the next mapped block is not the one after
+ * the previous, a new fragment starts. Blocks allocated by many small
+ * writes interleaved with other files', or freed and reused by churn, end
+ * up like that; sequential reads then lose readahead and touch scattered
+ * pages of the mapping.
+ *
+ * defrag_file moves a file's blocks, and its compressed clusters whole,
+ * into contiguous free runs, a span of up to DEFRAG_CHUNK blocks at a
+ * time. The copy is written to the image before extent_remap swaps it in
+ * (a few extents per call), so after a crash each part of the file maps
+ * either the old blocks or the new, both intact; the old ones are freed
+ * with the remap and not reused before it commits. Blocks shared with
+ * other files (blocks_ref) stay where they are: moving them would unshare
+ * them.
+ */
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+#define DEFRAG_CHUNK 1024 // most blocks copied before a flush and a remap
+
+/**
+ * Measure how fragmented a file is. Call with the inode locked.
+ *
+ * @param extents Set to the number of extents in its tree.
+ * @param frags Set to the number of fragments, 0 for a file without
+ *              blocks of its own.
+ */
+void defrag_measure(inode_t *node, uint32_t *extents, uint32_t *frags);
+
+/**
+ * Move a regular file's blocks into as few runs as free space allows.
+ * Call with the inode locked for writing, inside a journal handle.
+ *
+ * @param moved Set to the number of blocks moved.
+ *
+ * @return 0, or a negative errno if a flush or remap failed; what was
+ *         moved before that stays moved. Running out of free runs is not
+ *         an error, just the end of what can be done.
+ */
+int defrag_file(inode_t *node, uint32_t *moved);
+
+#endif
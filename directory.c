@@ -1,72 +1,380 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h> //include this import to return errors so fuse can recognise failures (would just read 1 as a number of bytes)
 #include "directory.h"
+#include "dcache.h"
 #include "blocks.h"
 #include "inode.h"  // for inode_get_bnum
+#include "journal.h"
+#include "stats.h"
 
-// Look up a file name inside a given inode
-int directory_lookup(inode_t *dd, const char *name) {
-  if (!dd) {
-    return -1;
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / sizeof(dirent_t))
+#define DX_ENTRIES_PER_BLOCK ((BLOCK_SIZE - sizeof(dx_node_t)) / sizeof(dx_entry_t))
+
+// Hash a name for the directory index (FNV-1a with a final avalanche).
+static uint32_t dx_hash(const char *name) {
+  uint32_t h = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *) name; *p; p++) {
+    h ^= *p;
+    h *= 16777619u;
   }
-  int bnum = inode_get_bnum(dd, 0);
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  return h;
+}
+
+// Get a pointer to the given logical block of a directory.
+static void *dir_block(inode_t *dd, int lblk) {
+  int bnum = inode_get_bnum(dd, lblk);
   if (bnum <= 0) {
+    return NULL;
+  }
+  return blocks_get_block(bnum);
+}
+
+// Append a zeroed block to an indexed directory, returning its logical number.
+static int dir_append_block(inode_t *dd) {
+  int lblk = dd->size / BLOCK_SIZE;
+  int rv = grow_inode(dd, dd->size + BLOCK_SIZE);
+  if (rv < 0) {
+    return rv;
+  }
+  void *block = dir_block(dd, lblk);
+  journal_dirty(block);
+  memset(block, 0, BLOCK_SIZE);
+  return lblk;
+}
+
+// Find the entry in an index node that covers the given hash.
+static int dx_search(dx_node_t *node, uint32_t hash) {
+  int lo = 1, hi = node->count - 1, pos = 0;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (node->entries[mid].hash <= hash) {
+      pos = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return pos;
+}
+
+// Insert (hash, block) into an index node right after position pos.
+static void dx_insert(dx_node_t *node, int pos, uint32_t hash, uint32_t block) {
+  journal_dirty(node);
+  memmove(&node->entries[pos + 2], &node->entries[pos + 1],
+          (node->count - pos - 1) * sizeof(dx_entry_t));
+  node->entries[pos + 1].hash = hash;
+  node->entries[pos + 1].block = block;
+  node->count++;
+}
+
+// Path from the root of an indexed directory down to the leaf for a hash.
+typedef struct dx_path {
+  dx_node_t *node[2]; // root, then the index block (if levels == 1)
+  int pos[2];         // chosen entry in each node
+  int depth;          // number of nodes in the path
+  int leaf;           // logical block of the leaf
+} dx_path_t;
+
+static int dx_walk(inode_t *dd, uint32_t hash, dx_path_t *path) {
+  dx_node_t *node = dir_block(dd, 0);
+  if (!node) {
     return -1;
   }
-  dirent_t *entries = (dirent_t *) blocks_get_block(bnum);
-  int n_entries = dd->size / sizeof(dirent_t);
+  int levels = node->levels;
+  path->depth = 0;
+  for (;;) {
+    int pos = dx_search(node, hash);
+    path->node[path->depth] = node;
+    path->pos[path->depth] = pos;
+    path->depth++;
+    int next = node->entries[pos].block;
+    if (path->depth > levels) {
+      path->leaf = next;
+      return 0;
+    }
+    node = dir_block(dd, next);
+    if (!node) {
+      return -1;
+    }
+  }
+}
 
-  for (int i = 0; i < n_entries; i++) {
+// Find a used entry with the given name in an array of dirents.
+static dirent_t *dirents_find(dirent_t *entries, int n, const char *name) {
+  for (int i = 0; i < n; i++) {
     if (entries[i].used && strcmp(entries[i].name, name) == 0) {
-      return entries[i].inum;
+      stats_add(ST_DIRENTS_SCANNED, i + 1);
+      return &entries[i];
     }
   }
+  stats_add(ST_DIRENTS_SCANNED, n);
+  return NULL;
+}
 
-  return -1;
+// Fill in a dirent slot.
+static void dirent_set(dirent_t *entry, const char *name, int inum) {
+  journal_dirty(entry);
+  strncpy(entry->name, name, DIR_NAME_LENGTH);
+  entry->name[DIR_NAME_LENGTH - 1] = '\0';
+  entry->inum = inum;
+  entry->used = 1;
 }
 
-// Add to the directory
-int directory_put(inode_t *dd, const char *name, int inum) {
-  if (!dd || strlen(name) >= DIR_NAME_LENGTH) {
+// Locate the dirent for name, or NULL.
+static dirent_t *dirent_lookup(inode_t *dd, const char *name) {
+  if (dd->flags & INODE_DIR_INDEXED) {
+    dx_path_t path;
+    if (dx_walk(dd, dx_hash(name), &path) < 0) {
+      return NULL;
+    }
+    dirent_t *leaf = dir_block(dd, path.leaf);
+    return leaf ? dirents_find(leaf, DIRENTS_PER_BLOCK, name) : NULL;
+  }
+
+  dirent_t *entries = dir_block(dd, 0);
+  if (!entries) {
+    return NULL;
+  }
+  return dirents_find(entries, dd->size / sizeof(dirent_t), name);
+}
+
+// Look up a file name inside a given inode
+int directory_lookup(inode_t *dd, const char *name) {
+  if (!dd) {
     return -1;
   }
-  if (directory_lookup(dd, name) >= 0) {
-    return -EEXIST;
+  dirent_t *entry = dirent_lookup(dd, name);
+  return entry ? entry->inum : -1;
+}
+
+static int cmp_dirent_hash(const void *a, const void *b) {
+  uint32_t ha = dx_hash(((const dirent_t *) a)->name);
+  uint32_t hb = dx_hash(((const dirent_t *) b)->name);
+  return ha < hb ? -1 : ha > hb;
+}
+
+// Sort the used entries of a full leaf by hash and move the upper half into
+// a new leaf, keeping names with equal hashes together. Stores the first
+// hash of the new leaf in *split_hash and returns its logical block.
+static int dx_split_leaf(inode_t *dd, int lblk, uint32_t *split_hash) {
+  dirent_t *tmp = malloc(BLOCK_SIZE);
+  memcpy(tmp, dir_block(dd, lblk), BLOCK_SIZE);
+  int n = 0;
+  for (int i = 0; i < (int) DIRENTS_PER_BLOCK; i++) {
+    if (tmp[i].used) {
+      tmp[n++] = tmp[i];
+    }
   }
+  qsort(tmp, n, sizeof(dirent_t), cmp_dirent_hash);
 
-  int bnum = inode_get_bnum(dd, 0);
-  if (bnum <= 0) {
-    bnum = alloc_block();
-    if (bnum < 0) {
-      return -ENOSPC;
+  // pick the split point nearest the middle that falls between two hashes
+  int split = -1;
+  for (int d = 0; d < n / 2 && split < 0; d++) {
+    int cands[2] = {n / 2 + d, n / 2 - d};
+    for (int c = 0; c < 2; c++) {
+      int m = cands[c];
+      if (m > 0 && m < n &&
+          dx_hash(tmp[m].name) != dx_hash(tmp[m - 1].name)) {
+        split = m;
+        break;
+      }
+    }
+  }
+  if (split < 0) {
+    free(tmp);
+    return -ENOSPC;
+  }
+
+  int new_lblk = dir_append_block(dd);
+  if (new_lblk < 0) {
+    free(tmp);
+    return new_lblk;
+  }
+  dirent_t *old_leaf = dir_block(dd, lblk);
+  dirent_t *new_leaf = dir_block(dd, new_lblk);
+  journal_dirty(old_leaf);
+  journal_dirty(new_leaf);
+  memset(old_leaf, 0, BLOCK_SIZE);
+  memcpy(old_leaf, tmp, split * sizeof(dirent_t));
+  memcpy(new_leaf, tmp + split, (n - split) * sizeof(dirent_t));
+  *split_hash = dx_hash(tmp[split].name);
+  free(tmp);
+  return new_lblk;
+}
+
+// Make room in the index above a leaf. Returns 0 once the parent of the
+// leaf has a free entry (the caller re-walks), or a negative error.
+static int dx_grow_index(inode_t *dd, dx_path_t *path) {
+  dx_node_t *root = path->node[0];
+
+  if (root->levels == 0) {
+    // root is full of leaf pointers: push them down into a new index block
+    int lblk = dir_append_block(dd);
+    if (lblk < 0) {
+      return lblk;
+    }
+    root = dir_block(dd, 0);
+    dx_node_t *node = dir_block(dd, lblk);
+    journal_dirty(root);
+    journal_dirty(node);
+    node->count = root->count;
+    memcpy(node->entries, root->entries, root->count * sizeof(dx_entry_t));
+    root->count = 1;
+    root->levels = 1;
+    root->entries[0].hash = 0;
+    root->entries[0].block = lblk;
+    return 0;
+  }
+
+  if (root->count >= DX_ENTRIES_PER_BLOCK) {
+    return -ENOSPC;
+  }
+
+  // split the full index block in two and hang the upper half off the root
+  int lblk = dir_append_block(dd);
+  if (lblk < 0) {
+    return lblk;
+  }
+  root = dir_block(dd, 0);
+  dx_node_t *old_node = dir_block(dd, root->entries[path->pos[0]].block);
+  dx_node_t *new_node = dir_block(dd, lblk);
+  journal_dirty(old_node);
+  journal_dirty(new_node);
+  int half = old_node->count / 2;
+  new_node->count = old_node->count - half;
+  memcpy(new_node->entries, &old_node->entries[half],
+         new_node->count * sizeof(dx_entry_t));
+  old_node->count = half;
+  dx_insert(root, path->pos[0], new_node->entries[0].hash, lblk);
+  return 0;
+}
+
+// Add a name to an indexed directory.
+static int dx_put(inode_t *dd, const char *name, int inum) {
+  uint32_t hash = dx_hash(name);
+  for (;;) {
+    dx_path_t path;
+    if (dx_walk(dd, hash, &path) < 0) {
+      return -EIO;
+    }
+    dirent_t *leaf = dir_block(dd, path.leaf);
+    for (int i = 0; i < (int) DIRENTS_PER_BLOCK; i++) {
+      if (!leaf[i].used) {
+        dirent_set(&leaf[i], name, inum);
+        return 0;
+      }
+    }
+
+    // the leaf is full; its parent needs a free slot before it can split
+    dx_node_t *parent = path.node[path.depth - 1];
+    if (parent->count >= DX_ENTRIES_PER_BLOCK) {
+      int rv = dx_grow_index(dd, &path);
+      if (rv < 0) {
+        return rv;
+      }
+      continue;
+    }
+
+    uint32_t split_hash;
+    int new_lblk = dx_split_leaf(dd, path.leaf, &split_hash);
+    if (new_lblk < 0) {
+      return new_lblk;
     }
-    // give to first direct slot
-    dd->direct[0] = bnum;
+    dx_insert(parent, path.pos[path.depth - 1], split_hash, new_lblk);
+  }
+}
+
+// Turn a full linear directory into an indexed one: block 0 becomes the
+// root and the existing entries move to a fresh leaf.
+static int dx_convert(inode_t *dd) {
+  dirent_t *tmp = malloc(BLOCK_SIZE);
+  memcpy(tmp, dir_block(dd, 0), BLOCK_SIZE);
+
+  journal_dirty(dd);
+  dd->size = BLOCK_SIZE;
+  int leaf = dir_append_block(dd);
+  if (leaf < 0) {
+    // put the directory back the way it was
+    journal_dirty(dd);
+    dd->size = DIRENTS_PER_BLOCK * sizeof(dirent_t);
+    free(tmp);
+    return leaf;
   }
+  void *leaf_block = dir_block(dd, leaf);
+  journal_dirty(leaf_block);
+  memcpy(leaf_block, tmp, BLOCK_SIZE);
+  free(tmp);
 
-  dirent_t *entries = (dirent_t *) blocks_get_block(bnum);
+  dx_node_t *root = dir_block(dd, 0);
+  journal_dirty(root);
+  journal_dirty(dd);
+  memset(root, 0, BLOCK_SIZE);
+  root->count = 1;
+  root->levels = 0;
+  root->entries[0].hash = 0;
+  root->entries[0].block = leaf;
+  dd->flags |= INODE_DIR_INDEXED;
+  return 0;
+}
+
+// Add a name to a linear directory, converting it to an indexed one when
+// its block is full.
+static int linear_put(inode_t *dd, const char *name, int inum) {
   int n_entries = dd->size / sizeof(dirent_t);
 
   // Look for a free slot
+  dirent_t *entries = dir_block(dd, 0);
   for (int i = 0; i < n_entries; i++) {
     if (!entries[i].used) {
-      strncpy(entries[i].name, name, DIR_NAME_LENGTH);
-      entries[i].name[DIR_NAME_LENGTH - 1] = '\0';
-      entries[i].inum = inum;
-      entries[i].used = 1;
+      dirent_set(&entries[i], name, inum);
       return 0;
     }
   }
 
-  // Otherwise, append to end
-  dirent_t *entry = &entries[n_entries];
-  strncpy(entry->name, name, DIR_NAME_LENGTH);
-  entry->name[DIR_NAME_LENGTH - 1] = '\0';
-  entry->inum = inum;
-  entry->used = 1;
-  dd->size += sizeof(dirent_t);
-  return 0;
+  // Otherwise, append to end (mapping the block on the first entry)
+  if (n_entries < (int) DIRENTS_PER_BLOCK) {
+    int rv = grow_inode(dd, dd->size + sizeof(dirent_t));
+    if (rv < 0) {
+      return rv;
+    }
+    entries = dir_block(dd, 0);
+    dirent_set(&entries[n_entries], name, inum);
+    return 0;
+  }
+
+  // The single block is full; switch to the hashed index
+  int rv = dx_convert(dd);
+  if (rv < 0) {
+    return rv;
+  }
+  return dx_put(dd, name, inum);
+}
+
+// Add to the directory
+int directory_put(inode_t *dd, const char *name, int inum) {
+  if (!dd || strlen(name) >= DIR_NAME_LENGTH) {
+    return -1;
+  }
+  if (directory_lookup(dd, name) >= 0) {
+    return -EEXIST;
+  }
+
+  int rv;
+  if (dd->flags & INODE_DIR_INDEXED) {
+    rv = dx_put(dd, name, inum);
+  } else {
+    rv = linear_put(dd, name, inum);
+  }
+  if (rv == 0) {
+    // replaces any negative entry for the name
+    dcache_insert(inode_get_inum(dd), name, inum);
+  }
+  return rv;
 }
 
 // delete entry in directory
@@ -74,22 +382,41 @@ int directory_delete(inode_t *dd, const char *name) {
   if (!dd) {
     return -1;
   }
-  int bnum = inode_get_bnum(dd, 0);
-  if (bnum <= 0) {
+  dirent_t *entry = dirent_lookup(dd, name);
+  if (!entry) {
     return -1;
   }
+  journal_dirty(entry);
+  entry->used = 0;
+  dcache_insert(inode_get_inum(dd), name, -1);
+  return 0;
+}
 
-  dirent_t *entries = (dirent_t *) blocks_get_block(bnum);
-  int n_entries = dd->size / sizeof(dirent_t);
-
-  for (int i = 0; i < n_entries; i++) {
-    if (entries[i].used && strcmp(entries[i].name, name) == 0) {
-      entries[i].used = 0;
-      return 0;
+// Cons the used names in an array of dirents onto list.
+static slist_t *dirents_list(dirent_t *entries, int n, slist_t *list) {
+  for (int i = 0; i < n; i++) {
+    if (entries[i].used) {
+      list = s_cons(entries[i].name, list);
     }
   }
+  return list;
+}
 
-  return -1;
+// Cons the names of every leaf below an index node onto list.
+static slist_t *dx_list(inode_t *dd, dx_node_t *node, int levels,
+                        slist_t *list) {
+  for (uint32_t i = 0; i < node->count; i++) {
+    void *child = dir_block(dd, node->entries[i].block);
+    if (!child) {
+      continue;
+    }
+    if (levels > 0) {
+      list = dx_list(dd, child, levels - 1, list);
+    } else {
+      list = dirents_list(child, DIRENTS_PER_BLOCK, list);
+    }
+  }
+  return list;
 }
 
 // get the list of file names in directory
@@ -97,21 +424,103 @@ slist_t *directory_list(inode_t *dd) {
   if (!dd) {
     return NULL;
   }
-  int bnum = inode_get_bnum(dd, 0);
-  if (bnum <= 0) {
+  if (dd->flags & INODE_DIR_INDEXED) {
+    dx_node_t *root = dir_block(dd, 0);
+    return root ? dx_list(dd, root, root->levels, NULL) : NULL;
+  }
+  dirent_t *entries = dir_block(dd, 0);
+  if (!entries) {
     return NULL;
   }
-  dirent_t *entries = (dirent_t *) blocks_get_block(bnum);
-  int n_entries = dd->size / sizeof(dirent_t);
-  slist_t *list = NULL;
+  return dirents_list(entries, dd->size / sizeof(dirent_t), NULL);
+}
 
-  for (int i = 0; i < n_entries; i++) {
-    if (entries[i].used) {
-      list = s_cons(entries[i].name, list);
+// Visit the used entries of a leaf with hash >= from in hash order. end
+// is the position of whatever follows the leaf. Allocation-free: the
+// order is sorted into arrays on the stack.
+static int dx_iterate_leaf(dirent_t *leaf, uint32_t from, uint64_t end,
+                           dir_iter_t fn, void *arg) {
+  uint32_t hash[DIRENTS_PER_BLOCK];
+  int idx[DIRENTS_PER_BLOCK];
+  int n = 0;
+  for (int i = 0; i < (int) DIRENTS_PER_BLOCK; i++) {
+    if (!leaf[i].used) {
+      continue;
+    }
+    uint32_t h = dx_hash(leaf[i].name);
+    if (h < from) {
+      continue;
+    }
+    // insertion sort; a leaf holds few entries
+    int j = n++;
+    for (; j > 0 && hash[j - 1] > h; j--) {
+      hash[j] = hash[j - 1];
+      idx[j] = idx[j - 1];
+    }
+    hash[j] = h;
+    idx[j] = i;
+  }
+  for (int k = 0; k < n; k++) {
+    uint64_t next = k + 1 < n ? DIR_POS_HASHED | hash[k + 1] : end;
+    int rv = fn(arg, leaf[idx[k]].name, leaf[idx[k]].inum, next);
+    if (rv) {
+      return rv;
     }
   }
+  return 0;
+}
 
-  return list;
+// Visit the leaves below an index node in hash order, from the one that
+// covers hash from. end is the position of whatever follows the node.
+static int dx_iterate(inode_t *dd, dx_node_t *node, int levels, uint32_t from,
+                      uint64_t end, dir_iter_t fn, void *arg) {
+  for (uint32_t i = dx_search(node, from); i < node->count; i++) {
+    uint64_t next = i + 1 < node->count
+                        ? DIR_POS_HASHED | node->entries[i + 1].hash
+                        : end;
+    void *child = dir_block(dd, node->entries[i].block);
+    if (!child) {
+      continue;
+    }
+    int rv = levels > 0
+                 ? dx_iterate(dd, child, levels - 1, from, next, fn, arg)
+                 : dx_iterate_leaf(child, from, next, fn, arg);
+    if (rv) {
+      return rv;
+    }
+    from = 0; // later children are listed whole
+  }
+  return 0;
+}
+
+// List the directory from position pos (0 for the start), calling fn for
+// each entry until it returns nonzero. Returns that value, or 0 once
+// every entry has been visited. The caller holds the directory's lock.
+int directory_iterate(inode_t *dd, uint64_t pos, dir_iter_t fn, void *arg) {
+  if (!dd || pos >= DIR_POS_END) {
+    return 0;
+  }
+  if (dd->flags & INODE_DIR_INDEXED) {
+    dx_node_t *root = dir_block(dd, 0);
+    if (!root) {
+      return 0;
+    }
+    // a slot position means the directory was indexed since the listing
+    // began; start over rather than skip entries
+    uint32_t from = pos & DIR_POS_HASHED ? (uint32_t) pos : 0;
+    return dx_iterate(dd, root, root->levels, from, DIR_POS_END, fn, arg);
+  }
+  dirent_t *entries = dir_block(dd, 0);
+  int n = dd->size / sizeof(dirent_t);
+  for (uint64_t i = pos; entries && i < (uint64_t) n; i++) {
+    if (entries[i].used) {
+      int rv = fn(arg, entries[i].name, entries[i].inum, i + 1);
+      if (rv) {
+        return rv;
+      }
+    }
+  }
+  return 0;
 }
 
 //print out the directory
@@ -124,4 +533,4 @@ void print_directory(inode_t *dd) {
     cur = cur->next;
   }
   s_free(list);
-}
\ No newline at end of file
+}
@@ -1,6 +1,8 @@
 #ifndef DIRECTORY_H
 #define DIRECTORY_H
 
+#include <stdint.h>
+
 #include "blocks.h"
 #include "inode.h"
 #include "slist.h"
@@ -14,10 +16,46 @@ typedef struct dirent {
   char _reserved[8];
 } dirent_t;
 
+// Directories start out "linear": one block of dirent_t, scanned in order.
+// When that block fills up the directory is converted to a hashed index
+// (flag INODE_DIR_INDEXED), laid out like an ext3 htree:
+//
+//   logical block 0     dx_root: sorted (hash, block) pairs
+//   index blocks        dx_node: same, one level below the root (optional)
+//   leaf blocks         arrays of dirent_t, each covering a hash range
+//
+// A lookup reads the root, at most one index block and one leaf, no matter
+// how many entries the directory holds.
+
+typedef struct dx_entry {
+  uint32_t hash;  // lowest name hash routed to this block
+  uint32_t block; // logical block number within the directory
+} dx_entry_t;
+
+typedef struct dx_node {
+  uint32_t count;  // entries in use
+  uint32_t levels; // root only: index levels below the root (0 or 1)
+  dx_entry_t entries[];
+} dx_node_t;
+
+// Positions for directory_iterate. A linear directory counts slots from 0;
+// an indexed one is listed in hash order and a position is the hash to
+// resume at, tagged with DIR_POS_HASHED. Both stay valid while entries
+// come and go (a leaf split reorders slots but not hashes); only names
+// whose hashes collide may be listed twice.
+#define DIR_POS_HASHED (1ULL << 32)
+#define DIR_POS_END (1ULL << 33)
+
+// Called for each entry with the position just past it. A nonzero return
+// stops the listing and is passed back.
+typedef int (*dir_iter_t)(void *arg, const char *name, int inum,
+                          uint64_t next);
+
 int directory_lookup(inode_t *dd, const char *name);
+int directory_iterate(inode_t *dd, uint64_t pos, dir_iter_t fn, void *arg);
 int directory_put(inode_t *dd, const char *name, int inum);
 int directory_delete(inode_t *dd, const char *name);
 slist_t *directory_list(inode_t *dd);
 void print_directory(inode_t *dd);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,641 @@
+/**
+ * Extent tree implementation.
+ *
+ * Every node is an extent_header_t followed by 12-byte entries: extents in
+ * leaves (depth 0), index entries above them. The root is embedded in the
+ * inode (EXT_ROOT_MAX entries); other nodes fill a whole block. An index
+ * entry's lblk is never above the lowest logical block mapped under it,
+ * so lookups descend into the last entry whose lblk is <= the target.
+ * Every change to a node is journaled; tree blocks come from the metadata
+ * zone.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "extent.h"
+#include "journal.h"
+
+#define EXT_ENTRY_SIZE 12
+// Tree blocks one change can reserve: see extent_remap
+#define EXT_POOL_MAX ((EXT_REMAP_MAX + 1) * (EXT_MAX_DEPTH + 1))
+#define EXT_BLOCK_MAX ((BLOCK_SIZE - sizeof(extent_header_t)) / EXT_ENTRY_SIZE)
+
+_Static_assert(sizeof(extent_t) == EXT_ENTRY_SIZE, "extent_t must be 12 bytes");
+_Static_assert(sizeof(extent_idx_t) == EXT_ENTRY_SIZE, "extent_idx_t must be 12 bytes");
+
+// Tree blocks reserved up front by an insert, so a split half way up the
+// tree can never fail and leave the tree torn.
+typedef struct ext_ctx {
+  int pool[EXT_POOL_MAX];
+  int n;
+} ext_ctx_t;
+
+// Result of splitting a node: the new right sibling.
+typedef struct ext_split {
+  uint32_t lblk; // first logical block in the sibling
+  uint32_t pblk; // block holding the sibling
+} ext_split_t;
+
+// Leaf lookup cache: per slot, the last leaf a lookup descended to and
+// the range of logical blocks routed to it. A change to a tree bumps its
+// slot's generation, which invalidates the entry. Entries are per thread;
+// the generations are shared. Callers hold the inode lock, so a tree
+// never changes while a lookup in it runs.
+#define EXT_CACHE_SLOTS 256
+
+typedef struct ext_cache {
+  extent_root_t *root;
+  extent_header_t *leaf;
+  uint32_t lo, hi; // [lo, hi) is routed to leaf
+  uint32_t gen;
+} ext_cache_t;
+
+static __thread ext_cache_t ext_cache[EXT_CACHE_SLOTS];
+static uint32_t ext_cache_gen[EXT_CACHE_SLOTS];
+
+// Roots live in inodes, so neighbouring trees are INODE_SIZE apart.
+static int ext_cache_slot(extent_root_t *root) {
+  return ((uintptr_t) root / 128) % EXT_CACHE_SLOTS;
+}
+
+static void ext_cache_drop(extent_root_t *root) {
+  __atomic_fetch_add(&ext_cache_gen[ext_cache_slot(root)], 1, __ATOMIC_RELAXED);
+}
+
+static extent_t *ext_leaf(extent_header_t *h) { return (extent_t *) (h + 1); }
+static extent_idx_t *ext_idx(extent_header_t *h) { return (extent_idx_t *) (h + 1); }
+static extent_header_t *ext_node(uint32_t bnum) { return blocks_get_block(bnum); }
+
+// Both kinds of entry start with their logical block.
+static uint32_t ext_first_lblk(extent_header_t *h) { return *(uint32_t *) (h + 1); }
+
+static int ext_capacity(int is_root) {
+  return is_root ? EXT_ROOT_MAX : (int) EXT_BLOCK_MAX;
+}
+
+// Last index entry with lblk <= target, or 0.
+static int ext_idx_search(extent_header_t *h, uint32_t lblk) {
+  extent_idx_t *ix = ext_idx(h);
+  int lo = 1, hi = h->count - 1, pos = 0;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (ix[mid].lblk <= lblk) {
+      pos = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return pos;
+}
+
+// Last extent with lblk <= target, or -1.
+static int ext_leaf_search(extent_header_t *h, uint32_t lblk) {
+  extent_t *ex = ext_leaf(h);
+  int lo = 0, hi = h->count - 1, pos = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (ex[mid].lblk <= lblk) {
+      pos = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return pos;
+}
+
+static void ext_put_entry(extent_header_t *h, int pos, const void *entry) {
+  journal_dirty(h);
+  char *base = (char *) (h + 1);
+  memmove(base + (pos + 1) * EXT_ENTRY_SIZE, base + pos * EXT_ENTRY_SIZE,
+          (h->count - pos) * EXT_ENTRY_SIZE);
+  memcpy(base + pos * EXT_ENTRY_SIZE, entry, EXT_ENTRY_SIZE);
+  h->count++;
+}
+
+static void ext_del_entry(extent_header_t *h, int pos) {
+  journal_dirty(h);
+  char *base = (char *) (h + 1);
+  memmove(base + pos * EXT_ENTRY_SIZE, base + (pos + 1) * EXT_ENTRY_SIZE,
+          (h->count - pos - 1) * EXT_ENTRY_SIZE);
+  h->count--;
+}
+
+// Number of data blocks an extent holds.
+static uint32_t ext_plen(const extent_t *e) {
+  return e->flags & EXT_COMPRESSED ? (uint32_t) (e->flags & EXT_PLEN) : e->len;
+}
+
+// Can b be appended to a as one extent?
+static int ext_can_merge(extent_t *a, extent_t *b) {
+  return a->flags == 0 && b->flags == 0 && a->lblk + a->len == b->lblk &&
+         a->pblk + a->len == b->pblk && a->len + b->len <= EXT_MAX_LEN;
+}
+
+// Take an empty tree block from the reservation.
+static extent_header_t *ext_new_node(ext_ctx_t *ctx, int depth, uint32_t *bnum) {
+  assert(ctx->n > 0);
+  *bnum = ctx->pool[--ctx->n];
+  extent_header_t *h = ext_node(*bnum);
+  journal_dirty(h);
+  memset(h, 0, sizeof(extent_header_t));
+  h->depth = depth;
+  return h;
+}
+
+// Add entry at pos in node h. A full block node is split in two and the
+// new right sibling reported in *split; a full root pushes its entries
+// down into a new block so the tree gains a level.
+static void ext_node_add(ext_ctx_t *ctx, extent_header_t *h, int is_root,
+                         int pos, const void *entry, ext_split_t *split,
+                         int *did_split) {
+  *did_split = 0;
+  if (h->count < ext_capacity(is_root)) {
+    ext_put_entry(h, pos, entry);
+    return;
+  }
+
+  journal_dirty(h);
+  uint32_t bnum;
+  if (is_root) {
+    extent_header_t *child = ext_new_node(ctx, h->depth, &bnum);
+    child->count = h->count;
+    memcpy(child + 1, h + 1, h->count * EXT_ENTRY_SIZE);
+    ext_put_entry(child, pos, entry);
+    h->depth++;
+    h->count = 1;
+    ext_idx(h)[0].lblk = ext_first_lblk(child);
+    ext_idx(h)[0].child = bnum;
+    ext_idx(h)[0]._reserved = 0;
+    return;
+  }
+
+  // appending (the common case for growing files) leaves the old node full
+  int from = pos == h->count ? h->count : h->count / 2;
+  extent_header_t *sib = ext_new_node(ctx, h->depth, &bnum);
+  sib->count = h->count - from;
+  memcpy(sib + 1, (char *) (h + 1) + from * EXT_ENTRY_SIZE,
+         sib->count * EXT_ENTRY_SIZE);
+  h->count = from;
+  if (pos >= from) {
+    ext_put_entry(sib, pos - from, entry);
+  } else {
+    ext_put_entry(h, pos, entry);
+  }
+  split->lblk = ext_first_lblk(sib);
+  split->pblk = bnum;
+  *did_split = 1;
+}
+
+// Insert ext into the subtree under h.
+static void ext_insert_rec(ext_ctx_t *ctx, extent_header_t *h, int is_root,
+                           extent_t *ext, ext_split_t *split, int *did_split) {
+  *did_split = 0;
+  if (h->depth == 0) {
+    extent_t *ex = ext_leaf(h);
+    int i = ext_leaf_search(h, ext->lblk);
+    if (i >= 0 && ext_can_merge(&ex[i], ext)) {
+      journal_dirty(h);
+      ex[i].len += ext->len;
+      if (i + 1 < h->count && ext_can_merge(&ex[i], &ex[i + 1])) {
+        ex[i].len += ex[i + 1].len;
+        ext_del_entry(h, i + 1);
+      }
+      return;
+    }
+    if (i + 1 < h->count && ext_can_merge(ext, &ex[i + 1])) {
+      journal_dirty(h);
+      ex[i + 1].lblk = ext->lblk;
+      ex[i + 1].pblk = ext->pblk;
+      ex[i + 1].len += ext->len;
+      return;
+    }
+    ext_node_add(ctx, h, is_root, i + 1, ext, split, did_split);
+    return;
+  }
+
+  extent_idx_t *ix = ext_idx(h);
+  int i = ext_idx_search(h, ext->lblk);
+  if (ext->lblk < ix[i].lblk) {
+    journal_dirty(h);
+    ix[i].lblk = ext->lblk;
+  }
+  ext_split_t child_split;
+  int child_did_split;
+  ext_insert_rec(ctx, ext_node(ix[i].child), 0, ext, &child_split,
+                 &child_did_split);
+  if (child_did_split) {
+    extent_idx_t entry = {child_split.lblk, child_split.pblk, 0};
+    ext_node_add(ctx, h, is_root, i + 1, &entry, split, did_split);
+  }
+}
+
+static int ext_fill_pool(ext_ctx_t *ctx, int need);
+
+// Reserve the tree blocks an insert at lblk could need: one per full node
+// on the path, counting up from the leaf. Also reports in *bound the first
+// logical block routed to a later subtree; an extent inserted at lblk must
+// end at or before it.
+static int ext_reserve(extent_root_t *root, uint32_t lblk, ext_ctx_t *ctx,
+                       uint32_t *bound) {
+  extent_header_t *path[EXT_MAX_DEPTH + 1];
+  extent_header_t *h = &root->hdr;
+  int depth = 0;
+  path[depth++] = h;
+  *bound = UINT32_MAX;
+  while (h->depth > 0) {
+    int i = ext_idx_search(h, lblk);
+    if (i + 1 < h->count && ext_idx(h)[i + 1].lblk < *bound) {
+      *bound = ext_idx(h)[i + 1].lblk;
+    }
+    h = ext_node(ext_idx(h)[i].child);
+    path[depth++] = h;
+  }
+
+  int need = 0;
+  for (int lvl = depth - 1; lvl >= 0; lvl--) {
+    if (path[lvl]->count < ext_capacity(lvl == 0)) {
+      break;
+    }
+    need++;
+  }
+  if (need == depth && root->hdr.depth >= EXT_MAX_DEPTH) {
+    return -EFBIG;
+  }
+  return ext_fill_pool(ctx, need);
+}
+
+// Allocate need tree blocks into ctx, or none.
+static int ext_fill_pool(ext_ctx_t *ctx, int need) {
+  assert(need <= (int) (sizeof(ctx->pool) / sizeof(ctx->pool[0])));
+  ctx->n = 0;
+  while (ctx->n < need) {
+    int bnum = alloc_meta_block();
+    if (bnum < 0) {
+      while (ctx->n > 0) {
+        free_block(ctx->pool[--ctx->n]);
+      }
+      return -ENOSPC;
+    }
+    ctx->pool[ctx->n++] = bnum;
+  }
+  return 0;
+}
+
+// Insert using blocks already reserved in ctx.
+static void ext_insert_pooled(extent_root_t *root, ext_ctx_t *ctx,
+                              extent_t *ext) {
+  ext_split_t split;
+  int did_split;
+  ext_insert_rec(ctx, &root->hdr, 1, ext, &split, &did_split);
+  assert(!did_split);
+}
+
+static void ext_release_pool(ext_ctx_t *ctx) {
+  while (ctx->n > 0) {
+    free_block(ctx->pool[--ctx->n]);
+  }
+}
+
+// Insert using blocks already reserved in ctx, then give back the rest.
+static void ext_insert_reserved(extent_root_t *root, ext_ctx_t *ctx,
+                                extent_t *ext) {
+  ext_insert_pooled(root, ctx, ext);
+  ext_release_pool(ctx);
+}
+
+// Find the leaf lblk is routed to, and in *bound the first logical block
+// routed to a later leaf.
+static extent_header_t *ext_find_leaf(extent_root_t *root, uint32_t lblk,
+                                      uint32_t *bound) {
+  extent_header_t *h = &root->hdr;
+  *bound = UINT32_MAX;
+  if (h->depth == 0) {
+    return h;
+  }
+
+  int slot = ext_cache_slot(root);
+  ext_cache_t *c = &ext_cache[slot];
+  uint32_t gen = __atomic_load_n(&ext_cache_gen[slot], __ATOMIC_RELAXED);
+  if (c->root == root && c->gen == gen && lblk >= c->lo && lblk < c->hi) {
+    *bound = c->hi;
+    return c->leaf;
+  }
+
+  uint32_t lo = 0;
+  while (h->depth > 0) {
+    extent_idx_t *ix = ext_idx(h);
+    int i = ext_idx_search(h, lblk);
+    // the first child also takes everything below its key
+    if (i > 0) {
+      lo = ix[i].lblk;
+    }
+    if (i + 1 < h->count && ix[i + 1].lblk < *bound) {
+      *bound = ix[i + 1].lblk;
+    }
+    h = ext_node(ix[i].child);
+  }
+
+  c->root = root;
+  c->leaf = h;
+  c->lo = lo;
+  c->hi = *bound;
+  c->gen = gen;
+  return h;
+}
+
+// Map a logical block to a physical block, reporting the extent's flags.
+uint32_t extent_lookup_flags(extent_root_t *root, uint32_t lblk,
+                             uint32_t *run, uint16_t *flags) {
+  uint32_t bound; // first block mapped by a later subtree
+  extent_header_t *h = ext_find_leaf(root, lblk, &bound);
+
+  extent_t *ex = ext_leaf(h);
+  int i = ext_leaf_search(h, lblk);
+  if (i >= 0 && lblk < ex[i].lblk + ex[i].len) {
+    if (run) {
+      *run = ex[i].lblk + ex[i].len - lblk;
+    }
+    *flags = ex[i].flags;
+    if (ex[i].flags & EXT_COMPRESSED) {
+      return ex[i].pblk;
+    }
+    return ex[i].pblk + (lblk - ex[i].lblk);
+  }
+  if (run) {
+    uint32_t next = i + 1 < h->count ? ex[i + 1].lblk : bound;
+    *run = next - lblk;
+  }
+  *flags = 0;
+  return 0;
+}
+
+// Map a logical block to a physical block.
+uint32_t extent_lookup(extent_root_t *root, uint32_t lblk, uint32_t *run) {
+  uint16_t flags;
+  uint32_t pblk = extent_lookup_flags(root, lblk, run, &flags);
+  assert(!(flags & EXT_COMPRESSED));
+  return pblk;
+}
+
+static uint32_t ext_remove_rec(extent_header_t *h, uint32_t from,
+                               uint32_t end, int free_data);
+static void ext_collapse(extent_root_t *root);
+
+// Map [lblk, lblk+len) to [pblk, pblk+len).
+int extent_insert(extent_root_t *root, uint32_t lblk, uint32_t pblk,
+                  uint32_t len) {
+  uint32_t first = lblk;
+  ext_cache_drop(root);
+  while (len > 0) {
+    ext_ctx_t ctx;
+    uint32_t bound;
+    int rv = ext_reserve(root, lblk, &ctx, &bound);
+    if (rv < 0) {
+      // unmap the chunks already inserted; the blocks stay the caller's.
+      // The range after them is unmapped, so this never splits an extent.
+      ext_remove_rec(&root->hdr, first, lblk, 0);
+      ext_collapse(root);
+      return rv;
+    }
+    // don't let one extent straddle two subtrees
+    uint32_t n = len > EXT_MAX_LEN ? EXT_MAX_LEN : len;
+    if (lblk + n > bound) {
+      n = bound - lblk;
+    }
+    extent_t ext = {lblk, pblk, n, 0};
+    ext_insert_reserved(root, &ctx, &ext);
+    lblk += n;
+    pblk += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Find the leaf extent containing lblk, or NULL.
+static extent_t *ext_find(extent_root_t *root, uint32_t lblk) {
+  uint32_t bound;
+  extent_header_t *h = ext_find_leaf(root, lblk, &bound);
+  int i = ext_leaf_search(h, lblk);
+  if (i >= 0 && lblk < ext_leaf(h)[i].lblk + ext_leaf(h)[i].len) {
+    return &ext_leaf(h)[i];
+  }
+  return 0;
+}
+
+// Unmap [from, end) under h, which must not lie strictly inside one extent.
+// Frees the data blocks too if free_data is set. Returns the number of
+// data blocks unmapped.
+static uint32_t ext_remove_rec(extent_header_t *h, uint32_t from,
+                               uint32_t end, int free_data) {
+  uint32_t removed = 0;
+  if (h->depth == 0) {
+    extent_t *ex = ext_leaf(h);
+    int i = ext_leaf_search(h, from);
+    if (i < 0) {
+      i = 0;
+    }
+    while (i < h->count) {
+      uint32_t es = ex[i].lblk, ee = ex[i].lblk + ex[i].len;
+      if (ee <= from) {
+        i++;
+      } else if (es >= end) {
+        break;
+      } else if (es >= from && ee <= end) {
+        if (free_data) {
+          free_blocks(ex[i].pblk, ext_plen(&ex[i]));
+        }
+        removed += ext_plen(&ex[i]);
+        ext_del_entry(h, i);
+      } else if (es < from) {
+        // keep the head
+        assert(!(ex[i].flags & EXT_COMPRESSED));
+        uint32_t keep = from - es;
+        if (free_data) {
+          free_blocks(ex[i].pblk + keep, ex[i].len - keep);
+        }
+        journal_dirty(h);
+        removed += ex[i].len - keep;
+        ex[i].len = keep;
+        i++;
+      } else {
+        // keep the tail
+        assert(!(ex[i].flags & EXT_COMPRESSED));
+        uint32_t cut = end - es;
+        if (free_data) {
+          free_blocks(ex[i].pblk, cut);
+        }
+        journal_dirty(h);
+        removed += cut;
+        ex[i].lblk += cut;
+        ex[i].pblk += cut;
+        ex[i].len -= cut;
+        i++;
+      }
+    }
+    return removed;
+  }
+
+  extent_idx_t *ix = ext_idx(h);
+  int i = ext_idx_search(h, from);
+  while (i < h->count && ix[i].lblk < end) {
+    extent_header_t *child = ext_node(ix[i].child);
+    removed += ext_remove_rec(child, from, end, free_data);
+    if (child->count == 0) {
+      free_block(ix[i].child);
+      ext_del_entry(h, i);
+    } else {
+      i++;
+    }
+  }
+  return removed;
+}
+
+// Pull single children back into the root while they fit.
+static void ext_collapse(extent_root_t *root) {
+  extent_header_t *h = &root->hdr;
+  if (h->depth > 0 && h->count == 0) {
+    journal_dirty(h);
+    h->depth = 0;
+  }
+  while (h->depth > 0 && h->count == 1) {
+    uint32_t bnum = ext_idx(h)[0].child;
+    extent_header_t *child = ext_node(bnum);
+    if (child->count > EXT_ROOT_MAX) {
+      break;
+    }
+    journal_dirty(h);
+    h->depth = child->depth;
+    h->count = child->count;
+    memcpy(h + 1, child + 1, child->count * EXT_ENTRY_SIZE);
+    free_block(bnum);
+  }
+}
+
+// Unmap [lblk, lblk+len) and free the data blocks it mapped.
+int extent_remove(extent_root_t *root, uint32_t lblk, uint32_t len) {
+  uint32_t end = len > UINT32_MAX - lblk ? UINT32_MAX : lblk + len;
+
+  // punching out the middle of an extent leaves two extents
+  extent_t *e = ext_find(root, lblk);
+  if (e && e->lblk < lblk && e->lblk + e->len > end) {
+    assert(!(e->flags & EXT_COMPRESSED));
+    ext_ctx_t ctx;
+    uint32_t bound;
+    int rv = ext_reserve(root, lblk, &ctx, &bound);
+    if (rv < 0) {
+      return rv;
+    }
+    extent_t tail = {end, e->pblk + (end - e->lblk), e->lblk + e->len - end,
+                     e->flags};
+    journal_dirty(e);
+    e->len = lblk - e->lblk;
+    free_blocks(e->pblk + e->len, end - lblk);
+    ext_insert_reserved(root, &ctx, &tail);
+    ext_cache_drop(root);
+    return end - lblk;
+  }
+
+  uint32_t removed = ext_remove_rec(&root->hdr, lblk, end, 1);
+  ext_collapse(root);
+  ext_cache_drop(root);
+  return removed;
+}
+
+// Find the last extent in a tree.
+int extent_last(extent_root_t *root, uint32_t *lblk, uint32_t *len) {
+  extent_header_t *h = &root->hdr;
+  while (h->depth > 0 && h->count > 0) {
+    h = ext_node(ext_idx(h)[h->count - 1].child);
+  }
+  if (h->count == 0) {
+    return -1;
+  }
+  extent_t *last = &ext_leaf(h)[h->count - 1];
+  *lblk = last->lblk;
+  *len = last->len;
+  return 0;
+}
+
+static int ext_count_rec(extent_header_t *h) {
+  if (h->depth == 0) {
+    return h->count;
+  }
+  int n = 0;
+  for (int i = 0; i < h->count; i++) {
+    n += ext_count_rec(ext_node(ext_idx(h)[i].child));
+  }
+  return n;
+}
+
+// Count the extents in a tree.
+int extent_count(extent_root_t *root) { return ext_count_rec(&root->hdr); }
+
+// An extent that can't be split must land in one subtree, so the one
+// lblk is routed to takes [lblk, end) whole. That range is unmapped, so
+// no later subtree holds anything below end, and an index key inside the
+// range (at most one per level, left behind by removals) can be raised to
+// end.
+static void ext_raise_keys(extent_root_t *root, uint32_t lblk, uint32_t end) {
+  extent_header_t *h = &root->hdr;
+  while (h->depth > 0) {
+    extent_idx_t *ix = ext_idx(h);
+    int i = ext_idx_search(h, lblk);
+    if (i + 1 < h->count && ix[i + 1].lblk < end) {
+      journal_dirty(h);
+      ix[i + 1].lblk = end;
+    }
+    h = ext_node(ix[i].child);
+  }
+}
+
+// Replace the mapping of the range ext[0..n) covers with them.
+int extent_remap(extent_root_t *root, const extent_t *ext, int n) {
+  assert(n > 0 && n <= EXT_REMAP_MAX);
+  uint32_t lblk = ext[0].lblk, end = ext[n - 1].lblk + ext[n - 1].len;
+  // The removal may leave the inserts a different, fuller path than the
+  // one there now, and cutting an extent in two takes one more insert:
+  // reserve for n + 1 inserts that each split every level. A root that
+  // was pushed down holds one entry, so that many inserts add at most one
+  // level.
+  int depth = root->hdr.depth;
+  if (depth >= EXT_MAX_DEPTH) {
+    return -EFBIG;
+  }
+  ext_ctx_t ctx;
+  int rv = ext_fill_pool(&ctx, (n + 1) * (depth + 2));
+  if (rv < 0) {
+    return rv;
+  }
+  ext_cache_drop(root);
+
+  uint32_t freed;
+  extent_t *e = ext_find(root, lblk);
+  if (e && e->lblk < lblk && e->lblk + e->len > end) {
+    assert(!(e->flags & EXT_COMPRESSED));
+    extent_t tail = {end, e->pblk + (end - e->lblk), e->lblk + e->len - end,
+                     e->flags};
+    journal_dirty(e);
+    e->len = lblk - e->lblk;
+    free_blocks(e->pblk + e->len, end - lblk);
+    freed = end - lblk;
+    ext_insert_pooled(root, &ctx, &tail);
+  } else {
+    freed = ext_remove_rec(&root->hdr, lblk, end, 1);
+    ext_collapse(root);
+  }
+  ext_raise_keys(root, lblk, end);
+  for (int i = 0; i < n; i++) {
+    assert(ext[i].len > 0 && (i == 0 || ext[i].lblk == ext[i - 1].lblk +
+                                            ext[i - 1].len));
+    extent_t copy = ext[i];
+    ext_insert_pooled(root, &ctx, &copy);
+  }
+  ext_release_pool(&ctx);
+  ext_cache_drop(root);
+  return freed;
+}
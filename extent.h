@@ -0,0 +1,138 @@
+/**
+ * Extent trees: the map from a file's logical blocks to disk blocks.
+ *
+ * Each extent maps a run of logical blocks to a run of contiguous physical
+ * blocks. The root of the tree lives inside the inode and holds a handful
+ * of entries; when it overflows, the entries move into a tree block and
+ * the root becomes an index over such blocks, as in ext4.
+ */
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stdint.h>
+
+// Number of entries that fit in the root inside the inode
+#define EXT_ROOT_MAX 8
+// Longest run a single extent can describe
+#define EXT_MAX_LEN 0xffff
+// Number of tree levels allowed below the root. Four levels of index
+// blocks address far more extents than a 32-bit logical block number can
+// ever need, so in practice the tree only stops growing when the disk is
+// full.
+#define EXT_MAX_DEPTH 4
+// Most extents one extent_remap can put in place
+#define EXT_REMAP_MAX 4
+
+typedef struct extent_header {
+  uint16_t count; // entries in use
+  uint16_t depth; // 0: entries are extents, otherwise index entries
+  uint32_t _reserved;
+} extent_header_t;
+
+// Leaf entry
+typedef struct extent {
+  uint32_t lblk;  // first logical block
+  uint32_t pblk;  // first physical block
+  uint16_t len;   // number of blocks
+  uint16_t flags; // EXT_* below; 0 for plain blocks
+} extent_t;
+
+// extent_t.flags. A compressed extent maps len logical blocks (a cluster,
+// see compress.h) to the (flags & EXT_PLEN) blocks at pblk that hold them
+// compressed. It is only ever inserted or removed whole.
+#define EXT_COMPRESSED 0x8000
+#define EXT_PLEN 0x00ff
+
+// Index entry
+typedef struct extent_idx {
+  uint32_t lblk;  // lowest logical block mapped below child
+  uint32_t child; // physical block of the child node
+  uint32_t _reserved;
+} extent_idx_t;
+
+// The root as embedded in an inode; an all-zero root is an empty tree.
+typedef struct extent_root {
+  extent_header_t hdr;
+  extent_t entries[EXT_ROOT_MAX];
+} extent_root_t;
+
+/**
+ * Map a logical block to a physical block.
+ *
+ * @param root The tree.
+ * @param lblk Logical block number.
+ * @param run Set to the number of blocks from lblk on that are mapped
+ *            contiguously (or, for a hole, that are unmapped). May be NULL.
+ *
+ * Remembers the leaf it ended up in, so the next lookup in the same leaf
+ * (the usual case for sequential access) skips the walk from the root.
+ *
+ * @return The physical block, or 0 if lblk falls in a hole.
+ */
+uint32_t extent_lookup(extent_root_t *root, uint32_t lblk, uint32_t *run);
+
+/**
+ * Like extent_lookup, for trees that may hold compressed extents. For
+ * those it returns the first block of the compressed data and sets *run
+ * to the rest of the cluster from lblk.
+ *
+ * @param flags Set to the flags of the extent, or 0 for a hole.
+ */
+uint32_t extent_lookup_flags(extent_root_t *root, uint32_t lblk,
+                             uint32_t *run, uint16_t *flags);
+
+/**
+ * Map [lblk, lblk+len) to [pblk, pblk+len). The logical range must be
+ * unmapped. Merges with the preceding extent when both runs line up.
+ *
+ * @return 0 on success, -ENOSPC if a tree block can't be allocated, or
+ *         -EFBIG if the tree would grow past EXT_MAX_DEPTH. On failure
+ *         nothing in the range is mapped and the data blocks stay with
+ *         the caller.
+ */
+int extent_insert(extent_root_t *root, uint32_t lblk, uint32_t pblk,
+                  uint32_t len);
+
+/**
+ * Replace whatever maps a range with new extents, which may be
+ * compressed, in one step: the tree blocks it could need are reserved
+ * first, so it either happens entirely or not at all. The data blocks the
+ * range mapped are freed. The range must not cut a compressed extent.
+ *
+ * @param ext The new extents, in order and covering the range without
+ *            gaps.
+ * @param n How many (1 to EXT_REMAP_MAX).
+ *
+ * @return The number of data blocks freed, or -ENOSPC or -EFBIG with
+ *         nothing changed.
+ */
+int extent_remap(extent_root_t *root, const extent_t *ext, int n);
+
+/**
+ * Unmap [lblk, lblk+len) and free the data blocks it mapped. Tree blocks
+ * left empty are freed too. The range must not cut a compressed extent.
+ *
+ * @param len Number of blocks; UINT32_MAX removes everything from lblk on.
+ *
+ * @return The number of data blocks freed, or a negative error.
+ */
+int extent_remove(extent_root_t *root, uint32_t lblk, uint32_t len);
+
+/**
+ * Find the extent that maps the highest logical blocks.
+ *
+ * @param lblk Set to its first logical block.
+ * @param len Set to its length.
+ *
+ * @return 0, or -1 if the tree is empty.
+ */
+int extent_last(extent_root_t *root, uint32_t *lblk, uint32_t *len);
+
+/**
+ * Count the extents in a tree.
+ *
+ * @return Number of leaf extents.
+ */
+int extent_count(extent_root_t *root);
+
+#endif
@@ -0,0 +1,250 @@
+// frag.c
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "frag.h"
+#include "inode.h"
+#include "journal.h"
+
+#define FRAG_BUCKETS 4096
+#define FRAG_MAX_UNITS 32 // units per block the masks below can hold
+
+// A data block holding fragments. Blocks are kept on one list per longest
+// run of free units, so an allocation takes the first block on the
+// shortest list that fits: the fullest block with room wins.
+typedef struct frag_block {
+  uint32_t bnum;
+  uint32_t used;    // units that belong to files
+  uint32_t pending; // units freed by transactions that may not have committed
+  uint64_t tid;     // last transaction that freed units here
+  int run;          // longest run of free units; the list it is on
+  int on_pending;   // on pending_blocks
+  struct frag_block *hnext;       // hash chain
+  struct frag_block *prev, *next; // list of blocks with the same run
+  struct frag_block *pnext;       // pending_blocks
+} frag_block_t;
+
+static pthread_mutex_t frag_lock = PTHREAD_MUTEX_INITIALIZER;
+static frag_block_t *frag_hash[FRAG_BUCKETS];
+static frag_block_t *by_run[FRAG_MAX_UNITS + 1];
+static frag_block_t *pending_blocks; // blocks with pending units
+static int units_per_block;
+
+// Bits for units [start, start+n).
+static uint32_t unit_mask(int start, int n) {
+  uint32_t m = n >= 32 ? UINT32_MAX : (1u << n) - 1;
+  return m << start;
+}
+
+// First unit of a run of n units not set in busy, or -1.
+static int find_run(uint32_t busy, int n) {
+  for (int start = 0; start + n <= units_per_block; start++) {
+    if (!(busy & unit_mask(start, n))) {
+      return start;
+    }
+  }
+  return -1;
+}
+
+static int longest_run(uint32_t busy) {
+  int best = 0, cur = 0;
+  for (int i = 0; i < units_per_block; i++) {
+    cur = busy & (1u << i) ? 0 : cur + 1;
+    if (cur > best) {
+      best = cur;
+    }
+  }
+  return best;
+}
+
+static void list_remove(frag_block_t *fb) {
+  if (fb->prev) {
+    fb->prev->next = fb->next;
+  } else {
+    by_run[fb->run] = fb->next;
+  }
+  if (fb->next) {
+    fb->next->prev = fb->prev;
+  }
+}
+
+// Move fb to the list for its current longest run.
+static void fb_update(frag_block_t *fb) {
+  list_remove(fb);
+  fb->run = longest_run(fb->used | fb->pending);
+  fb->prev = NULL;
+  fb->next = by_run[fb->run];
+  if (fb->next) {
+    fb->next->prev = fb;
+  }
+  by_run[fb->run] = fb;
+}
+
+static frag_block_t *fb_find(uint32_t bnum) {
+  frag_block_t *fb = frag_hash[bnum % FRAG_BUCKETS];
+  while (fb && fb->bnum != bnum) {
+    fb = fb->hnext;
+  }
+  return fb;
+}
+
+static frag_block_t *fb_new(uint32_t bnum) {
+  frag_block_t *fb = calloc(1, sizeof(frag_block_t));
+  fb->bnum = bnum;
+  fb->hnext = frag_hash[bnum % FRAG_BUCKETS];
+  frag_hash[bnum % FRAG_BUCKETS] = fb;
+  // on the run-0 list until fb_update places it
+  fb->next = by_run[0];
+  if (fb->next) {
+    fb->next->prev = fb;
+  }
+  by_run[0] = fb;
+  return fb;
+}
+
+// Forget a block nothing lives in any more.
+static void fb_drop(frag_block_t *fb) {
+  frag_block_t **link = &frag_hash[fb->bnum % FRAG_BUCKETS];
+  while (*link != fb) {
+    link = &(*link)->hnext;
+  }
+  *link = fb->hnext;
+  list_remove(fb);
+  if (fb->on_pending) {
+    link = &pending_blocks;
+    while (*link != fb) {
+      link = &(*link)->pnext;
+    }
+    *link = fb->pnext;
+  }
+  free(fb);
+}
+
+// Rebuild the map from the fragments the inodes in use point at.
+void frag_init() {
+  units_per_block = BLOCK_SIZE / FRAG_SIZE;
+  assert(units_per_block <= FRAG_MAX_UNITS);
+  superblock_t *sb = blocks_get_superblock();
+  void *ibm = get_inode_bitmap();
+  for (uint32_t inum = 0; inum < sb->inode_count; inum++) {
+    if (!bitmap_get(ibm, inum)) {
+      continue;
+    }
+    inode_t *node = get_inode(inum);
+    if (node->refs <= 0 || !(node->flags & INODE_FRAG)) {
+      continue;
+    }
+    frag_block_t *fb = fb_find(node->frag.block);
+    if (!fb) {
+      fb = fb_new(node->frag.block);
+    }
+    fb->used |= unit_mask(node->frag.unit, node->frag.units);
+    fb_update(fb);
+  }
+}
+
+void frag_free_map() {
+  for (int i = 0; i < FRAG_BUCKETS; i++) {
+    while (frag_hash[i]) {
+      frag_block_t *fb = frag_hash[i];
+      frag_hash[i] = fb->hnext;
+      free(fb);
+    }
+  }
+  memset(by_run, 0, sizeof(by_run));
+  pending_blocks = NULL;
+}
+
+// Allocate units, from a partly used block if one has room.
+int frag_alloc(int units, frag_t *f) {
+  assert(units > 0 && units < units_per_block);
+  pthread_mutex_lock(&frag_lock);
+  frag_block_t *fb = NULL;
+  for (int r = units; r <= units_per_block && !fb; r++) {
+    fb = by_run[r];
+  }
+  int start = 0;
+  if (fb) {
+    start = find_run(fb->used | fb->pending, units);
+    assert(start >= 0);
+  } else {
+    int bnum = alloc_block();
+    if (bnum < 0) {
+      pthread_mutex_unlock(&frag_lock);
+      return -ENOSPC;
+    }
+    fb = fb_new(bnum);
+  }
+  fb->used |= unit_mask(start, units);
+  fb_update(fb);
+  pthread_mutex_unlock(&frag_lock);
+  f->block = fb->bnum;
+  f->unit = start;
+  f->units = units;
+  return 0;
+}
+
+// Shrink or grow a run in place.
+int frag_resize(frag_t *f, int units) {
+  pthread_mutex_lock(&frag_lock);
+  frag_block_t *fb = fb_find(f->block);
+  assert(fb);
+  if (units > f->units) {
+    uint32_t more = unit_mask(f->unit + f->units, units - f->units);
+    if (f->unit + units > units_per_block ||
+        ((fb->used | fb->pending) & more)) {
+      pthread_mutex_unlock(&frag_lock);
+      return -ENOSPC;
+    }
+    fb->used |= more;
+    fb_update(fb);
+  } else if (units < f->units) {
+    uint32_t freed = unit_mask(f->unit + units, f->units - units);
+    fb->used &= ~freed;
+    if (fb->used == 0) {
+      // the block waits for the commit in the block allocator instead
+      uint32_t bnum = fb->bnum;
+      fb_drop(fb);
+      free_block(bnum);
+    } else {
+      fb->pending |= freed;
+      fb->tid = journal_tid();
+      if (!fb->on_pending) {
+        fb->on_pending = 1;
+        fb->pnext = pending_blocks;
+        pending_blocks = fb;
+      }
+      fb_update(fb);
+    }
+  }
+  f->units = units;
+  pthread_mutex_unlock(&frag_lock);
+  return 0;
+}
+
+// Hand units freed by committed transactions back to the map.
+void frag_release(uint64_t tid) {
+  pthread_mutex_lock(&frag_lock);
+  frag_block_t **link = &pending_blocks;
+  while (*link) {
+    frag_block_t *fb = *link;
+    if (fb->tid <= tid) {
+      *link = fb->pnext;
+      fb->on_pending = 0;
+      fb->pending = 0;
+      fb_update(fb);
+    } else {
+      link = &fb->pnext;
+    }
+  }
+  pthread_mutex_unlock(&frag_lock);
+}
+
+char *frag_data(const frag_t *f) {
+  return (char *) blocks_get_block(f->block) + (size_t) f->unit * FRAG_SIZE;
+}
@@ -0,0 +1,75 @@
+/**
+ * Fragments: small files packed together into shared data blocks.
+ *
+ * A file too big to keep inline but smaller than a block takes a run of
+ * FRAG_SIZE units inside a block it shares with other small files,
+ * instead of a whole block of its own. The inode records the run (frag_t)
+ * in place of its extent tree.
+ *
+ * Which units are in use is known only from the inodes; the map of
+ * partly used blocks is kept in memory and rebuilt at mount. A block is
+ * marked used in the block bitmap while any fragment lives in it.
+ */
+#ifndef FRAG_H
+#define FRAG_H
+
+#include <stdint.h>
+
+#define FRAG_SIZE 512 // bytes per fragment unit
+
+typedef struct frag {
+  uint32_t block;  // shared data block
+  uint16_t unit;   // first unit within the block
+  uint16_t units;  // length of the run in units
+} frag_t;
+
+/**
+ * Rebuild the map of fragment blocks from the inode table. Call after
+ * blocks_init, before anything allocates.
+ */
+void frag_init();
+
+/**
+ * Drop the in-memory map, when the image is closed.
+ */
+void frag_free_map();
+
+/**
+ * Allocate a run of units, preferring the fullest block that has room.
+ * The units hold whatever was there before. Call inside a journal handle.
+ *
+ * @param units Number of units wanted (1 to units per block - 1).
+ * @param f Set to the new run.
+ *
+ * @return 0, or -ENOSPC if the disk is full.
+ */
+int frag_alloc(int units, frag_t *f);
+
+/**
+ * Shrink a run, freeing its tail, or grow it in place if the units after
+ * it are free. Shrinking to 0 frees the run; the block goes back to the
+ * block allocator once nothing else lives in it. Freed units are not
+ * handed out again until the transaction that freed them has committed.
+ * Call inside a journal handle.
+ *
+ * @param f The run, updated on success.
+ * @param units New length in units.
+ *
+ * @return 0, or -ENOSPC if the run can't grow in place.
+ */
+int frag_resize(frag_t *f, int units);
+
+/**
+ * Make the units freed by transactions up to tid available again. The
+ * journal calls this once they have committed.
+ *
+ * @param tid Id of the last committed transaction.
+ */
+void frag_release(uint64_t tid);
+
+/**
+ * Return a pointer to the first byte of a run.
+ */
+char *frag_data(const frag_t *f);
+
+#endif
@@ -0,0 +1,104 @@
+/**
+ * Per-inode reader/writer locks.
+ *
+ * A lock object exists only while some thread holds or waits for it. The
+ * objects live in a hash table keyed by inode number, so memory scales
+ * with the inodes in use instead of the size of the inode table. The
+ * table is split into shards with a mutex each, and that mutex is only
+ * held to find the object, never while waiting on the inode lock itself.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "ilock.h"
+
+#define ILOCK_SHARDS 64
+#define ILOCK_BUCKETS 64 // per shard
+
+typedef struct ilock {
+  int inum;
+  int users; // threads holding or waiting for the lock
+  pthread_rwlock_t rw;
+  struct ilock *next;
+} ilock_t;
+
+typedef struct ilock_shard {
+  pthread_mutex_t mu;
+  ilock_t *buckets[ILOCK_BUCKETS];
+  ilock_t *spare; // unused objects, kept with their rwlock initialized
+} ilock_shard_t;
+
+static ilock_shard_t ilock_shards[ILOCK_SHARDS];
+
+static ilock_shard_t *ilock_shard(int inum) {
+  return &ilock_shards[inum % ILOCK_SHARDS];
+}
+
+static ilock_t **ilock_bucket(ilock_shard_t *sh, int inum) {
+  return &sh->buckets[(inum / ILOCK_SHARDS) % ILOCK_BUCKETS];
+}
+
+// Set up the lock table.
+void ilock_init() {
+  for (int i = 0; i < ILOCK_SHARDS; i++) {
+    pthread_mutex_init(&ilock_shards[i].mu, NULL);
+  }
+}
+
+// Find or create the lock object for inum and register as a user.
+static ilock_t *ilock_get(int inum) {
+  assert(inum >= 0);
+  ilock_shard_t *sh = ilock_shard(inum);
+  pthread_mutex_lock(&sh->mu);
+  ilock_t **bucket = ilock_bucket(sh, inum);
+  ilock_t *l = *bucket;
+  while (l && l->inum != inum) {
+    l = l->next;
+  }
+  if (!l) {
+    if (sh->spare) {
+      l = sh->spare;
+      sh->spare = l->next;
+    } else {
+      l = malloc(sizeof(ilock_t));
+      pthread_rwlock_init(&l->rw, NULL);
+    }
+    l->inum = inum;
+    l->users = 0;
+    l->next = *bucket;
+    *bucket = l;
+  }
+  l->users++;
+  pthread_mutex_unlock(&sh->mu);
+  return l;
+}
+
+// Lock an inode for reading.
+void inode_rdlock(int inum) {
+  pthread_rwlock_rdlock(&ilock_get(inum)->rw);
+}
+
+// Lock an inode for writing.
+void inode_wrlock(int inum) {
+  pthread_rwlock_wrlock(&ilock_get(inum)->rw);
+}
+
+// Release an inode lock; the last user retires the lock object.
+void inode_unlock(int inum) {
+  ilock_shard_t *sh = ilock_shard(inum);
+  pthread_mutex_lock(&sh->mu);
+  ilock_t **link = ilock_bucket(sh, inum);
+  while (*link && (*link)->inum != inum) {
+    link = &(*link)->next;
+  }
+  ilock_t *l = *link;
+  assert(l);
+  pthread_rwlock_unlock(&l->rw);
+  if (--l->users == 0) {
+    *link = l->next;
+    l->next = sh->spare;
+    sh->spare = l;
+  }
+  pthread_mutex_unlock(&sh->mu);
+}
@@ -0,0 +1,59 @@
+/**
+ * Per-inode reader/writer locks.
+ *
+ * Readers of an inode (stat, read, directory lookups and listings) share
+ * its lock; anything that changes the inode, its data or, for a
+ * directory, its entries holds it exclusively.
+ *
+ * Lock ordering; take locks in this order and never the other way round:
+ *
+ *   1. the rename lock (storage.c), only for a rename between two
+ *      different directories
+ *   2. inode locks, a directory before anything inside it. Two
+ *      directories that are not ancestor and descendant are only held
+ *      together by a rename between them, under the rename lock, which
+ *      takes the lower inode number first. Two files are only held
+ *      together by a clone between them, lower inode number first
+ *   3. a journal handle (journal.h). journal_start may wait for a commit,
+ *      which waits for every open handle to close, so a thread holding a
+ *      handle must never wait for an inode lock
+ *   4. the open file table lock (storage.c)
+ *   5. the inode allocator lock (inode.c), then the fragment allocator
+ *      lock (frag.c), then the dedup index lock (dedup.c), then the block
+ *      allocator lock (blocks.c), then the journal's own lock
+ *   6. the dentry cache set locks (dcache.c) or the dirty data lock
+ *      (blocks.c); nothing else is taken while holding one
+ *
+ * Path resolution holds at most one directory lock at a time, and only
+ * on a dentry cache miss.
+ */
+#ifndef ILOCK_H
+#define ILOCK_H
+
+/**
+ * Set up the lock table. Call once, before any other thread starts.
+ */
+void ilock_init();
+
+/**
+ * Lock an inode for reading; other readers may hold it at the same time.
+ *
+ * @param inum Inode number.
+ */
+void inode_rdlock(int inum);
+
+/**
+ * Lock an inode for writing.
+ *
+ * @param inum Inode number.
+ */
+void inode_wrlock(int inum);
+
+/**
+ * Release a lock taken by inode_rdlock or inode_wrlock.
+ *
+ * @param inum Inode number.
+ */
+void inode_unlock(int inum);
+
+#endif
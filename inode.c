@@ -1,39 +1,97 @@
 // inode.c
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "inode.h"
 #include "blocks.h"
 #include "bitmap.h"
+#include "compress.h"
+#include "dedup.h"
+#include "journal.h"
+#include "stats.h"
 #include <errno.h> //include this import to return errors so fuse can recognise failures (would just read 1 as a number of bytes)
 
-#define INODE_BLOCK 1
-#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(inode_t))
-#define MAX_INODES INODES_PER_BLOCK
+// Most blocks inode_clone maps in one step. Their refcounts, and those of
+// the blocks of dst they replace, take up to 3 refcount blocks each; with
+// dst's bitmap, extent-tree and inode blocks that stays within
+// JOURNAL_STEP_BLOCKS.
+#define CLONE_STEP_BLOCKS 4096
 
 // Get a pointer to the inode at index inum
 inode_t* get_inode(int inum) {
-  if (inum < 0 || inum >= MAX_INODES) {
+  superblock_t* sb = blocks_get_superblock();
+  if (inum < 0 || inum >= (int)sb->inode_count) {
     return NULL;
   }
-  void* base = blocks_get_block(INODE_BLOCK);
+  void* base = blocks_get_block(sb->inode_table_start);
   return ((inode_t*)base) + inum;
 }
 
+// Number of inodes to create when formatting an image of block_count blocks.
+// NUFS_INODES in the environment overrides the default ratio.
+int inode_count_for(uint32_t block_count) {
+  long count = ((long)block_count * BLOCK_SIZE) / INODE_RATIO;
+  const char* env = getenv("NUFS_INODES");
+  if (env) {
+    count = atol(env);
+  }
+  // always fill whole inode table blocks, with at least one block
+  long per_block = BLOCK_SIZE / INODE_SIZE;
+  if (count < per_block) {
+    count = per_block;
+  }
+  return (count + per_block - 1) / per_block * per_block;
+}
+
+// Get the inode number of an inode in the inode table, or -1 if the
+// pointer does not point into the table
+int inode_get_inum(inode_t* node) {
+  superblock_t* sb = blocks_get_superblock();
+  inode_t* base = blocks_get_block(sb->inode_table_start);
+  if (node < base || node >= base + sb->inode_count) {
+    return -1;
+  }
+  return node - base;
+}
+
+// Guards the inode bitmap and the superblock's inode_hint
+static pthread_mutex_t inode_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
 //allocates a freee inode
+// Starts at the persisted hint, so the scan is short no matter how many
+// inodes are in use.
 int alloc_inode() {
+  superblock_t* sb = blocks_get_superblock();
   void* bm = get_inode_bitmap();
-  for (int i = 1; i < MAX_INODES; i++) {
-      if (!bitmap_get(bm, i)) {
-          bitmap_put(bm, i, 1);
-          inode_t* node = get_inode(i);
-          memset(node, 0, sizeof(inode_t));
-          node->refs = 1;
-          return i;
-      }
+  int max_inodes = sb->inode_count;
+  pthread_mutex_lock(&inode_alloc_lock);
+  int hint = sb->inode_hint;
+  if (hint < 1 || hint >= max_inodes) {
+    hint = 1;
+  }
+  int i = bitmap_next_free(bm, hint, max_inodes);
+  if (i < 0) {
+    i = bitmap_next_free(bm, 1, hint);
+  }
+  if (i < 0) {
+    pthread_mutex_unlock(&inode_alloc_lock);
+    return -ENOSPC;
   }
-  return -ENOSPC;
+  journal_dirty((char*)bm + i / 8);
+  bitmap_put(bm, i, 1);
+  journal_dirty(sb);
+  sb->inode_hint = i + 1;
+  pthread_mutex_unlock(&inode_alloc_lock);
+  inode_t* node = get_inode(i);
+  journal_dirty(node);
+  memset(node, 0, sizeof(inode_t));
+  node->refs = 1;
+  return i;
 }
 
 // frees an inode and release all of its blocks.
@@ -43,101 +101,521 @@ void free_inode(int inum) {
     return;
   }
 
-  // free direct blocks
-  int nblocks = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  for (int b = 0; b < nblocks && b < NDIRECT; b++) {
-      if (node->direct[b] != 0) {
-          free_block(node->direct[b]);
+  shrink_inode(node, 0);
+  blocks_forget_dirty(inum);
+  journal_dirty(node);
+  memset(node, 0, sizeof(inode_t));
+
+  pthread_mutex_lock(&inode_alloc_lock);
+  void* bm = get_inode_bitmap();
+  journal_dirty((char*)bm + inum / 8);
+  bitmap_put(bm, inum, 0);
+  // keep the hint at the lowest known free inode
+  superblock_t* sb = blocks_get_superblock();
+  if (inum < (int)sb->inode_hint) {
+    journal_dirty(sb);
+    sb->inode_hint = inum;
+  }
+  pthread_mutex_unlock(&inode_alloc_lock);
+}
+
+static int inode_layout(inode_t* node, int64_t new_size, int write);
+
+//Grow an inode to new_size bytes
+// A file's new range is a hole until something is written to it (see
+// inode_fill_holes). Directories get their blocks at once, from the
+// metadata zone; between blocks the size covers what is mapped so far, so
+// a big grow can move on to a new transaction there (journal_restart).
+int grow_inode(inode_t* node, int64_t new_size) {
+  int64_t new_blocks = bytes_to_blocks(new_size);
+  if (new_blocks > UINT32_MAX) {
+    return -EFBIG; // past the last logical block an extent can map
+  }
+  int rv = inode_layout(node, new_size, 0);
+  if (rv < 0) {
+    return rv;
+  }
+  if (S_ISDIR(node->mode)) {
+    int64_t old_size = node->size;
+    int64_t old_blocks = bytes_to_blocks(node->size);
+    for (int64_t b = old_blocks; b < new_blocks; b++) {
+      if (b > old_blocks) {
+        journal_dirty(node);
+        node->size = b * BLOCK_SIZE;
+        journal_restart();
       }
+      int bnum = alloc_meta_block();
+      int rv = bnum < 0 ? -ENOSPC : extent_insert(&node->extents, b, bnum, 1);
+      if (rv < 0) {
+        if (bnum >= 0) {
+          free_block(bnum);
+        }
+        // give back what this call allocated
+        journal_dirty(node);
+        node->size = b * BLOCK_SIZE;
+        shrink_inode(node, old_size);
+        return rv;
+      }
+      journal_dirty(node);
+      node->blocks++;
+    }
   }
-  // free indirect blocks
-  if (nblocks > NDIRECT && node->indirect != 0) {
-      int* iblock = (int*)blocks_get_block(node->indirect);
-      int rem = nblocks - NDIRECT;
-      for (int i = 0; i < rem && i < NINDIRECT; i++) {
-          if (iblock[i] != 0) free_block(iblock[i]);
+  journal_dirty(node);
+  node->size = new_size;
+  return 0;
+}
+
+// Allocate blocks for the holes in [offset, offset+size) of a file, so a
+// write can go there. New blocks are requested as contiguous runs that
+// continue right after the block before the hole, so files written in
+// order end up laid out in order. Parts of new blocks that the write
+// won't cover are zeroed. The size is left alone.
+int inode_fill_holes(inode_t* node, int64_t offset, int64_t size) {
+  assert(!(node->flags & (INODE_INLINE | INODE_FRAG)));
+  int64_t end = offset + size;
+  int64_t first = offset / BLOCK_SIZE;
+  int64_t end_blk = bytes_to_blocks(end);
+  if (end_blk > UINT32_MAX) {
+    return -EFBIG;
+  }
+  int inum = inode_get_inum(node);
+  int64_t b = first;
+  while (b < end_blk) {
+    uint32_t run;
+    uint32_t bnum = extent_lookup(&node->extents, b, &run);
+    if (run > end_blk - b) {
+      run = end_blk - b;
+    }
+    if (bnum != 0) {
+      b += run;
+      continue;
+    }
+    int goal = b > 0 ? inode_get_bnum(node, b - 1) + 1 : 0;
+    while (run > 0) {
+      int got = 1;
+      // one extent's worth at most, so a run dirties few bitmap blocks
+      int start = alloc_blocks(run > EXT_MAX_LEN ? EXT_MAX_LEN : run, goal, &got);
+      // only the first and last block can be partly written: zero them
+      // before they are mapped
+      blocks_io_t edge[2];
+      int nedge = 0;
+      if (b == first && offset % BLOCK_SIZE != 0) {
+        blocks_io_t io = {start, 0, BLOCK_SIZE, NULL};
+        edge[nedge++] = io;
+      }
+      if (b + got == end_blk && end % BLOCK_SIZE != 0) {
+        blocks_io_t io = {start + got - 1, 0, BLOCK_SIZE, NULL};
+        edge[nedge++] = io;
+      }
+      int rv = start < 0 ? -ENOSPC : blocks_write(edge, nedge);
+      if (rv == 0) {
+        rv = extent_insert(&node->extents, b, start, got);
+      }
+      if (rv < 0) {
+        if (start >= 0) {
+          free_blocks(start, got);
+        }
+        // blocks mapped past the end would be lost to the file; holes
+        // filled inside it just read as zeros
+        shrink_inode(node, node->size);
+        return rv;
+      }
+      journal_dirty(node);
+      node->blocks += got;
+      for (int i = 0; i < nedge; i++) {
+        blocks_mark_dirty(inum, edge[i].bnum, 1);
       }
-      free_block(node->indirect);
+      b += got;
+      run -= got;
+      goal = start + got;
+      journal_restart();
+    }
   }
-  memset(node, 0, sizeof(inode_t));
-  bitmap_put(get_inode_bitmap(), inum, 0);
+  return 0;
+}
+
+// Give the n shared blocks at lblk, mapped from pblk on, copies of their
+// own, in up to EXT_REMAP_MAX runs. Copies fewer than n when the free
+// space is that broken up, and returns how many, or -ENOSPC.
+static int inode_copy_shared(inode_t* node, uint32_t lblk, uint32_t pblk,
+                             uint32_t n) {
+  extent_t runs[EXT_REMAP_MAX];
+  int count = 0;
+  uint32_t have = 0;
+  int goal = pblk;
+  while (have < n && count < EXT_REMAP_MAX) {
+    int got;
+    int start = alloc_blocks(n - have, goal, &got);
+    if (start < 0) {
+      break;
+    }
+    extent_t run = {lblk + have, start, got, 0};
+    runs[count++] = run;
+    have += got;
+    goal = start + got;
+  }
+  // copy first: once the remap drops this file's references, the last
+  // file left holding the old blocks may write them in place
+  int inum = inode_get_inum(node);
+  int freed = count > 0 ? 0 : -ENOSPC;
+  for (int i = 0; i < count && freed == 0; i++) {
+    uint32_t from = pblk + (runs[i].lblk - lblk);
+    void *data = blocks_get(from, runs[i].len);
+    blocks_io_t io = {runs[i].pblk, 0, (size_t) runs[i].len * BLOCK_SIZE,
+                      data};
+    freed = data ? blocks_write(&io, 1) : -EIO;
+    if (data) {
+      blocks_put(data, from, runs[i].len, 0);
+    }
+    blocks_mark_dirty(inum, runs[i].pblk, runs[i].len);
+  }
+  if (freed == 0) {
+    freed = extent_remap(&node->extents, runs, count);
+  }
+  if (freed < 0) {
+    for (int i = 0; i < count; i++) {
+      free_blocks(runs[i].pblk, runs[i].len);
+    }
+    return freed;
+  }
+  journal_dirty(node);
+  node->blocks += have - freed;
+  stats_add(ST_COW_BLOCKS, have);
+  return have;
+}
+
+// Copy the shared blocks in [offset, offset+size) of a file (see
+// blocks_ref), so a write can go there in place. The other blocks are
+// taken out of the dedup index first, so that none of them becomes shared
+// while the write is under way. Compressed clusters are left alone: a
+// write expands them into new blocks anyway.
+int inode_unshare(inode_t* node, int64_t offset, int64_t size) {
+  if (size <= 0 || node->blocks == 0 || inode_small_data(node)) {
+    return 0;
+  }
+  int64_t b = offset / BLOCK_SIZE;
+  int64_t end_blk = bytes_to_blocks(offset + size);
+  if (end_blk > UINT32_MAX) {
+    end_blk = UINT32_MAX;
+  }
+  while (b < end_blk) {
+    uint32_t run;
+    uint16_t flags;
+    uint32_t bnum = extent_lookup_flags(&node->extents, b, &run, &flags);
+    if (run > end_blk - b) {
+      run = end_blk - b;
+    }
+    if (bnum == 0 || (flags & EXT_COMPRESSED)) {
+      b += run;
+      continue;
+    }
+    dedup_forget(bnum, run);
+    uint32_t skip = 0;
+    while (skip < run && !blocks_shared(bnum + skip)) {
+      skip++;
+    }
+    if (skip == run) {
+      b += run;
+      continue;
+    }
+    uint32_t n = 1;
+    while (skip + n < run && blocks_shared(bnum + skip + n)) {
+      n++;
+    }
+    int rv = inode_copy_shared(node, b + skip, bnum + skip, n);
+    if (rv < 0) {
+      return rv;
+    }
+    b += skip + rv;
+  }
+  return 0;
 }
 
-//Grow an inode to at least new_size bytes by allocating additional blocks
-int grow_inode(inode_t* node, int new_size) {
-  int old_blocks = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  int new_blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  for (int b = old_blocks; b < new_blocks; b++) {
-      int bnum = alloc_block();
-      if (bnum < 0) {
-        return -ENOSPC;
+// Map [lblk, lblk+n) of src into dst at dst_lblk, sharing the blocks
+// (see blocks_ref) and freeing what dst mapped there, which must not cut
+// a compressed extent. Only metadata is copied. A compressed cluster of
+// src can only be shared whole and on a cluster boundary of dst, so a
+// range that would split one fails with -EINVAL before anything changes.
+// Later failures (-ENOSPC, -EMLINK) leave the blocks shared so far mapped.
+int inode_clone(inode_t* dst, uint32_t dst_lblk, inode_t* src, uint32_t lblk,
+                uint32_t n) {
+  for (int pass = 0; pass < 2; pass++) {
+    uint32_t done = 0;
+    while (done < n) {
+      uint32_t run;
+      uint16_t flags;
+      uint32_t pblk =
+          extent_lookup_flags(&src->extents, lblk + done, &run, &flags);
+      if (run > n - done) {
+        run = n - done;
       }
-      if (b < NDIRECT) {
-          node->direct[b] = bnum;
-      } else {
-          // first time indirect needed
-          if (node->indirect == 0) {
-              node->indirect = alloc_block();
-              if (node->indirect < 0) {
-                return -ENOSPC;
-              }
-              // zero out the indirect block
-              memset(blocks_get_block(node->indirect), 0, BLOCK_SIZE);
+      // a long extent is shared a step at a time (compressed ones are
+      // shorter than a step, so never cut)
+      if (run > CLONE_STEP_BLOCKS) {
+        run = CLONE_STEP_BLOCKS;
+      }
+      if (pblk == 0) {
+        // a hole in src is a hole in dst
+        int freed = pass == 1 ? extent_remove(&dst->extents, dst_lblk + done, run) : 0;
+        if (freed < 0) {
+          return freed;
+        }
+        if (freed > 0) {
+          journal_dirty(dst);
+          dst->blocks -= freed;
+          journal_restart();
+        }
+        done += run;
+        continue;
+      }
+      extent_t ext = {dst_lblk + done, pblk, run, flags};
+      int plen = run;
+      if (flags & EXT_COMPRESSED) {
+        if ((lblk + done) % CLUSTER_BLOCKS != 0 || run < CLUSTER_BLOCKS ||
+            ext.lblk % CLUSTER_BLOCKS != 0) {
+          return -EINVAL;
+        }
+        plen = flags & EXT_PLEN;
+      }
+      if (pass == 1) {
+        int rv = blocks_ref(pblk, plen);
+        if (rv == 0) {
+          rv = extent_remap(&dst->extents, &ext, 1);
+          if (rv < 0) {
+            free_blocks(pblk, plen);
           }
-          int* iblock = (int*)blocks_get_block(node->indirect);
-          iblock[b - NDIRECT] = bnum;
+        }
+        if (rv < 0) {
+          return rv;
+        }
+        journal_dirty(dst);
+        dst->blocks += plen - rv;
+        journal_restart();
       }
+      done += run;
+    }
   }
-  node->size = new_size;
   return 0;
 }
 
-// Shrink an inode to new_size bytes by freeing blocks no longer needed
-int shrink_inode(inode_t* node, int new_size) {
-  int old_blocks = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  int new_blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  // free blocks above new_blocks
-  for (int b = new_blocks; b < old_blocks; b++) {
-      if (b < NDIRECT) {
-          free_block(node->direct[b]);
-          node->direct[b] = 0;
-      } else if (node->indirect) {
-          int* iblock = (int*)blocks_get_block(node->indirect);
-          free_block(iblock[b - NDIRECT]);
-          iblock[b - NDIRECT] = 0;
+// The data of an inline or fragment file, or NULL for one in blocks.
+char* inode_small_data(inode_t* node) {
+  if (node->flags & INODE_INLINE) {
+    return node->inline_data;
+  }
+  if (node->flags & INODE_FRAG) {
+    return frag_data(&node->frag);
+  }
+  return NULL;
+}
+
+static int frag_units_for(int64_t size) {
+  return (size + FRAG_SIZE - 1) / FRAG_SIZE;
+}
+
+// Move a file's data to where a file of new_size bytes keeps it: inline,
+// in a fragment or in blocks. On failure the file is left as it was.
+static int inode_move(inode_t* node, int64_t new_size) {
+  int inum = inode_get_inum(node);
+  int64_t keep = node->size; // at most INODE_FRAG_MAX here
+  char* saved = malloc(BLOCK_SIZE);
+  char* src = inode_small_data(node);
+  if (src) {
+    memcpy(saved, src, keep);
+  } else {
+    memset(saved, 0, keep); // no blocks: all hole
+  }
+  int old_flags = node->flags;
+  extent_root_t old_root = node->extents;
+  frag_t old_frag = node->frag;
+
+  journal_dirty(node);
+  memset(&node->extents, 0, sizeof(extent_root_t));
+  node->flags &= ~(INODE_INLINE | INODE_FRAG);
+  char* dst = NULL;
+  int rv = 0;
+  if (new_size <= INODE_INLINE_MAX) {
+    node->flags |= INODE_INLINE;
+    dst = node->inline_data;
+  } else if (new_size <= INODE_FRAG_MAX) {
+    rv = frag_alloc(frag_units_for(new_size), &node->frag);
+    if (rv == 0) {
+      node->flags |= INODE_FRAG;
+      dst = frag_data(&node->frag);
+      memset(dst, 0, (size_t) node->frag.units * FRAG_SIZE);
+      blocks_mark_dirty(inum, node->frag.block, 1);
+    }
+  } else if (keep > 0) {
+    // the write is partial, so the rest of the block is zeroed
+    rv = inode_fill_holes(node, 0, keep);
+    if (rv == 0) {
+      uint32_t bnum = extent_lookup(&node->extents, 0, NULL);
+      blocks_io_t io = {bnum, 0, keep, saved};
+      rv = blocks_write(&io, 1);
+      if (rv < 0) {
+        free_blocks(bnum, 1);
+        node->blocks -= 1;
+      } else {
+        blocks_mark_dirty(inum, bnum, 1);
       }
+    }
+  }
+  if (rv < 0) {
+    node->extents = old_root;
+    node->flags = old_flags;
+  } else {
+    if (dst) {
+      memcpy(dst, saved, keep);
+    }
+    if (old_flags & INODE_FRAG) {
+      frag_resize(&old_frag, 0);
+    }
+  }
+  free(saved);
+  return rv;
+}
+
+// Get a regular file's data ready to hold new_size bytes. Returns
+// INODE_INLINE or INODE_FRAG if that is where the data now lives, or 0
+// for blocks. Files move up from inline to a fragment to blocks as they
+// grow, never back (except through truncating to 0). A file with no data
+// yet (empty, or all hole) only becomes small for a write: one that is
+// just truncated up stays sparse.
+static int inode_layout(inode_t* node, int64_t new_size, int write) {
+  int small = node->flags & (INODE_INLINE | INODE_FRAG);
+  if (!S_ISREG(node->mode)) {
+    return 0;
+  }
+  if (!small && (node->blocks > 0 || !write || new_size == 0 ||
+                 new_size > INODE_FRAG_MAX)) {
+    return 0;
   }
-  // if we dropped back below direct threshold, free indirect block
-  if (new_blocks <= NDIRECT && node->indirect) {
-      free_block(node->indirect);
-      node->indirect = 0;
+  if (small == INODE_INLINE && new_size <= INODE_INLINE_MAX) {
+    return small;
+  }
+  if (small == INODE_FRAG && new_size <= INODE_FRAG_MAX) {
+    int units = frag_units_for(new_size);
+    int old_units = node->frag.units;
+    if (units <= old_units) {
+      return small;
+    }
+    // grow in place when the next units are free; they are not zeroed
+    frag_t f = node->frag;
+    if (frag_resize(&f, units) == 0) {
+      journal_dirty(node);
+      node->frag = f;
+      memset(frag_data(&f) + (size_t) old_units * FRAG_SIZE, 0,
+             (size_t) (units - old_units) * FRAG_SIZE);
+      blocks_mark_dirty(inode_get_inum(node), f.block, 1);
+      return small;
+    }
+  }
+  int rv = inode_move(node, new_size);
+  return rv < 0 ? rv : node->flags & (INODE_INLINE | INODE_FRAG);
+}
+
+// Get a file ready for a write of [offset, offset+size): returns
+// INODE_INLINE or INODE_FRAG if the write goes to inode_small_data, 0 if
+// it goes to blocks, or a negative errno.
+int inode_prepare_write(inode_t* node, int64_t offset, int64_t size) {
+  int64_t end = offset + size;
+  int rv = inode_layout(node, end > node->size ? end : node->size, 1);
+  if (rv == INODE_INLINE) {
+    journal_dirty(node);
+  }
+  return rv;
+}
+
+// Shrink an inode to new_size bytes by freeing blocks no longer needed
+// Extents go one at a time from the end, with the size cut back to match
+// after each, so a big file can be freed over several transactions.
+// Holes cost nothing here: only mapped extents are visited.
+int shrink_inode(inode_t* node, int64_t new_size) {
+  // a compressed cluster only goes whole: expand one the end cuts into
+  if (new_size < node->size && new_size % CLUSTER_SIZE != 0) {
+    int rv = compress_expand(node, new_size, 1);
+    if (rv < 0) {
+      return rv;
+    }
   }
+  // the tail of the new last block is zeroed below, in place
+  if (new_size < node->size && new_size % BLOCK_SIZE != 0) {
+    int rv = inode_unshare(node, new_size, 1);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+  char* small = inode_small_data(node);
+  if (small) {
+    journal_dirty(node);
+    if (new_size < node->size) {
+      memset(small + new_size, 0, node->size - new_size);
+    }
+    if (node->flags & INODE_FRAG) {
+      blocks_mark_dirty(inode_get_inum(node), node->frag.block, 1);
+      // the tail's units go back to be shared
+      frag_resize(&node->frag, frag_units_for(new_size));
+    }
+    if (new_size == 0) {
+      // back to an ordinary empty file
+      memset(&node->extents, 0, sizeof(extent_root_t));
+      node->flags &= ~(INODE_INLINE | INODE_FRAG);
+    }
+    node->size = new_size;
+    return 0;
+  }
+  int64_t old_size = node->size;
+  int64_t new_blocks = bytes_to_blocks(new_size);
+  uint32_t lblk, len;
+  while (extent_last(&node->extents, &lblk, &len) == 0 &&
+         lblk + (int64_t)len > new_blocks) {
+    if (lblk < new_blocks) {
+      lblk = new_blocks;
+    }
+    int rv = extent_remove(&node->extents, lblk, UINT32_MAX);
+    if (rv < 0) {
+      return rv;
+    }
+    journal_dirty(node);
+    node->blocks -= rv;
+    if ((int64_t)lblk * BLOCK_SIZE < node->size) {
+      node->size = (int64_t)lblk * BLOCK_SIZE;
+    }
+    if (node->size < new_size) {
+      node->size = new_size;
+    }
+    journal_restart();
+  }
+  // bytes past the end of a file's last block stay zero, so growing it
+  // again reads zeros there and not what was cut off
+  if (!S_ISDIR(node->mode) && new_size < old_size && new_size % BLOCK_SIZE) {
+    uint32_t bnum = extent_lookup(&node->extents, new_size / BLOCK_SIZE, NULL);
+    if (bnum != 0) {
+      blocks_io_t io = {bnum, new_size % BLOCK_SIZE,
+                        BLOCK_SIZE - new_size % BLOCK_SIZE, NULL};
+      blocks_write(&io, 1);
+      blocks_mark_dirty(inode_get_inum(node), bnum, 1);
+    }
+  }
+  journal_dirty(node);
   node->size = new_size;
   return 0;
 }
 
-//get the bnum for a inode
+//get the bnum for a inode (0 if the block is not mapped)
+// For a block in a compressed cluster, the first block holding the cluster.
 int inode_get_bnum(inode_t* node, int file_block) {
   if (file_block < 0) {
     return -EINVAL;
   }
-  if (file_block < NDIRECT) {
-      return node->direct[file_block];
-  }
-  if (node->indirect == 0) {
-    return -EFBIG;
-  }
-  int* iblock = (int*)blocks_get_block(node->indirect);
-  int idx = file_block - NDIRECT;
-  if (idx < 0 || idx >= NINDIRECT) {
-    return -EFBIG;
-  }
-  return iblock[idx];
+  uint16_t flags;
+  return extent_lookup_flags(&node->extents, file_block, NULL, &flags);
 }
 
 //Print the inode
 void print_inode(inode_t* node) {
-  printf("INODE {refs: %d, mode: %04o, size: %d, direct[0]=%d, indirect=%d}\n",
-         node->refs, node->mode, node->size,
-         node->direct[0], node->indirect);
-}
\ No newline at end of file
+  printf("INODE {refs: %d, mode: %04o, size: %lld, blocks: %u, extents: %d, "
+         "depth: %d}\n",
+         node->refs, node->mode, (long long) node->size, node->blocks,
+         extent_count(&node->extents), node->extents.hdr.depth);
+}
@@ -2,29 +2,65 @@
 //
 #ifndef INODE_H
 #define INODE_H
-// Number of direct block pointers
-#define NDIRECT 12
-// Number of pointers stored in an indirect block
-#define NINDIRECT (BLOCK_SIZE / sizeof(int))
+// On-disk size of an inode record: two whole cache lines, so no record
+// straddles a line and a block holds BLOCK_SIZE / INODE_SIZE records
+#define INODE_SIZE 128
+// Default bytes of disk per inode when sizing the inode table at format time
+#define INODE_RATIO 16384
+#include <stdint.h>
+
 #include "blocks.h"
+#include "extent.h"
+#include "frag.h"
 
 
 
 typedef struct inode {
   int refs;  // reference count
   int mode;  // permission & type
-  int size;  // bytes
-  //changed this to handle larger files
-  int direct[NDIRECT];     // direct block numbers (0 if unused)
-  int indirect;            // block number of indirect block (0 if none)
+  int64_t size; // bytes
+  int flags; // INODE_* flags below
+  uint32_t blocks; // data blocks mapped; holes don't count
+  union {
+    extent_root_t extents; // block map (see extent.h)
+    char inline_data[sizeof(extent_root_t)]; // contents, if INODE_INLINE
+    frag_t frag; // where the contents are, if INODE_FRAG
+  };
+  char _reserved[INODE_SIZE - 3 * sizeof(int) - sizeof(int64_t) -
+                 sizeof(uint32_t) - sizeof(extent_root_t)]; // pad to INODE_SIZE
 } inode_t;
 
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode_t must be INODE_SIZE bytes");
+
+// inode_t.flags
+#define INODE_DIR_INDEXED 0x1 // directory uses the hashed index (directory.c)
+#define INODE_INLINE 0x2      // file data is in inline_data, not in blocks
+#define INODE_FRAG 0x4        // file data is in a fragment (frag.h)
+#define INODE_COMPRESS 0x8    // compress new data (compress.h); directories
+                              // pass it on to what is created in them
+#define INODE_READONLY 0x10   // part of a snapshot (snapshot.h): nothing
+                              // may change it
+
+// Largest file kept inline. Bytes of inline_data past the size are zero.
+#define INODE_INLINE_MAX ((int64_t) sizeof(extent_root_t))
+// Largest file kept in a fragment; one any bigger might as well have a
+// block. Bytes of the fragment past the size are zero too.
+#define INODE_FRAG_MAX ((int64_t) BLOCK_SIZE - FRAG_SIZE)
+
+int inode_count_for(uint32_t block_count);
 void print_inode(inode_t *node);
 inode_t *get_inode(int inum);
+int inode_get_inum(inode_t *node);
 int alloc_inode();
 void free_inode();
-int grow_inode(inode_t *node, int size);
-int shrink_inode(inode_t *node, int size);
+int grow_inode(inode_t *node, int64_t size);
+int inode_fill_holes(inode_t *node, int64_t offset, int64_t size);
+int inode_unshare(inode_t *node, int64_t offset, int64_t size);
+int inode_clone(inode_t *dst, uint32_t dst_lblk, inode_t *src, uint32_t lblk,
+                uint32_t n);
+int inode_prepare_write(inode_t *node, int64_t offset, int64_t size);
+char *inode_small_data(inode_t *node);
+int shrink_inode(inode_t *node, int64_t size);
 int inode_get_bnum(inode_t *node, int file_bnum);
 
-#endif
\ No newline at end of file
+#endif
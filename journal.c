@@ -0,0 +1,571 @@
+/**
+ * Write-ahead journal for metadata.
+ *
+ * Physical block journaling as in ext3's jbd: a record is a header block
+ * listing home block numbers, the images of those blocks, and a commit
+ * block with a checksum over the rest. Records always start at the first
+ * block of the journal region; a commit is checkpointed before the next
+ * one is written, so there is never more than one record to replay.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "frag.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
+
+#define JOURNAL_MIN_BLOCKS (2 * JOURNAL_STEP_BLOCKS + 2) // two handles
+#define JOURNAL_MAX_BLOCKS 1022 // one header block lists at most 1020 blocks
+#define JOURNAL_REVOKED UINT32_MAX
+#define JOURNAL_TCACHE 8
+
+// The running transaction
+typedef struct jtx {
+  uint64_t tid;
+  uint32_t *blocks; // blocks dirtied, in order; JOURNAL_REVOKED once freed
+  int count, cap;
+  int *slots;       // hash of blocks: index in blocks + 1, or 0 if empty
+  int nslots;       // a power of two, at least twice cap
+  int shared;       // entries in the data area (see journal_forget)
+  int handles;      // open handles
+  int reserved;     // credits the open handles have not used yet
+  int locked;       // being closed; new handles wait
+} jtx_t;
+
+static int j_fd = -1;
+static uint32_t j_start, j_blocks; // the journal region
+static int j_capacity;             // block images per record
+static int j_credits;              // blocks reserved for each open handle
+static jtx_t j_tx;
+// Blocks of the transaction being written, which come back into the
+// running one if the write fails. The running transaction, what its
+// handles have reserved and these always fit in one record.
+static int j_committing;
+static uint64_t j_written; // last transaction checkpointed (or abandoned)
+static uint64_t j_durable; // last transaction whose record was written
+// Guards j_tx, j_written and j_durable; never held while waiting for
+// anything else
+static pthread_mutex_t j_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t j_cond = PTHREAD_COND_INITIALIZER;
+
+// Set by journal_freeze: handles from other threads wait until it thaws
+static int j_frozen;
+static pthread_t j_freezer;
+
+static pthread_t j_thread;
+static int j_thread_running, j_stopping;
+static int j_interval_ms = 5000;
+static pthread_cond_t j_timer = PTHREAD_COND_INITIALIZER;
+
+static __thread int j_nest;          // depth of the calling thread's handles
+static __thread uint64_t j_my_tid;   // transaction of the outermost handle
+static __thread int j_my_dirtied;    // blocks it added to the transaction
+// Blocks the calling thread's handle already added, so dirtying the same
+// block again skips the lock. Only metadata-area blocks, which are never
+// revoked, are cached.
+static __thread uint32_t j_tcache[JOURNAL_TCACHE];
+static __thread uint64_t j_tcache_tid[JOURNAL_TCACHE];
+
+// Blocks in the journal for an image of block_count blocks.
+uint32_t journal_size_for(uint32_t block_count) {
+  uint32_t n = block_count / 64;
+  if (n < JOURNAL_MIN_BLOCKS) {
+    n = JOURNAL_MIN_BLOCKS;
+  }
+  return n < JOURNAL_MAX_BLOCKS ? n : JOURNAL_MAX_BLOCKS;
+}
+
+static uint64_t journal_checksum(uint64_t h, const void *data, size_t len) {
+  const uint64_t *w = data;
+  for (size_t i = 0; i < len / sizeof(uint64_t); i++) {
+    h = (h ^ w[i]) * 0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+static int journal_pwrite(const void *buf, size_t len, uint64_t bnum) {
+  off_t off = (off_t) bnum * BLOCK_SIZE;
+  while (len > 0) {
+    ssize_t n = pwrite(j_fd, buf, len, off);
+    if (n < 0) {
+      return -errno;
+    }
+    buf = (const char *) buf + n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+static int journal_pread(void *buf, size_t len, uint64_t bnum) {
+  ssize_t n = pread(j_fd, buf, len, (off_t) bnum * BLOCK_SIZE);
+  return n == (ssize_t) len ? 0 : -EIO;
+}
+
+// Index in j_tx.blocks of bnum, or -1
+static int tx_find(jtx_t *tx, uint32_t bnum) {
+  int mask = tx->nslots - 1;
+  for (int h = (bnum * 2654435761u) & mask; tx->slots[h]; h = (h + 1) & mask) {
+    if (tx->blocks[tx->slots[h] - 1] == bnum) {
+      return tx->slots[h] - 1;
+    }
+  }
+  return -1;
+}
+
+static void tx_slot_put(jtx_t *tx, int idx) {
+  int mask = tx->nslots - 1;
+  int h = (tx->blocks[idx] * 2654435761u) & mask;
+  while (tx->slots[h]) {
+    h = (h + 1) & mask;
+  }
+  tx->slots[h] = idx + 1;
+}
+
+// Add bnum to the transaction; returns 1 if it was not already there
+static int tx_add(jtx_t *tx, uint32_t bnum) {
+  if (tx_find(tx, bnum) >= 0) {
+    return 0;
+  }
+  if (tx->count == tx->cap) {
+    tx->cap *= 2;
+    tx->blocks = realloc(tx->blocks, tx->cap * sizeof(uint32_t));
+    tx->nslots = tx->cap * 2;
+    free(tx->slots);
+    tx->slots = calloc(tx->nslots, sizeof(int));
+    for (int i = 0; i < tx->count; i++) {
+      if (tx->blocks[i] != JOURNAL_REVOKED) {
+        tx_slot_put(tx, i);
+      }
+    }
+  }
+  tx->blocks[tx->count] = bnum;
+  tx_slot_put(tx, tx->count++);
+  if (bnum >= blocks_get_superblock()->data_start) {
+    tx->shared++;
+  }
+  return 1;
+}
+
+static void tx_reset(jtx_t *tx, uint64_t tid) {
+  tx->tid = tid;
+  tx->count = 0;
+  tx->reserved = 0;
+  tx->shared = 0;
+  tx->locked = 0;
+  if (!tx->blocks) {
+    tx->cap = 64;
+    tx->blocks = malloc(tx->cap * sizeof(uint32_t));
+    tx->nslots = tx->cap * 2;
+    tx->slots = calloc(tx->nslots, sizeof(int));
+  } else {
+    memset(tx->slots, 0, tx->nslots * sizeof(int));
+  }
+}
+
+// Would one more handle overrun the journal?
+static int tx_full(jtx_t *tx) {
+  return tx->count + tx->reserved + j_committing + j_credits > j_capacity;
+}
+
+// Write one record and flush it, then write its blocks home and flush
+// again. Blocks in the data area are shared with the page cache and
+// already hold what they should; only the fsync is needed for them.
+static int journal_write(uint64_t tid, const uint32_t *blocks, const char *images,
+                         int count) {
+  journal_header_t *hdr = calloc(1, BLOCK_SIZE);
+  journal_commit_t *commit = calloc(1, BLOCK_SIZE);
+  hdr->magic = JOURNAL_MAGIC;
+  hdr->count = count;
+  hdr->tid = tid;
+  memcpy(hdr->blocks, blocks, count * sizeof(uint32_t));
+  commit->magic = JOURNAL_COMMIT_MAGIC;
+  commit->count = count;
+  commit->tid = tid;
+  commit->checksum = journal_checksum(journal_checksum(tid, hdr, BLOCK_SIZE),
+                                      images, (size_t) count * BLOCK_SIZE);
+
+  // the checksum covers the images, so one flush orders the whole record
+  int rv = journal_pwrite(hdr, BLOCK_SIZE, j_start);
+  if (rv == 0) {
+    rv = journal_pwrite(images, (size_t) count * BLOCK_SIZE, j_start + 1);
+  }
+  if (rv == 0) {
+    rv = journal_pwrite(commit, BLOCK_SIZE, j_start + 1 + count);
+  }
+  if (rv == 0 && fdatasync(j_fd) < 0) {
+    rv = -errno;
+  }
+
+  uint32_t data_start = blocks_get_superblock()->data_start;
+  for (int i = 0; rv == 0 && i < count; i++) {
+    if (blocks[i] < data_start) {
+      rv = journal_pwrite(images + (size_t) i * BLOCK_SIZE, BLOCK_SIZE,
+                          blocks[i]);
+    }
+  }
+  if (rv == 0 && fdatasync(j_fd) < 0) {
+    rv = -errno;
+  }
+  free(hdr);
+  free(commit);
+  return rv;
+}
+
+// Close the running transaction and write it out. Returns the id of the
+// last transaction that has to be at home for everything dirtied before
+// the call to be there.
+static uint64_t journal_commit() {
+  pthread_mutex_lock(&j_lock);
+  jtx_t *tx = &j_tx;
+  uint64_t tid = tx->tid;
+  if (tx->locked) {
+    // someone else is closing it
+    pthread_mutex_unlock(&j_lock);
+    return tid;
+  }
+  if (tx->count == 0) {
+    pthread_mutex_unlock(&j_lock);
+    return tid - 1;
+  }
+
+  uint64_t start = stats_now();
+  tx->locked = 1;
+  while (tx->handles > 0) {
+    pthread_cond_wait(&j_cond, &j_lock);
+  }
+  // copy the images out, so new handles can change the blocks while
+  // this transaction is written
+  int count = 0;
+  uint32_t *blocks = malloc(tx->count * sizeof(uint32_t));
+  char *images = malloc((size_t) tx->count * BLOCK_SIZE);
+  for (int i = 0; i < tx->count; i++) {
+    if (tx->blocks[i] != JOURNAL_REVOKED) {
+      blocks[count] = tx->blocks[i];
+      memcpy(images + (size_t) count * BLOCK_SIZE,
+             blocks_get_block(tx->blocks[i]), BLOCK_SIZE);
+      count++;
+    }
+  }
+  assert(count <= j_capacity);
+  j_committing = count;
+  tx_reset(tx, tid + 1);
+  pthread_cond_broadcast(&j_cond);
+
+  // records go out in transaction order
+  while (j_written != tid - 1) {
+    pthread_cond_wait(&j_cond, &j_lock);
+  }
+  pthread_mutex_unlock(&j_lock);
+
+  int rv = journal_write(tid, blocks, images, count);
+
+  pthread_mutex_lock(&j_lock);
+  if (rv < 0) {
+    // try again with the next transaction
+    fprintf(stderr, "nufs: journal commit %llu failed: %s\n",
+            (unsigned long long) tid, strerror(-rv));
+    for (int i = 0; i < count; i++) {
+      tx_add(tx, blocks[i]);
+    }
+  }
+  j_committing = 0;
+  j_written = tid;
+  if (rv == 0) {
+    j_durable = tid;
+  }
+  pthread_cond_broadcast(&j_cond);
+  pthread_mutex_unlock(&j_lock);
+
+  if (rv == 0) {
+    blocks_release_frees(tid);
+    frag_release(tid);
+  }
+  free(blocks);
+  free(images);
+  stats_op(ST_JOURNAL_COMMIT, start);
+  stats_add(ST_JOURNAL_BLOCKS, count);
+  TRACE(TRACE_OPS, TR_COMMIT, -1, tid, count, rv);
+  return tid;
+}
+
+// Bring the home locations up to date with the record in the journal,
+// if it is complete. Returns the id the next transaction should use.
+static uint64_t journal_replay() {
+  journal_header_t *hdr = malloc(BLOCK_SIZE);
+  journal_commit_t *commit = malloc(BLOCK_SIZE);
+  uint64_t next = 1;
+  int rv = journal_pread(hdr, BLOCK_SIZE, j_start);
+  if (rv < 0 || hdr->magic != JOURNAL_MAGIC || hdr->count == 0 ||
+      (int) hdr->count > j_capacity) {
+    free(hdr);
+    free(commit);
+    return next;
+  }
+  next = hdr->tid + 1;
+
+  int count = hdr->count;
+  char *images = malloc((size_t) count * BLOCK_SIZE);
+  rv = journal_pread(images, (size_t) count * BLOCK_SIZE, j_start + 1);
+  if (rv == 0) {
+    rv = journal_pread(commit, BLOCK_SIZE, j_start + 1 + count);
+  }
+  uint32_t block_count = blocks_get_superblock()->block_count;
+  int valid = rv == 0 && commit->magic == JOURNAL_COMMIT_MAGIC &&
+              commit->tid == hdr->tid && (int) commit->count == count &&
+              commit->checksum ==
+                  journal_checksum(journal_checksum(hdr->tid, hdr, BLOCK_SIZE),
+                                   images, (size_t) count * BLOCK_SIZE);
+  for (int i = 0; valid && i < count; i++) {
+    valid = hdr->blocks[i] < block_count;
+  }
+
+  // writing a checkpointed record home again changes nothing
+  for (int i = 0; valid && i < count; i++) {
+    rv = journal_pwrite(images + (size_t) i * BLOCK_SIZE, BLOCK_SIZE,
+                        hdr->blocks[i]);
+    assert(rv == 0);
+  }
+  if (valid) {
+    rv = fdatasync(j_fd);
+    assert(rv == 0);
+    printf("+ replayed journal transaction %llu (%d blocks)\n",
+           (unsigned long long) hdr->tid, count);
+  }
+  free(images);
+  free(hdr);
+  free(commit);
+  return next;
+}
+
+// Replay the journal and open the first transaction.
+void journal_init(int fd) {
+  superblock_t *sb = blocks_get_superblock();
+  j_fd = fd;
+  j_start = sb->journal_start;
+  j_blocks = sb->journal_blocks;
+  j_capacity = j_blocks - 2;
+  if (j_capacity > JOURNAL_MAX_BLOCKS - 2) {
+    j_capacity = JOURNAL_MAX_BLOCKS - 2;
+  }
+  // a quarter of the journal each, but room for a step at least; in a
+  // journal formatted smaller than that, handles take turns
+  j_credits = j_capacity / 4;
+  if (j_credits > JOURNAL_HANDLE_BLOCKS) {
+    j_credits = JOURNAL_HANDLE_BLOCKS;
+  }
+  if (j_credits < JOURNAL_STEP_BLOCKS) {
+    j_credits = JOURNAL_STEP_BLOCKS < j_capacity ? JOURNAL_STEP_BLOCKS
+                                                 : j_capacity;
+  }
+
+  const char *env = getenv("NUFS_COMMIT_MS");
+  if (env && atoi(env) > 0) {
+    j_interval_ms = atoi(env);
+  }
+
+  uint64_t tid = journal_replay();
+  tx_reset(&j_tx, tid);
+  j_written = tid - 1;
+  j_durable = tid - 1;
+}
+
+static void *journal_thread(void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&j_lock);
+  while (!j_stopping) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += j_interval_ms / 1000;
+    ts.tv_nsec += (long) (j_interval_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&j_timer, &j_lock, &ts);
+    if (j_stopping) {
+      break;
+    }
+    pthread_mutex_unlock(&j_lock);
+    journal_commit();
+    pthread_mutex_lock(&j_lock);
+  }
+  pthread_mutex_unlock(&j_lock);
+  return NULL;
+}
+
+// Start the periodic commit thread.
+void journal_start_thread() {
+  if (j_thread_running) {
+    return;
+  }
+  int rv = pthread_create(&j_thread, NULL, journal_thread, NULL);
+  assert(rv == 0);
+  j_thread_running = 1;
+}
+
+// Commit whatever is pending and stop the commit thread.
+void journal_shutdown() {
+  if (j_thread_running) {
+    pthread_mutex_lock(&j_lock);
+    j_stopping = 1;
+    pthread_cond_signal(&j_timer);
+    pthread_mutex_unlock(&j_lock);
+    pthread_join(j_thread, NULL);
+    j_thread_running = 0;
+  }
+  journal_sync();
+}
+
+// Open a handle.
+void journal_start() {
+  if (j_nest++ > 0) {
+    return;
+  }
+  pthread_mutex_lock(&j_lock);
+  jtx_t *tx = &j_tx;
+  while (tx->locked || tx_full(tx) ||
+         (j_frozen && !pthread_equal(j_freezer, pthread_self()))) {
+    if (!tx->locked && tx->handles == 0 && tx->count > 0 && tx_full(tx)) {
+      // full and idle: commit it here
+      pthread_mutex_unlock(&j_lock);
+      journal_commit();
+      pthread_mutex_lock(&j_lock);
+    } else {
+      pthread_cond_wait(&j_cond, &j_lock);
+    }
+  }
+  tx->handles++;
+  tx->reserved += j_credits;
+  j_my_tid = tx->tid;
+  j_my_dirtied = 0;
+  pthread_mutex_unlock(&j_lock);
+}
+
+// Close a handle.
+void journal_stop() {
+  assert(j_nest > 0);
+  if (--j_nest > 0) {
+    return;
+  }
+  pthread_mutex_lock(&j_lock);
+  if (j_my_dirtied < j_credits) {
+    j_tx.reserved -= j_credits - j_my_dirtied;
+  }
+  // handed back credits may let a waiting handle in
+  j_tx.handles--;
+  pthread_cond_broadcast(&j_cond);
+  pthread_mutex_unlock(&j_lock);
+}
+
+// Stop other threads from opening handles and wait for theirs to close.
+void journal_freeze() {
+  assert(j_nest == 0);
+  pthread_mutex_lock(&j_lock);
+  while (j_frozen) {
+    pthread_cond_wait(&j_cond, &j_lock);
+  }
+  j_frozen = 1;
+  j_freezer = pthread_self();
+  while (j_tx.handles > 0) {
+    pthread_cond_wait(&j_cond, &j_lock);
+  }
+  pthread_mutex_unlock(&j_lock);
+}
+
+void journal_thaw() {
+  pthread_mutex_lock(&j_lock);
+  j_frozen = 0;
+  pthread_cond_broadcast(&j_cond);
+  pthread_mutex_unlock(&j_lock);
+}
+
+// Move a long operation to a new transaction.
+void journal_restart() {
+  if (j_nest != 1 || j_credits - j_my_dirtied >= JOURNAL_STEP_BLOCKS) {
+    return;
+  }
+  journal_stop();
+  journal_start();
+}
+
+// Add the block holding ptr to the running transaction.
+void journal_dirty(const void *ptr) {
+  assert(j_nest > 0);
+  uint32_t bnum = blocks_get_bnum(ptr);
+  int c = bnum % JOURNAL_TCACHE;
+  if (j_tcache[c] == bnum && j_tcache_tid[c] == j_my_tid) {
+    return;
+  }
+  pthread_mutex_lock(&j_lock);
+  if (tx_add(&j_tx, bnum)) {
+    if (j_my_dirtied < j_credits) {
+      j_tx.reserved--;
+    } else {
+      // past its credits, the handle can only use room nobody reserved;
+      // without any, the transaction would not fit in one record
+      assert(j_tx.count + j_tx.reserved + j_committing <= j_capacity &&
+             "journal handle overran its credits");
+    }
+    j_my_dirtied++;
+  }
+  pthread_mutex_unlock(&j_lock);
+  if (bnum < blocks_get_superblock()->data_start) {
+    j_tcache[c] = bnum;
+    j_tcache_tid[c] = j_my_tid;
+  }
+}
+
+// Drop freed data-area blocks from the running transaction.
+void journal_forget(uint32_t start, uint32_t n) {
+  pthread_mutex_lock(&j_lock);
+  jtx_t *tx = &j_tx;
+  if (tx->shared > 0 && n < (uint32_t) tx->count) {
+    for (uint32_t b = start; b < start + n; b++) {
+      int i = tx_find(tx, b);
+      if (i >= 0) {
+        tx->blocks[i] = JOURNAL_REVOKED;
+        tx->shared--;
+      }
+    }
+  } else if (tx->shared > 0) {
+    for (int i = 0; i < tx->count; i++) {
+      if (tx->blocks[i] >= start && tx->blocks[i] - start < n) {
+        tx->blocks[i] = JOURNAL_REVOKED;
+        tx->shared--;
+      }
+    }
+  }
+  pthread_mutex_unlock(&j_lock);
+}
+
+// Transaction of the calling thread's handle.
+uint64_t journal_tid() {
+  assert(j_nest > 0);
+  return j_my_tid;
+}
+
+// Commit the running transaction and wait until it is at home.
+int journal_sync() {
+  assert(j_nest == 0);
+  uint64_t tid = journal_commit();
+  pthread_mutex_lock(&j_lock);
+  while (j_written < tid) {
+    pthread_cond_wait(&j_cond, &j_lock);
+  }
+  // a failed commit's blocks go back into the running transaction, so a
+  // later one that was written covers it
+  int rv = j_durable >= tid ? 0 : -EIO;
+  pthread_mutex_unlock(&j_lock);
+  return rv;
+}
@@ -0,0 +1,149 @@
+/**
+ * Write-ahead journal for metadata.
+ *
+ * Every change to metadata (the superblock, bitmaps, inode table and the
+ * directory and extent-tree blocks in the metadata zone) happens inside a
+ * handle, and every block a handle changes is recorded with
+ * journal_dirty. Handles from all threads join one running transaction.
+ * Opening a handle reserves room in it for the blocks the handle may
+ * dirty, and waits while there is none, so a transaction always fits in
+ * a single record and commits atomically. A commit waits for the
+ * transaction's open handles to finish, writes copies of its blocks to
+ * the journal region followed by a commit record, flushes once, and only
+ * then writes the blocks to their home locations (the checkpoint). The
+ * metadata area is mapped privately, so nothing reaches its home location
+ * any other way.
+ *
+ * A transaction commits when the commit interval (NUFS_COMMIT_MS,
+ * default 5000) passes, when it is close to filling the journal, or on
+ * journal_sync. Since each commit is checkpointed before the next one is
+ * written, the journal holds at most one transaction, and mounting
+ * replays at most that one.
+ *
+ * File data is not journaled. Data blocks freed by a transaction are
+ * only handed out again once it has committed, so a crash can't leave a
+ * committed file pointing at another file's new data.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#define JOURNAL_MAGIC 0x4c4e524a        // "JRNL"
+#define JOURNAL_COMMIT_MAGIC 0x544d4f43 // "COMT"
+
+// Most blocks an operation dirties between two journal_restart points
+#define JOURNAL_STEP_BLOCKS 16
+// Most blocks reserved for one handle; journal_restart moves it to a new
+// transaction once fewer than JOURNAL_STEP_BLOCKS of them are left
+#define JOURNAL_HANDLE_BLOCKS 64
+
+// First block of a journal record, followed by the block images and a
+// commit block
+typedef struct journal_header {
+  uint32_t magic;    // JOURNAL_MAGIC
+  uint32_t count;    // block images in the record
+  uint64_t tid;      // transaction id
+  uint32_t blocks[]; // home block of each image
+} journal_header_t;
+
+// Last block of a journal record; the record counts only if it is present
+// and its checksum matches
+typedef struct journal_commit {
+  uint32_t magic; // JOURNAL_COMMIT_MAGIC
+  uint32_t count;
+  uint64_t tid;
+  uint64_t checksum; // over the header block and the images
+} journal_commit_t;
+
+/**
+ * Number of blocks to give the journal when formatting an image of
+ * block_count blocks.
+ */
+uint32_t journal_size_for(uint32_t block_count);
+
+/**
+ * Replay the last committed transaction, if it never reached its home
+ * locations, and set up an empty running transaction. Call from
+ * blocks_init, before the metadata area is mapped privately.
+ *
+ * @param fd The image file.
+ */
+void journal_init(int fd);
+
+/**
+ * Start the thread that commits every NUFS_COMMIT_MS. Call after any
+ * fork (e.g. from the FUSE init callback).
+ */
+void journal_start_thread();
+
+/**
+ * Commit whatever is pending and stop the commit thread.
+ */
+void journal_shutdown();
+
+/**
+ * Open a handle. Handles nest; only the outermost one counts. May wait
+ * for a commit if the journal is nearly full, so call it after taking
+ * inode locks, never before.
+ */
+void journal_start();
+
+/**
+ * Close the handle opened by the matching journal_start.
+ */
+void journal_stop();
+
+/**
+ * Let a long operation continue in a new transaction once its handle has
+ * too few credits left for another step. Call only where the filesystem
+ * is consistent; inside a nested handle this does nothing.
+ */
+void journal_restart();
+
+/**
+ * Wait until no other thread has a handle open, and keep them from opening
+ * one until journal_thaw. Every change to the filesystem happens inside a
+ * handle, so the caller then sees all of it standing still, and can read
+ * any inode or directory without its lock. It may open handles itself,
+ * but must not take an inode lock while frozen: the thread holding one
+ * may be waiting to open a handle. Call with no handle open.
+ */
+void journal_freeze();
+
+/**
+ * Let other threads open handles again after journal_freeze.
+ */
+void journal_thaw();
+
+/**
+ * Record that the block holding ptr, which must be in the image, is
+ * changed by the open handle.
+ */
+void journal_dirty(const void *ptr);
+
+/**
+ * Drop freed blocks from the running transaction, so a data-area block
+ * that held a directory or extent-tree node is not written as metadata
+ * after it is reused for file data.
+ *
+ * @param start First freed block.
+ * @param n Number of blocks.
+ */
+void journal_forget(uint32_t start, uint32_t n);
+
+/**
+ * Id of the transaction the calling thread's handle belongs to.
+ */
+uint64_t journal_tid();
+
+/**
+ * Commit the running transaction and wait until it is at home. Call with
+ * no handle open.
+ *
+ * @return 0, or -EIO if the commit could not be written; its changes then
+ *         wait for the next one.
+ */
+int journal_sync();
+
+#endif
@@ -0,0 +1,394 @@
+/**
+ * nufs-bench: benchmark the storage layer in-process, without FUSE.
+ *
+ *   nufs-bench [-q] [-o out.json] [-b baseline.json] [-t tolerance%] [image]
+ *
+ * Formats a fresh image (default bench.nufs, removed afterwards), runs a
+ * fixed set of workloads with fixed random seeds, prints a table and
+ * writes the results as JSON. With -b, each workload's ops/s is compared
+ * against the baseline file (a previous JSON output) and the exit status
+ * is 1 if any dropped by more than the tolerance (default 15%).
+ * -q runs a tenth of the operations, for a quick check.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "directory.h"
+#include "inode.h"
+#include "stats.h"
+#include "storage.h"
+
+#define BENCH_FILE_MB 64
+#define BENCH_MAX_RESULTS 64
+#define BENCH_MAX_IO (1 << 20)
+
+typedef struct bench_result {
+  char name[48];
+  long ops;
+  double seconds;
+  double ops_per_sec;
+  double mb_per_sec; // 0 for metadata workloads
+  double p50_us, p99_us, p999_us;
+} bench_result_t;
+
+static bench_result_t results[BENCH_MAX_RESULTS];
+static int nresults;
+static int scale = 1; // divides op counts (-q)
+static uint64_t *lat; // per-op latencies of the running workload
+static long lat_n;
+static char iobuf[BENCH_MAX_IO];
+
+static uint64_t rng_state;
+
+static uint64_t rng() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+// Size of the file the I/O workloads use: whole MBs, so every I/O size
+// divides it
+static long file_bytes() {
+  return ((long) BENCH_FILE_MB << 20) / scale >> 20 << 20;
+}
+
+static void die(const char *what, int rv) {
+  fprintf(stderr, "nufs-bench: %s failed: %s\n", what, strerror(-rv));
+  exit(2);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Start a workload of up to ops operations.
+static void bench_begin(long ops) {
+  lat = realloc(lat, sizeof(uint64_t) * ops);
+  lat_n = 0;
+  rng_state = 0x9e3779b97f4a7c15ull; // same sequence every run
+}
+
+// Finish the running workload; bytes is the data moved, 0 for metadata.
+static void bench_end(const char *name, double bytes) {
+  bench_result_t *r = &results[nresults++];
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  uint64_t total = 0;
+  for (long i = 0; i < lat_n; i++) {
+    total += lat[i];
+  }
+  qsort(lat, lat_n, sizeof(uint64_t), cmp_u64);
+  r->ops = lat_n;
+  r->seconds = total / 1e9;
+  r->ops_per_sec = total ? lat_n / r->seconds : 0;
+  r->mb_per_sec = total ? bytes / (1 << 20) / r->seconds : 0;
+  r->p50_us = lat_n ? lat[lat_n / 2] / 1e3 : 0;
+  r->p99_us = lat_n ? lat[lat_n * 99 / 100] / 1e3 : 0;
+  r->p999_us = lat_n ? lat[lat_n * 999 / 1000] / 1e3 : 0;
+  printf("%-22s %9ld ops %12.0f ops/s %9.1f MB/s  p50 %8.2f  p99 %8.2f  "
+         "p99.9 %8.2f us\n",
+         r->name, r->ops, r->ops_per_sec, r->mb_per_sec, r->p50_us,
+         r->p99_us, r->p999_us);
+}
+
+// Time one call; evaluates to its result.
+#define TIMED(call)                                                            \
+  ({                                                                           \
+    uint64_t _t0 = stats_now();                                                \
+    __typeof__(call) _rv = (call);                                             \
+    lat[lat_n++] = stats_now() - _t0;                                          \
+    _rv;                                                                       \
+  })
+
+static void bench_seq_write(const char *path, int io) {
+  char name[48];
+  long ops = file_bytes() / io;
+  storage_unlink(path);
+  int rv = storage_mknod(path, 0100644);
+  if (rv < 0) {
+    die("mknod", rv);
+  }
+  int inum = storage_open(path);
+  bench_begin(ops);
+  for (long i = 0; i < ops; i++) {
+    rv = TIMED(storage_fwrite(inum, iobuf, io, (off_t) i * io));
+    if (rv != io) {
+      die("write", rv);
+    }
+  }
+  storage_release(inum);
+  snprintf(name, sizeof(name), "seq_write_%dk", io >> 10);
+  bench_end(name, (double) ops * io);
+}
+
+static void bench_seq_read(const char *path, int io) {
+  char name[48];
+  long ops = file_bytes() / io;
+  int inum = storage_open(path);
+  bench_begin(ops);
+  for (long i = 0; i < ops; i++) {
+    int rv = TIMED(storage_fread(inum, iobuf, io, (off_t) i * io));
+    if (rv != io) {
+      die("read", rv);
+    }
+  }
+  storage_release(inum);
+  snprintf(name, sizeof(name), "seq_read_%dk", io >> 10);
+  bench_end(name, (double) ops * io);
+}
+
+static void bench_rand(const char *path, int io, int write) {
+  char name[48];
+  long ops = 20000 / scale;
+  long slots = file_bytes() / io;
+  int inum = storage_open(path);
+  bench_begin(ops);
+  for (long i = 0; i < ops; i++) {
+    off_t off = (off_t) (rng() % slots) * io;
+    int rv = write ? TIMED(storage_fwrite(inum, iobuf, io, off))
+                   : TIMED(storage_fread(inum, iobuf, io, off));
+    if (rv != io) {
+      die(write ? "write" : "read", rv);
+    }
+  }
+  storage_release(inum);
+  snprintf(name, sizeof(name), "rand_%s_%dk", write ? "write" : "read",
+           io >> 10);
+  bench_end(name, (double) ops * io);
+}
+
+// create, stat and unlink many files in one directory
+static void bench_storm() {
+  long n = 20000 / scale;
+  char path[64];
+  storage_mkdir("/storm", 0755);
+
+  bench_begin(n);
+  for (long i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "/storm/f%ld", i);
+    int rv = TIMED(storage_mknod(path, 0100644));
+    if (rv < 0) {
+      die("mknod", rv);
+    }
+  }
+  bench_end("create", 0);
+
+  bench_begin(n);
+  for (long i = 0; i < n; i++) {
+    struct stat st;
+    snprintf(path, sizeof(path), "/storm/f%ld", rng() % n);
+    int rv = TIMED(storage_stat(path, &st));
+    if (rv < 0) {
+      die("stat", rv);
+    }
+  }
+  bench_end("stat", 0);
+
+  bench_begin(n);
+  for (long i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "/storm/f%ld", i);
+    int rv = TIMED(storage_unlink(path));
+    if (rv < 0) {
+      die("unlink", rv);
+    }
+  }
+  bench_end("unlink", 0);
+}
+
+// resolve a path 32 directories deep
+static void bench_deep_path() {
+  char path[256] = "";
+  for (int d = 0; d < 32; d++) {
+    strcat(path, "/d");
+    storage_mkdir(path, 0755);
+  }
+  strcat(path, "/leaf");
+  storage_mknod(path, 0100644);
+
+  long n = 100000 / scale;
+  bench_begin(n);
+  for (long i = 0; i < n; i++) {
+    struct stat st;
+    int rv = TIMED(storage_stat(path, &st));
+    if (rv < 0) {
+      die("stat", rv);
+    }
+  }
+  bench_end("deep_path_stat", 0);
+}
+
+// look names up in a directory with many entries, through the dentry
+// cache (storage_stat) and straight through the directory code
+static void bench_large_dir() {
+  long entries = 50000 / scale;
+  char path[64];
+  storage_mkdir("/big", 0755);
+  for (long i = 0; i < entries; i++) {
+    snprintf(path, sizeof(path), "/big/entry-%ld", i);
+    int rv = storage_mknod(path, 0100644);
+    if (rv < 0) {
+      die("mknod", rv);
+    }
+  }
+
+  long n = 100000 / scale;
+  bench_begin(n);
+  for (long i = 0; i < n; i++) {
+    struct stat st;
+    snprintf(path, sizeof(path), "/big/entry-%ld", rng() % entries);
+    int rv = TIMED(storage_stat(path, &st));
+    if (rv < 0) {
+      die("stat", rv);
+    }
+  }
+  bench_end("large_dir_stat", 0);
+
+  struct stat st;
+  storage_stat("/big", &st);
+  inode_t *dir = get_inode(st.st_ino);
+  bench_begin(n);
+  for (long i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "entry-%ld", rng() % entries);
+    int rv = TIMED(directory_lookup(dir, path));
+    if (rv < 0) {
+      die("directory_lookup", rv);
+    }
+  }
+  bench_end("large_dir_lookup", 0);
+}
+
+// grow and shrink a file to random sizes
+static void bench_truncate_churn() {
+  long n = 5000 / scale;
+  storage_mknod("/churn", 0100644);
+  bench_begin(n);
+  for (long i = 0; i < n; i++) {
+    off_t size = rng() % (16 << 20);
+    int rv = TIMED(storage_truncate("/churn", size));
+    if (rv < 0) {
+      die("truncate", rv);
+    }
+  }
+  bench_end("truncate_churn", 0);
+}
+
+static void write_json(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    perror(path);
+    exit(2);
+  }
+  fprintf(f, "{\n  \"version\": 1,\n  \"quick\": %s,\n  \"results\": [\n",
+          scale > 1 ? "true" : "false");
+  for (int i = 0; i < nresults; i++) {
+    bench_result_t *r = &results[i];
+    // one result per line; read_baseline relies on it
+    fprintf(f,
+            "    {\"name\": \"%s\", \"ops\": %ld, \"seconds\": %.6f, "
+            "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, \"p50_us\": %.3f, "
+            "\"p99_us\": %.3f, \"p999_us\": %.3f}%s\n",
+            r->name, r->ops, r->seconds, r->ops_per_sec, r->mb_per_sec,
+            r->p50_us, r->p99_us, r->p999_us, i + 1 < nresults ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+  fclose(f);
+}
+
+// Compare against a previous output; returns the number of regressions.
+static int compare_baseline(const char *path, double tolerance) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    printf("no baseline at %s; run `make bench-baseline` to record one\n",
+           path);
+    return 0;
+  }
+  int regressions = 0;
+  char line[512];
+  printf("\n%-22s %12s %12s %8s\n", "vs baseline", "base ops/s", "ops/s",
+         "change");
+  while (fgets(line, sizeof(line), f)) {
+    char name[48];
+    double base;
+    char *p = strstr(line, "\"name\": \"");
+    char *q = strstr(line, "\"ops_per_sec\": ");
+    if (!p || !q || sscanf(p + 9, "%47[^\"]", name) != 1 ||
+        sscanf(q + 15, "%lf", &base) != 1) {
+      continue;
+    }
+    for (int i = 0; i < nresults; i++) {
+      if (strcmp(results[i].name, name) != 0 || base <= 0) {
+        continue;
+      }
+      double change = (results[i].ops_per_sec - base) / base * 100;
+      int bad = change < -tolerance;
+      regressions += bad;
+      printf("%-22s %12.0f %12.0f %+7.1f%%%s\n", name, base,
+             results[i].ops_per_sec, change, bad ? "  REGRESSION" : "");
+    }
+  }
+  fclose(f);
+  return regressions;
+}
+
+int main(int argc, char *argv[]) {
+  const char *out = "bench.json", *baseline = NULL;
+  double tolerance = 15;
+  int opt;
+  while ((opt = getopt(argc, argv, "qo:b:t:")) != -1) {
+    switch (opt) {
+    case 'q': scale = 10; break;
+    case 'o': out = optarg; break;
+    case 'b': baseline = optarg; break;
+    case 't': tolerance = atof(optarg); break;
+    default:
+      fprintf(stderr, "usage: %s [-q] [-o out.json] [-b baseline.json] "
+                      "[-t tolerance%%] [image]\n", argv[0]);
+      return 2;
+    }
+  }
+  const char *image = optind < argc ? argv[optind] : "bench.nufs";
+
+  // a fresh sparse image with room for every workload
+  unlink(image);
+  FILE *img = fopen(image, "w");
+  if (!img || ftruncate(fileno(img), 2L << 30) < 0) {
+    perror(image);
+    return 2;
+  }
+  fclose(img);
+  setenv("NUFS_INODES", "131072", 1);
+  storage_init(image);
+  storage_start();
+  memset(iobuf, 0xab, sizeof(iobuf));
+  printf("\n");
+
+  int sizes[] = {4 << 10, 64 << 10, 1 << 20};
+  for (int i = 0; i < 3; i++) {
+    bench_seq_write("/seq", sizes[i]);
+    bench_seq_read("/seq", sizes[i]);
+  }
+  bench_rand("/seq", 4 << 10, 0);
+  bench_rand("/seq", 64 << 10, 0);
+  bench_rand("/seq", 4 << 10, 1);
+  bench_rand("/seq", 64 << 10, 1);
+  bench_storm();
+  bench_deep_path();
+  bench_large_dir();
+  bench_truncate_churn();
+
+  storage_free();
+  write_json(out);
+  printf("\nwrote %s\n", out);
+  unlink(image);
+  int regressions = baseline ? compare_baseline(baseline, tolerance) : 0;
+  if (regressions > 0) {
+    printf("%d workload(s) more than %.0f%% slower than the baseline\n",
+           regressions, tolerance);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,101 @@
+/**
+ * nufs-clone: make a reflink copy of a file on a mounted nufs.
+ *
+ *   nufs-clone SRC DST [SRC_OFFSET LENGTH DST_OFFSET]
+ *
+ * DST (created if missing) shares SRC's data blocks instead of getting a
+ * copy of them; a later write to either file copies just the blocks it
+ * changes. With offsets, only LENGTH bytes from SRC_OFFSET are shared, at
+ * DST_OFFSET; offsets must be multiples of the block size, and a LENGTH of
+ * 0 means to the end of SRC. Both files must be on the same mount.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "storage.h"
+
+static void usage() {
+  fprintf(stderr, "usage: nufs-clone SRC DST [SRC_OFFSET LENGTH DST_OFFSET]\n");
+  exit(2);
+}
+
+// The directory nufs is mounted on that holds path (which must exist):
+// the last one walking up from it that is still on its device.
+static void mount_root(const char *path, char *root) {
+  struct stat st, up;
+  if (!realpath(path, root) || stat(root, &st) < 0) {
+    perror(path);
+    exit(1);
+  }
+  for (;;) {
+    char *slash = strrchr(root, '/');
+    if (slash == root) {
+      if (stat("/", &up) == 0 && up.st_dev == st.st_dev) {
+        root[1] = 0;
+      }
+      return;
+    }
+    *slash = 0;
+    if (stat(root, &up) < 0 || up.st_dev != st.st_dev) {
+      *slash = '/';
+      return;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3 && argc != 6) {
+    usage();
+  }
+  struct nufs_clone req;
+  memset(&req, 0, sizeof(req));
+  if (argc == 6) {
+    char *end;
+    req.src_offset = strtoull(argv[3], &end, 0);
+    req.src_length = *end ? 0 : strtoull(argv[4], &end, 0);
+    req.dest_offset = *end ? 0 : strtoull(argv[5], &end, 0);
+    if (*end) {
+      usage();
+    }
+  }
+
+  int fd = open(argv[2], O_WRONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    perror(argv[2]);
+    return 1;
+  }
+  // the filesystem knows the source by its path from the mount point
+  char root[PATH_MAX], src[PATH_MAX], dst_root[PATH_MAX];
+  mount_root(argv[1], root);
+  mount_root(argv[2], dst_root);
+  if (strcmp(root, dst_root) != 0) {
+    fprintf(stderr, "nufs-clone: %s and %s are not on the same mount\n",
+            argv[1], argv[2]);
+    return 1;
+  }
+  if (!realpath(argv[1], src)) {
+    perror(argv[1]);
+    return 1;
+  }
+  const char *rel = strcmp(root, "/") == 0 ? src : src + strlen(root);
+  if (snprintf(req.src, sizeof(req.src), "%s", *rel ? rel : "/") >=
+      (int) sizeof(req.src)) {
+    fprintf(stderr, "nufs-clone: %s: %s\n", argv[1], strerror(ENAMETOOLONG));
+    return 1;
+  }
+
+  unsigned long cmd = argc == 6 ? NUFS_IOC_CLONE_RANGE : NUFS_IOC_CLONE;
+  if (ioctl(fd, cmd, &req) < 0) {
+    fprintf(stderr, "nufs-clone: %s: %s\n", argv[2], strerror(errno));
+    return 1;
+  }
+  close(fd);
+  return 0;
+}
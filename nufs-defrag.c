@@ -0,0 +1,196 @@
+/**
+ * nufs-defrag: measure and undo fragmentation of files.
+ *
+ *   nufs-defrag [-n] [-q] PATH...              on a mounted nufs
+ *   nufs-defrag -i IMAGE [-n] [-q] [PATH...]   on an image nothing mounts
+ *
+ * Every regular file at or under each PATH has its blocks moved into
+ * contiguous runs (see defrag.h), one file at a time; a mounted
+ * filesystem stays usable meanwhile, only the file being moved waits.
+ * With -i the image is opened directly and PATHs are inside it (default
+ * /). -n only measures. Each file that was in more than one fragment is
+ * listed with its fragments (and extents) before and after, then a
+ * summary of the whole run; -q prints just the summary. /.snapshots and
+ * /.nufs are skipped.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "slist.h"
+#include "snapshot.h"
+#include "storage.h"
+#include "vfile.h"
+
+static const char *image; // -i: work on the image, not through a mount
+static int measure_only, quiet;
+
+static struct {
+  long files;       // regular files with blocks
+  long fragmented;  // of those, in more than one fragment, before
+  long still;       // and after
+  long frags_before, frags_after;
+  long blocks, moved;
+  int errors;
+} total;
+
+static void report(const char *path, const struct nufs_defrag *r) {
+  if (r->blocks == 0) {
+    return;
+  }
+  total.files++;
+  total.fragmented += r->frags_before > 1;
+  total.still += r->frags_after > 1;
+  total.frags_before += r->frags_before;
+  total.frags_after += r->frags_after;
+  total.blocks += r->blocks;
+  total.moved += r->moved;
+  if (quiet || r->frags_before < 2) {
+    return;
+  }
+  if (measure_only) {
+    printf("%s: %u blocks, %u fragments (%u extents)\n", path, r->blocks,
+           r->frags_before, r->extents_before);
+  } else {
+    printf("%s: %u blocks, %u fragments (%u extents) -> %u (%u), %u moved\n",
+           path, r->blocks, r->frags_before, r->extents_before, r->frags_after,
+           r->extents_after, r->moved);
+  }
+}
+
+static void defrag(const char *path) {
+  struct nufs_defrag r;
+  memset(&r, 0, sizeof(r));
+  r.flags = measure_only ? NUFS_DEFRAG_MEASURE : 0;
+  int rv;
+  if (image) {
+    rv = storage_defrag(path, &r);
+  } else {
+    int fd = open(path, O_RDONLY);
+    rv = fd < 0 || ioctl(fd, NUFS_IOC_DEFRAG, &r) < 0 ? -errno : 0;
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  if (rv < 0) {
+    fprintf(stderr, "nufs-defrag: %s: %s\n", path, strerror(-rv));
+    total.errors++;
+    return;
+  }
+  report(path, &r);
+}
+
+static int skipped(const char *name) {
+  return strcmp(name, SNAPSHOT_DIR) == 0 || strcmp(name, VFILE_DIR + 1) == 0;
+}
+
+static int collect(void *arg, const char *name, const struct stat *st,
+                   off_t next) {
+  (void) st;
+  (void) next;
+  slist_t **names = arg;
+  *names = s_cons(name, *names);
+  return 0;
+}
+
+static void walk(const char *path) {
+  struct stat st;
+  int rv = image ? storage_stat(path, &st) : (lstat(path, &st) < 0 ? -errno : 0);
+  if (rv < 0) {
+    fprintf(stderr, "nufs-defrag: %s: %s\n", path, strerror(-rv));
+    total.errors++;
+    return;
+  }
+  if (S_ISREG(st.st_mode)) {
+    defrag(path);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return;
+  }
+  // list the directory first: nothing is locked while its files move
+  slist_t *names = NULL;
+  if (image) {
+    storage_readdir(path, 0, collect, &names);
+  } else {
+    DIR *d = opendir(path);
+    struct dirent *de;
+    while (d && (de = readdir(d))) {
+      names = s_cons(de->d_name, names);
+    }
+    if (d) {
+      closedir(d);
+    }
+  }
+  for (slist_t *n = names; n; n = n->next) {
+    if (strcmp(n->data, ".") == 0 || strcmp(n->data, "..") == 0 ||
+        skipped(n->data)) {
+      continue;
+    }
+    size_t len = strlen(path);
+    char *child = malloc(len + strlen(n->data) + 2);
+    sprintf(child, "%s%s%s", path, len && path[len - 1] == '/' ? "" : "/",
+            n->data);
+    walk(child);
+    free(child);
+  }
+  s_free(names);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "i:nq")) != -1) {
+    switch (opt) {
+    case 'i': image = optarg; break;
+    case 'n': measure_only = 1; break;
+    case 'q': quiet = 1; break;
+    default:
+      fprintf(stderr, "usage: %s [-n] [-q] PATH...\n"
+                      "       %s -i IMAGE [-n] [-q] [PATH...]\n",
+              argv[0], argv[0]);
+      return 2;
+    }
+  }
+  if (!image && optind == argc) {
+    fprintf(stderr, "%s: no PATH given\n", argv[0]);
+    return 2;
+  }
+  if (image) {
+    if (access(image, R_OK | W_OK) < 0) {
+      perror(image);
+      return 1;
+    }
+    storage_init(image);
+    storage_start();
+    printf("\n");
+  }
+  if (optind == argc) {
+    walk("/");
+  }
+  for (int i = optind; i < argc; i++) {
+    walk(argv[i]);
+  }
+  if (image) {
+    storage_free();
+  }
+
+  double files = total.files ? total.files : 1;
+  printf("%ld files with blocks, %ld blocks", total.files, total.blocks);
+  if (measure_only) {
+    printf("\n%ld fragmented, %ld fragments (%.2f per file)\n",
+           total.fragmented, total.frags_before, total.frags_before / files);
+  } else {
+    printf(", %ld moved\n%ld fragmented -> %ld, %ld fragments -> %ld "
+           "(%.2f -> %.2f per file)\n",
+           total.moved, total.fragmented, total.still, total.frags_before,
+           total.frags_after, total.frags_before / files,
+           total.frags_after / files);
+  }
+  return total.errors ? 1 : 0;
+}
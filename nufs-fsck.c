@@ -0,0 +1,760 @@
+/**
+ * nufs-fsck: check an image that nothing has mounted, and repair it.
+ *
+ *   nufs-fsck [-y] [-j THREADS] IMAGE
+ *
+ * Opening the image replays the journal, as a mount would. Then every
+ * inode is checked (its fields, extent tree and, for a directory, its
+ * index) and the blocks it maps are counted; then every directory entry
+ * is checked and each inode's single link recorded; then every inode is
+ * followed up to the root; and last every block's owners are compared
+ * with the block bitmap and the refcount table. The inode and block
+ * passes are split across THREADS (default: one per CPU), so the whole
+ * run reads each piece of metadata once.
+ *
+ * Problems are listed as they are found, then counted by kind. With -y
+ * they are repaired through the journal:
+ *   - a damaged inode is cleared, and entries naming it go
+ *   - a bad entry (bad name, unused or damaged inode, second link) goes
+ *   - the block and inode bitmaps and the refcounts are set to match
+ *     what the inodes own; leaked blocks are freed
+ *   - wrong link counts and block counts are corrected
+ *   - an inode no path reaches is linked into /lost+found as "#INUM",
+ *     unless it is left over from a snapshot, which is freed instead
+ * Blocks owned in ways that can't be shared (a directory or extent-tree
+ * block, or a fragment, claimed twice) are only reported.
+ *
+ * Exit status: 0 if the image is clean, 1 if everything found was
+ * repaired, 4 if problems are left, 8 if the image couldn't be checked.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "compress.h"
+#include "dcache.h"
+#include "directory.h"
+#include "extent.h"
+#include "frag.h"
+#include "inode.h"
+#include "journal.h"
+
+#define FSCK_CHUNK 1024    // inodes or blocks a thread takes at a time
+#define FSCK_MAX_LINES 200 // problems listed; the rest are only counted
+
+#define EXT_BLOCK_ENTRIES                                                      \
+  ((BLOCK_SIZE - sizeof(extent_header_t)) / sizeof(extent_t))
+#define DX_ENTRIES ((BLOCK_SIZE - sizeof(dx_node_t)) / sizeof(dx_entry_t))
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / sizeof(dirent_t))
+
+// Kinds of problem, in the order they are counted in the summary
+#define PROBLEM_LIST(X)                                                        \
+  X(BAD_INODE, "damaged inodes", 1)                                            \
+  X(INODE_BITMAP, "inode bitmap bits wrong", 1)                                \
+  X(BAD_ENTRY, "bad directory entries", 1)                                     \
+  X(LINKS, "wrong link counts", 1)                                             \
+  X(BLOCK_COUNT, "wrong block counts", 1)                                      \
+  X(ORPHAN, "unreachable inodes", 1)                                           \
+  X(LEAKED, "leaked blocks", 1)                                                \
+  X(UNMARKED, "blocks in use but marked free", 1)                              \
+  X(REFCOUNT, "wrong block refcounts", 1)                                      \
+  X(CROSSLINKED, "cross-linked blocks", 0)
+
+#define PROBLEM_ENUM(name, label, fixable) P_##name,
+enum { PROBLEM_LIST(PROBLEM_ENUM) P_COUNT };
+#undef PROBLEM_ENUM
+
+#define PROBLEM_LABEL(name, label, fixable) label,
+static const char *problem_label[] = {PROBLEM_LIST(PROBLEM_LABEL)};
+#undef PROBLEM_LABEL
+
+#define PROBLEM_FIXABLE(name, label, fixable) fixable,
+static const int problem_fixable[] = {PROBLEM_LIST(PROBLEM_FIXABLE)};
+#undef PROBLEM_FIXABLE
+
+// What the inode pass made of each inode
+enum { I_FREE, I_OK, I_BAD };
+
+static superblock_t *sb;
+static int nthreads;
+static long problems[P_COUNT];
+static int lines;
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Owners of each block, counted by the inode pass
+static uint32_t *data_owners; // regular files' extents
+static uint16_t *meta_owners; // directory blocks and extent-tree nodes
+static uint32_t *frag_units;  // units of the block fragments take
+
+static uint8_t *istate;      // I_* for each inode
+static uint32_t *iblocks;    // blocks each inode really maps
+static int32_t *parent;      // the directory linking each inode, or -1
+static uint32_t *link_bnum;  // and the block and slot of the entry
+static uint16_t *link_slot;
+static uint8_t *reach;       // 0 unknown, 1 reachable, 2 not, 3 on the way
+
+typedef struct entry_loc {
+  uint32_t bnum;
+  uint16_t slot;
+} entry_loc_t;
+
+static entry_loc_t *bad_entries; // entries to clear
+static int n_bad_entries, cap_bad_entries;
+
+static void problem(int kind, const char *fmt, ...) {
+  __atomic_fetch_add(&problems[kind], 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&print_lock);
+  if (lines++ < FSCK_MAX_LINES) {
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+  }
+  pthread_mutex_unlock(&print_lock);
+}
+
+// Run fn(first, end) on [0, n) a chunk at a time on every thread.
+typedef void (*range_fn_t)(uint32_t first, uint32_t end);
+
+typedef struct sweep {
+  range_fn_t fn;
+  uint32_t n;
+  uint32_t next;
+} sweep_t;
+
+static void *sweep_thread(void *arg) {
+  sweep_t *s = arg;
+  for (;;) {
+    uint32_t first = __atomic_fetch_add(&s->next, FSCK_CHUNK, __ATOMIC_RELAXED);
+    if (first >= s->n) {
+      return NULL;
+    }
+    s->fn(first, s->n - first < FSCK_CHUNK ? s->n : first + FSCK_CHUNK);
+  }
+}
+
+static void sweep(range_fn_t fn, uint32_t n) {
+  sweep_t s = {fn, n, 0};
+  pthread_t *th = malloc(nthreads * sizeof(pthread_t));
+  for (int i = 1; i < nthreads; i++) {
+    pthread_create(&th[i], NULL, sweep_thread, &s);
+  }
+  sweep_thread(&s);
+  for (int i = 1; i < nthreads; i++) {
+    pthread_join(th[i], NULL);
+  }
+  free(th);
+}
+
+// Pass 1: inodes
+
+static int block_ok(uint32_t bnum, uint32_t n, uint32_t first) {
+  return bnum >= first && bnum < sb->block_count && n <= sb->block_count - bnum;
+}
+
+static void own(int meta, uint32_t start, uint32_t n) {
+  for (uint32_t b = start; b < start + n; b++) {
+    if (meta) {
+      __atomic_fetch_add(&meta_owners[b], 1, __ATOMIC_RELAXED);
+    } else {
+      __atomic_fetch_add(&data_owners[b], 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Check the extent subtree at h, which maps [lo, hi), adding the data
+// blocks below it to *blocks; with claim set, count its blocks as owned
+// instead. Returns what is wrong, or NULL.
+static const char *check_extents(extent_header_t *h, int is_root, int depth,
+                                 uint32_t lo, uint64_t hi, int is_dir,
+                                 uint64_t *blocks, int claim) {
+  if (h->depth != depth || depth > EXT_MAX_DEPTH) {
+    return "extent node at the wrong depth";
+  }
+  if (h->count > (is_root ? EXT_ROOT_MAX : EXT_BLOCK_ENTRIES)) {
+    return "extent node overfull";
+  }
+  if (depth > 0) {
+    extent_idx_t *ix = (extent_idx_t *) (h + 1);
+    for (int i = 0; i < h->count; i++) {
+      uint32_t from = i == 0 ? lo : ix[i].lblk;
+      uint64_t to = i + 1 < h->count ? ix[i + 1].lblk : hi;
+      if (from < lo || to > hi || from > to) {
+        return "extent index out of order";
+      }
+      if (!block_ok(ix[i].child, 1, sb->meta_start)) {
+        return "extent node outside the image";
+      }
+      if (claim) {
+        own(1, ix[i].child, 1);
+      }
+      const char *err = check_extents(blocks_get_block(ix[i].child), 0,
+                                      depth - 1, from, to, is_dir, blocks, claim);
+      if (err) {
+        return err;
+      }
+    }
+    return NULL;
+  }
+  extent_t *ex = (extent_t *) (h + 1);
+  uint64_t prev_end = lo;
+  for (int i = 0; i < h->count; i++) {
+    uint32_t plen = ex[i].len;
+    if (ex[i].len == 0 || ex[i].lblk < prev_end ||
+        (uint64_t) ex[i].lblk + ex[i].len > hi) {
+      return "extents overlap or out of order";
+    }
+    if (ex[i].flags & EXT_COMPRESSED) {
+      plen = ex[i].flags & EXT_PLEN;
+      if (is_dir || ex[i].len != CLUSTER_BLOCKS ||
+          ex[i].lblk % CLUSTER_BLOCKS != 0 || plen == 0 ||
+          plen >= CLUSTER_BLOCKS) {
+        return "bad compressed extent";
+      }
+    } else if (ex[i].flags != 0) {
+      return "unknown extent flags";
+    }
+    if (!block_ok(ex[i].pblk, plen, is_dir ? sb->meta_start : sb->data_start)) {
+      return "extent outside the data area";
+    }
+    if (claim) {
+      own(is_dir, ex[i].pblk, plen);
+    }
+    *blocks += plen;
+    prev_end = (uint64_t) ex[i].lblk + ex[i].len;
+  }
+  return NULL;
+}
+
+// Block of a directory's index node, checked, or NULL.
+static dx_node_t *dx_node_at(inode_t *node, uint32_t lblk) {
+  int bnum = lblk < node->size / BLOCK_SIZE ? inode_get_bnum(node, lblk) : 0;
+  dx_node_t *dx = bnum > 0 ? blocks_get_block(bnum) : NULL;
+  return dx && dx->count > 0 && dx->count <= DX_ENTRIES ? dx : NULL;
+}
+
+static const char *check_dir_layout(inode_t *node) {
+  if (!(node->flags & INODE_DIR_INDEXED)) {
+    if (node->size > BLOCK_SIZE || node->size % sizeof(dirent_t) != 0 ||
+        (node->size > 0 && inode_get_bnum(node, 0) <= 0)) {
+      return "bad directory size";
+    }
+    return NULL;
+  }
+  uint32_t nblocks = node->size / BLOCK_SIZE;
+  dx_node_t *root = dx_node_at(node, 0);
+  if (node->size % BLOCK_SIZE != 0 || !root || root->levels > 1) {
+    return "bad directory index root";
+  }
+  for (uint32_t i = 0; i < root->count; i++) {
+    uint32_t b = root->entries[i].block;
+    if (b == 0 || b >= nblocks || inode_get_bnum(node, b) <= 0) {
+      return "directory index names a missing block";
+    }
+    dx_node_t *dx = root->levels ? dx_node_at(node, b) : NULL;
+    if (root->levels && !dx) {
+      return "bad directory index node";
+    }
+    for (uint32_t j = 0; dx && j < dx->count; j++) {
+      uint32_t leaf = dx->entries[j].block;
+      if (leaf == 0 || leaf >= nblocks || inode_get_bnum(node, leaf) <= 0) {
+        return "directory index names a missing block";
+      }
+    }
+  }
+  return NULL;
+}
+
+static const char *check_inode(inode_t *node, uint64_t *blocks) {
+  int is_dir = S_ISDIR(node->mode);
+  int small = node->flags & (INODE_INLINE | INODE_FRAG);
+  *blocks = 0;
+  if (!is_dir && !S_ISREG(node->mode)) {
+    return "unknown file type";
+  }
+  if (node->flags & ~(INODE_DIR_INDEXED | INODE_INLINE | INODE_FRAG |
+                      INODE_COMPRESS | INODE_READONLY)) {
+    return "unknown flags";
+  }
+  if (small == (INODE_INLINE | INODE_FRAG) || (is_dir && small) ||
+      (!is_dir && (node->flags & INODE_DIR_INDEXED))) {
+    return "flags don't go together";
+  }
+  if (node->size < 0 || bytes_to_blocks(node->size) > (int64_t) UINT32_MAX + 1) {
+    return "bad size";
+  }
+  if (small == INODE_INLINE) {
+    return node->size <= INODE_INLINE_MAX ? NULL : "inline file too big";
+  }
+  if (small == INODE_FRAG) {
+    const frag_t *f = &node->frag;
+    if (node->size > INODE_FRAG_MAX || f->units == 0 ||
+        f->units < (node->size + FRAG_SIZE - 1) / FRAG_SIZE ||
+        f->unit + f->units > BLOCK_SIZE / FRAG_SIZE ||
+        !block_ok(f->block, 1, sb->data_start)) {
+      return "bad fragment";
+    }
+    return NULL;
+  }
+  const char *err = check_extents(&node->extents.hdr, 1, node->extents.hdr.depth,
+                                  0, (uint64_t) UINT32_MAX + 1, is_dir, blocks, 0);
+  return err ? err : is_dir ? check_dir_layout(node) : NULL;
+}
+
+static void check_inodes(uint32_t first, uint32_t end) {
+  void *ibm = get_inode_bitmap();
+  for (uint32_t inum = first; inum < end; inum++) {
+    inode_t *node = get_inode(inum);
+    int marked = inum == 0 || bitmap_get(ibm, inum);
+    if (node->refs <= 0) {
+      istate[inum] = I_FREE;
+      if (inum != 0 && marked) {
+        problem(P_INODE_BITMAP, "inode %u: free but marked in use", inum);
+      }
+      continue;
+    }
+    uint64_t blocks;
+    const char *err = check_inode(node, &blocks);
+    if (err) {
+      istate[inum] = I_BAD;
+      problem(P_BAD_INODE, "inode %u: %s", inum, err);
+      continue;
+    }
+    istate[inum] = I_OK;
+    iblocks[inum] = blocks;
+    if (!marked) {
+      problem(P_INODE_BITMAP, "inode %u: in use but marked free", inum);
+    }
+    if (node->blocks != blocks) {
+      problem(P_BLOCK_COUNT, "inode %u: counts %u blocks, maps %lu", inum,
+              node->blocks, (unsigned long) blocks);
+    }
+    if (node->flags & INODE_FRAG) {
+      uint32_t mask = ((1u << node->frag.units) - 1) << node->frag.unit;
+      uint32_t was = __atomic_fetch_or(&frag_units[node->frag.block], mask,
+                                       __ATOMIC_RELAXED);
+      if (was & mask) {
+        problem(P_CROSSLINKED, "inode %u: fragment in block %u overlaps another",
+                inum, node->frag.block);
+      }
+    } else if (!(node->flags & INODE_INLINE)) {
+      // checked above, so this only counts its blocks as owned
+      uint64_t again = 0;
+      check_extents(&node->extents.hdr, 1, node->extents.hdr.depth, 0,
+                    (uint64_t) UINT32_MAX + 1, S_ISDIR(node->mode), &again, 1);
+    }
+  }
+}
+
+// Pass 2: directory entries
+
+static void bad_entry(uint32_t bnum, uint16_t slot) {
+  pthread_mutex_lock(&print_lock);
+  if (n_bad_entries == cap_bad_entries) {
+    cap_bad_entries = cap_bad_entries ? 2 * cap_bad_entries : 64;
+    bad_entries = realloc(bad_entries, cap_bad_entries * sizeof(entry_loc_t));
+  }
+  bad_entries[n_bad_entries].bnum = bnum;
+  bad_entries[n_bad_entries].slot = slot;
+  n_bad_entries++;
+  pthread_mutex_unlock(&print_lock);
+}
+
+static void check_entry(int dir, uint32_t bnum, uint16_t slot) {
+  dirent_t *e = (dirent_t *) blocks_get_block(bnum) + slot;
+  int len = strnlen(e->name, DIR_NAME_LENGTH);
+  const char *why = NULL;
+  if (len == 0 || len == DIR_NAME_LENGTH || memchr(e->name, '/', len) ||
+      strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0) {
+    why = "bad name";
+  } else if (e->inum < 1 || (uint32_t) e->inum >= sb->inode_count) {
+    why = "inode number out of range";
+  } else if (istate[e->inum] != I_OK) {
+    why = istate[e->inum] == I_BAD ? "names a damaged inode" : "names a free inode";
+  } else {
+    int32_t none = -1;
+    if (!__atomic_compare_exchange_n(&parent[e->inum], &none, dir, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      why = "second link to the inode";
+    } else {
+      link_bnum[e->inum] = bnum;
+      link_slot[e->inum] = slot;
+    }
+  }
+  if (why) {
+    problem(P_BAD_ENTRY, "directory %d: entry \"%.*s\" -> %d: %s", dir, len,
+            e->name, e->inum, why);
+    bad_entry(bnum, slot);
+  }
+}
+
+static void check_leaf(int dir, inode_t *node, uint32_t lblk, int nslots) {
+  uint32_t bnum = inode_get_bnum(node, lblk);
+  dirent_t *entries = blocks_get_block(bnum);
+  for (int i = 0; i < nslots; i++) {
+    if (entries[i].used) {
+      check_entry(dir, bnum, i);
+    }
+  }
+}
+
+static void check_dirs(uint32_t first, uint32_t end) {
+  for (uint32_t inum = first; inum < end; inum++) {
+    inode_t *node = get_inode(inum);
+    if (istate[inum] != I_OK || !S_ISDIR(node->mode) || node->size == 0) {
+      continue;
+    }
+    if (!(node->flags & INODE_DIR_INDEXED)) {
+      check_leaf(inum, node, 0, node->size / sizeof(dirent_t));
+      continue;
+    }
+    // a leaf named twice by the index is read once
+    uint32_t nblocks = node->size / BLOCK_SIZE;
+    uint8_t *seen = calloc((nblocks + 7) / 8, 1);
+    dx_node_t *root = dx_node_at(node, 0);
+    for (uint32_t i = 0; i < root->count; i++) {
+      dx_node_t *dx = root->levels ? dx_node_at(node, root->entries[i].block) : NULL;
+      uint32_t n = dx ? dx->count : 1;
+      for (uint32_t j = 0; j < n; j++) {
+        uint32_t leaf = dx ? dx->entries[j].block : root->entries[i].block;
+        if (!bitmap_get(seen, leaf)) {
+          bitmap_put(seen, leaf, 1);
+          check_leaf(inum, node, leaf, DIRENTS_PER_BLOCK);
+        }
+      }
+    }
+    free(seen);
+  }
+}
+
+// Pass 3: reachability. Each inode has one link, so following the links
+// up from any inode either reaches the root, or stops at an inode with no
+// link (an orphan), or goes round a loop of directories.
+
+static int *orphans; // inodes to link into lost+found (or free)
+static int n_orphans;
+
+static void check_reach() {
+  int *path = malloc(sb->inode_count * sizeof(int));
+  orphans = malloc(sb->inode_count * sizeof(int));
+  reach[0] = 1;
+  for (uint32_t inum = 1; inum < sb->inode_count; inum++) {
+    if (istate[inum] != I_OK || reach[inum]) {
+      continue;
+    }
+    int n = 0, at = inum;
+    while (reach[at] == 0 && parent[at] >= 0) {
+      reach[at] = 3;
+      path[n++] = at;
+      at = parent[at];
+    }
+    int ok = reach[at] == 1;
+    if (!ok && reach[at] != 2) {
+      // no link, or a loop back to the path: at heads an orphaned tree
+      orphans[n_orphans++] = at;
+      inode_t *node = get_inode(at);
+      problem(P_ORPHAN, "inode %d: %s of %ld bytes not reachable from the root%s",
+              at, S_ISDIR(node->mode) ? "directory" : "file", (long) node->size,
+              parent[at] >= 0 ? " (directory loop)" : "");
+    }
+    reach[at] = ok ? 1 : 2;
+    for (int i = 0; i < n; i++) {
+      reach[path[i]] = ok ? 1 : 2;
+    }
+  }
+  free(path);
+  for (uint32_t inum = 1; inum < sb->inode_count; inum++) {
+    inode_t *node = get_inode(inum);
+    if (istate[inum] == I_OK && parent[inum] >= 0 && node->refs != 1) {
+      problem(P_LINKS, "inode %u: link count %d, has 1 link", inum, node->refs);
+    }
+  }
+}
+
+// Pass 4: blocks
+
+static uint16_t *refcounts() { return blocks_get_block(sb->refcount_start); }
+
+// The refcount a block should have, or -1 if it is cross-linked.
+static int want_refcount(uint32_t b) {
+  uint32_t d = data_owners[b], m = meta_owners[b] + (frag_units[b] != 0);
+  if (m > 1 || (m == 1 && d > 0) || d > UINT16_MAX + 1) {
+    return -1;
+  }
+  return d > 0 ? d - 1 : 0;
+}
+
+static void check_blocks(uint32_t first, uint32_t end) {
+  void *bbm = get_blocks_bitmap();
+  uint16_t *refs = refcounts();
+  for (uint32_t b = first; b < end; b++) {
+    int used = bitmap_get(bbm, b);
+    if (b < sb->meta_start) {
+      if (!used) {
+        problem(P_UNMARKED, "block %u: metadata marked free", b);
+      }
+      continue;
+    }
+    int owned = data_owners[b] || meta_owners[b] || frag_units[b];
+    if (used && !owned) {
+      problem(P_LEAKED, "block %u: marked in use, owned by nothing", b);
+    } else if (!used && owned) {
+      problem(P_UNMARKED, "block %u: in use but marked free", b);
+    }
+    int want = want_refcount(b);
+    if (want < 0) {
+      problem(P_CROSSLINKED, "block %u: owned by %u extents, %u tree or "
+              "directory nodes, %d fragment blocks", b, data_owners[b],
+              meta_owners[b], frag_units[b] != 0);
+    } else if (refs[b] != want) {
+      problem(P_REFCOUNT, "block %u: refcount %u, has %d more owners", b,
+              refs[b], want);
+    }
+  }
+}
+
+// Repair
+
+static int unrepaired; // problems repair ran into
+
+static int set_bit(void *bm, uint32_t i, int v) {
+  if (bitmap_get(bm, i) == v) {
+    return 0;
+  }
+  journal_dirty((char *) bm + i / 8);
+  bitmap_put(bm, i, v);
+  return 1;
+}
+
+static void clear_entry(uint32_t bnum, uint16_t slot) {
+  dirent_t *e = (dirent_t *) blocks_get_block(bnum) + slot;
+  journal_dirty(e);
+  memset(e, 0, sizeof(dirent_t));
+}
+
+// Make the inodes, entries, bitmaps and refcounts agree with what the
+// passes found. Nothing is allocated: the free space index still comes
+// from the bitmap as it was.
+static void repair_tables() {
+  void *ibm = get_inode_bitmap();
+  void *bbm = get_blocks_bitmap();
+  journal_start();
+  for (uint32_t inum = 1; inum < sb->inode_count; inum++) {
+    inode_t *node = get_inode(inum);
+    int changed = set_bit(ibm, inum, istate[inum] == I_OK);
+    if (istate[inum] == I_BAD) {
+      // what it mapped was not counted as owned, so it is freed below
+      journal_dirty(node);
+      memset(node, 0, sizeof(inode_t));
+      changed = 1;
+    } else if (istate[inum] == I_OK &&
+               (node->blocks != iblocks[inum] ||
+                (parent[inum] >= 0 && node->refs != 1))) {
+      journal_dirty(node);
+      node->blocks = iblocks[inum];
+      node->refs = 1;
+      changed = 1;
+    }
+    if (changed) {
+      journal_restart();
+    }
+  }
+  for (int i = 0; i < n_bad_entries; i++) {
+    clear_entry(bad_entries[i].bnum, bad_entries[i].slot);
+    journal_restart();
+  }
+  uint16_t *refs = refcounts();
+  for (uint32_t b = sb->meta_start; b < sb->block_count; b++) {
+    int want = want_refcount(b);
+    if (want < 0) {
+      continue;
+    }
+    int changed =
+        set_bit(bbm, b, data_owners[b] || meta_owners[b] || frag_units[b]);
+    if (refs[b] != want) {
+      journal_dirty(&refs[b]);
+      refs[b] = want;
+      changed = 1;
+    }
+    if (changed) {
+      journal_restart();
+    }
+  }
+  journal_stop();
+}
+
+static int lost_found() {
+  inode_t *root = get_inode(0);
+  int inum = directory_lookup(root, "lost+found");
+  if (inum >= 0) {
+    return S_ISDIR(get_inode(inum)->mode) ? inum : -1;
+  }
+  inum = alloc_inode();
+  if (inum < 0) {
+    return -1;
+  }
+  inode_t *node = get_inode(inum);
+  journal_dirty(node);
+  node->mode = 040700;
+  if (directory_put(root, "lost+found", inum) < 0) {
+    free_inode(inum);
+    return -1;
+  }
+  return inum;
+}
+
+// Link the heads of orphaned trees into /lost+found, and free what is
+// left of snapshots being removed. Runs on the repaired tables, so it
+// can allocate.
+static void repair_orphans() {
+  frag_init();
+  journal_start();
+  int lf = -1;
+  for (int i = 0; i < n_orphans; i++) {
+    int inum = orphans[i];
+    inode_t *node = get_inode(inum);
+    if (parent[inum] >= 0) {
+      // in a loop: take it out
+      clear_entry(link_bnum[inum], link_slot[inum]);
+    }
+    if (node->flags & INODE_READONLY) {
+      continue;
+    }
+    char name[DIR_NAME_LENGTH];
+    snprintf(name, sizeof(name), "#%d", inum);
+    lf = lf >= 0 ? lf : lost_found();
+    if (lf < 0 || directory_put(get_inode(lf), name, inum) < 0) {
+      printf("couldn't link inode %d into /lost+found\n", inum);
+      unrepaired++;
+    }
+    journal_dirty(node);
+    node->refs = 1;
+    journal_restart();
+  }
+  for (uint32_t inum = 1; inum < sb->inode_count; inum++) {
+    if (istate[inum] == I_OK && reach[inum] == 2 &&
+        (get_inode(inum)->flags & INODE_READONLY)) {
+      free_inode(inum);
+      journal_restart();
+    }
+  }
+  journal_stop();
+}
+
+// Make sure path is a nufs image nothing has open before blocks_init
+// gets it: that would format an empty file, and wait for a mount to end.
+static int open_check(const char *path) {
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    fprintf(stderr, "nufs-fsck: %s is in use (mounted?)\n", path);
+    close(fd);
+    return -1;
+  }
+  superblock_t s;
+  ssize_t n = pread(fd, &s, sizeof(s), 0);
+  close(fd);
+  if (n != sizeof(s) || s.magic != NUFS_MAGIC || s.version != NUFS_VERSION ||
+      s.block_size != (uint32_t) BLOCK_SIZE) {
+    fprintf(stderr, "nufs-fsck: %s is not a nufs image of this version\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-y] [-j THREADS] IMAGE\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+  int fix = 0, opt;
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt(argc, argv, "yj:")) != -1) {
+    switch (opt) {
+    case 'y': fix = 1; break;
+    case 'j': nthreads = atoi(optarg); break;
+    default: usage(argv[0]); return 8;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 8;
+  }
+  nthreads = nthreads < 1 ? 1 : nthreads;
+  const char *image = argv[optind];
+  if (open_check(image) < 0) {
+    return 8;
+  }
+  dcache_init();
+  blocks_init(image);
+  sb = blocks_get_superblock();
+  uint32_t ninodes = sb->inode_count, nblocks = sb->block_count;
+
+  data_owners = calloc(nblocks, sizeof(uint32_t));
+  meta_owners = calloc(nblocks, sizeof(uint16_t));
+  frag_units = calloc(nblocks, sizeof(uint32_t));
+  istate = calloc(ninodes, 1);
+  iblocks = calloc(ninodes, sizeof(uint32_t));
+  parent = malloc(ninodes * sizeof(int32_t));
+  memset(parent, 0xff, ninodes * sizeof(int32_t));
+  link_bnum = calloc(ninodes, sizeof(uint32_t));
+  link_slot = calloc(ninodes, sizeof(uint16_t));
+  reach = calloc(ninodes, 1);
+
+  printf("checking %s: %u blocks, %u inodes, %d threads\n", image, nblocks,
+         ninodes, nthreads);
+  sweep(check_inodes, ninodes);
+  if (istate[0] != I_OK || !S_ISDIR(get_inode(0)->mode)) {
+    printf("the root directory is damaged; nothing more can be checked\n");
+    blocks_free();
+    return 8;
+  }
+  sweep(check_dirs, ninodes);
+  check_reach();
+  sweep(check_blocks, nblocks);
+
+  long found = 0, left = 0;
+  for (int k = 0; k < P_COUNT; k++) {
+    found += problems[k] != 0;
+    if (problems[k] > 0) {
+      printf("%8ld %s%s\n", problems[k], problem_label[k],
+             fix && !problem_fixable[k] ? " (not repaired)" : "");
+      left += !fix || !problem_fixable[k];
+    }
+  }
+  if (lines > FSCK_MAX_LINES) {
+    printf("(%d problems listed of %d)\n", FSCK_MAX_LINES, lines);
+  }
+  if (fix && found) {
+    repair_tables();
+    if (n_orphans > 0) {
+      // reopen, so the allocators start from the repaired bitmap
+      journal_shutdown();
+      blocks_free();
+      blocks_init(image);
+      sb = blocks_get_superblock();
+      repair_orphans();
+    }
+    journal_shutdown();
+    left += unrepaired;
+    printf(left ? "repaired what could be\n" : "repaired\n");
+  }
+  blocks_free();
+  if (!found) {
+    printf("clean\n");
+  }
+  return !found ? 0 : left ? 4 : 1;
+}
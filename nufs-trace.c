@@ -0,0 +1,115 @@
+/**
+ * nufs-trace: decode a trace file written by nufs (see trace.h), or
+ * change the trace level of a mounted nufs.
+ *
+ *   nufs-trace [trace-file]
+ *   nufs-trace -l LEVEL PATH
+ *
+ * Prints every record still in the rings, oldest first, one per line:
+ * seconds since tracing started, ring, op and its fields. With -l, sets
+ * the level (0 stops tracing) of the nufs that PATH, any file or
+ * directory in it, is on.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_OP_NAME(name) #name,
+static const char *op_names[] = {TRACE_OP_LIST(TRACE_OP_NAME)};
+#undef TRACE_OP_NAME
+
+typedef struct dump_rec {
+  trace_rec_t rec;
+  int ring;
+} dump_rec_t;
+
+static int by_tsc(const void *a, const void *b) {
+  uint64_t x = ((const dump_rec_t *) a)->rec.tsc;
+  uint64_t y = ((const dump_rec_t *) b)->rec.tsc;
+  return x < y ? -1 : x > y;
+}
+
+// Set the trace level of the filesystem path is on.
+static int set_level(const char *path, int level) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || ioctl(fd, NUFS_IOC_TRACE, &level) < 0) {
+    perror(path);
+    return 1;
+  }
+  close(fd);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int opt, set = 0, level = 0;
+  while ((opt = getopt(argc, argv, "l:")) != -1) {
+    switch (opt) {
+    case 'l': set = 1; level = atoi(optarg); break;
+    default:
+      fprintf(stderr, "usage: %s [trace-file]\n"
+                      "       %s -l LEVEL PATH\n",
+              argv[0], argv[0]);
+      return 2;
+    }
+  }
+  if (set) {
+    if (optind != argc - 1) {
+      fprintf(stderr, "%s: -l needs one PATH\n", argv[0]);
+      return 2;
+    }
+    return set_level(argv[optind], level);
+  }
+  const char *path = optind < argc ? argv[optind] : "nufs.trace";
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    return 1;
+  }
+  trace_hdr_t *hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (hdr == MAP_FAILED) {
+    perror(path);
+    return 1;
+  }
+  if ((size_t) st.st_size < sizeof(trace_hdr_t) || hdr->magic != TRACE_MAGIC ||
+      hdr->version != TRACE_VERSION || hdr->rec_size != sizeof(trace_rec_t) ||
+      hdr->ring_recs != TRACE_RING_RECS || hdr->nrings > hdr->max_rings ||
+      (size_t) st.st_size <
+          sizeof(trace_hdr_t) + hdr->max_rings * sizeof(trace_ring_t)) {
+    fprintf(stderr, "nufs-trace: %s is not a nufs trace\n", path);
+    return 1;
+  }
+
+  // collect what each ring still holds
+  trace_ring_t *rings = (trace_ring_t *) (hdr + 1);
+  dump_rec_t *recs = malloc(sizeof(dump_rec_t) * hdr->nrings * TRACE_RING_RECS + 1);
+  size_t n = 0;
+  for (uint32_t r = 0; r < hdr->nrings; r++) {
+    uint64_t head = __atomic_load_n(&rings[r].head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_RING_RECS ? head - TRACE_RING_RECS : 0;
+    for (uint64_t i = first; i < head; i++) {
+      recs[n].rec = rings[r].recs[i % TRACE_RING_RECS];
+      recs[n].ring = r;
+      n++;
+    }
+  }
+  qsort(recs, n, sizeof(dump_rec_t), by_tsc);
+
+  for (size_t i = 0; i < n; i++) {
+    trace_rec_t *rec = &recs[i].rec;
+    double t = (double) (int64_t) (rec->tsc - hdr->start_tsc) / hdr->tsc_hz;
+    const char *op = rec->op < TR_OP_COUNT ? op_names[rec->op] : "?";
+    printf("%14.6f  r%-2d %-9s inode %-6d off %-10lld size %-8u rv %d\n", t,
+           recs[i].ring, op, rec->inum, (long long) rec->offset, rec->size,
+           rec->rv);
+  }
+  printf("%zu records from %u threads\n", n, hdr->nrings);
+  return 0;
+}
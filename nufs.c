@@ -1,23 +1,45 @@
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h> // FS_IOC_GETFLAGS, FS_COMPR_FL
+#endif
 #include "storage.h"
+#include "stats.h"
+#include "trace.h"
+#include "vfile.h"
 
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 
+// File handles normally hold an inode number. Handles on the synthetic
+// files under /.nufs hold a vfile_t pointer tagged with this bit instead.
+#define VFILE_FH (1ULL << 63)
+
+// The snapshot behind a /.nufs handle, or NULL for a regular handle
+static vfile_t *fh_vfile(struct fuse_file_info *fi) {
+  if (!(fi->fh & VFILE_FH)) {
+    return NULL;
+  }
+  return (vfile_t *) (uintptr_t) (fi->fh & ~VFILE_FH);
+}
+
 // implementation for: man 2 access
 // Checks if a file exists.
 int nufs_access(const char *path, int mask) {
+  STATS_TIME(ST_FUSE_ACCESS);
   struct stat st;
-  int rv = storage_stat(path, &st);
-  printf("access(%s, %04o) -> %d\n", path, mask, rv);
+  int rv = vfile_owns(path) ? vfile_stat(path, &st) : storage_stat(path, &st);
+  TRACE(TRACE_OPS, TR_ACCESS, rv == 0 ? (int) st.st_ino : -1, 0, 0, rv);
   return rv;
 }
 
@@ -25,146 +47,387 @@ int nufs_access(const char *path, int mask) {
 // Implementation for: man 2 stat
 // This is a crucial function.
 int nufs_getattr(const char *path, struct stat *st) {
+  STATS_TIME(ST_FUSE_GETATTR);
   int rv = 0;
 
   if (strcmp(path, "/") == 0) {
     st->st_mode = 040755; // directory
     st->st_size = 0;
     st->st_uid = getuid();
+  } else if (vfile_owns(path)) {
+    rv = vfile_stat(path, st);
   } else { 
     //delegate to storage stat
     rv = storage_stat(path, st);
     st->st_uid = getuid();
   }
-  printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode,
-         st->st_size);
+  TRACE(TRACE_OPS, TR_GETATTR, rv == 0 ? (int) st->st_ino : -1, 0,
+        rv == 0 ? st->st_size : 0, rv);
   return rv;
 }
 
+struct readdir_buf {
+  void *buf;
+  fuse_fill_dir_t filler;
+};
+
+// Add one entry to the reply; returns 1 once it is full
+static int readdir_fill(void *arg, const char *name, const struct stat *st,
+                        off_t next) {
+  struct readdir_buf *rb = arg;
+  return rb->filler(rb->buf, name, st, next);
+}
+
+// Open a directory as nufs_open does a file: readdir and ioctl get no
+// path, so fi->fh holds its inode number, or just VFILE_FH for /.nufs.
+int nufs_opendir(const char *path, struct fuse_file_info *fi) {
+  STATS_TIME(ST_FUSE_OPENDIR);
+  if (vfile_owns(path)) {
+    struct stat st;
+    int rv = vfile_stat(path, &st);
+    if (rv == 0 && !S_ISDIR(st.st_mode)) {
+      rv = -ENOTDIR;
+    }
+    fi->fh = VFILE_FH;
+    TRACE(TRACE_OPS, TR_OPENDIR, -1, 0, 0, rv);
+    return rv;
+  }
+  int rv = storage_open(path);
+  if (rv >= 0) {
+    fi->fh = rv;
+    rv = 0;
+  }
+  TRACE(TRACE_OPS, TR_OPENDIR, rv == 0 ? (int) fi->fh : -1, 0, 0, rv);
+  return rv;
+}
+
+// Drop the handle taken by opendir
+int nufs_releasedir(const char *path, struct fuse_file_info *fi) {
+  STATS_TIME(ST_FUSE_RELEASEDIR);
+  if (fi->fh & VFILE_FH) {
+    return 0;
+  }
+  storage_release(fi->fh);
+  TRACE(TRACE_OPS, TR_RELEASEDIR, fi->fh, 0, 0, 0);
+  return 0;
+}
+
 // implementation for: man 2 readdir
 // lists the contents of a directory
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi) {
+  STATS_TIME(ST_FUSE_READDIR);
   struct stat st;
   int rv;
-  //delegate to storage stat
-  rv = storage_stat(path, &st);
-  assert(rv == 0);
-
-  filler(buf, ".", &st, 0);
-  storage_stat("..", &st); 
-  filler(buf, "..", &st, 0);
-  slist_t *entries = storage_list(path);
-  slist_t *cur = entries;
-
-  while (cur) {
-    const char *name = cur->data;
-    char full_path[128];
-    snprintf(full_path, sizeof(full_path), "%s/%s", path, name);
-    if (strcmp(path, "/") == 0) {
-      snprintf(full_path, sizeof(full_path), "/%s", name); // avoid //
-    }
-
-    if (storage_stat(full_path, &st) == 0) {
-      filler(buf, name, &st, 0);
+  if (fi->fh & VFILE_FH) {
+    rv = vfile_stat(VFILE_DIR, &st);
+    if (rv == 0) {
+      filler(buf, ".", &st, 0);
+      filler(buf, "..", NULL, 0);
+      slist_t *names = vfile_list();
+      for (slist_t *cur = names; cur; cur = cur->next) {
+        char full_path[128];
+        snprintf(full_path, sizeof(full_path), VFILE_DIR "/%s", cur->data);
+        if (vfile_stat(full_path, &st) == 0) {
+          filler(buf, cur->data, &st, 0);
+        }
+      }
+      s_free(names);
     }
-
-    cur = cur->next;
+    TRACE(TRACE_OPS, TR_READDIR, -1, offset, 0, rv);
+    return rv;
   }
-  s_free(entries);
-  printf("readdir(%s) -> %d\n", path, rv);
-  return 0;
+  struct readdir_buf rb = {buf, filler};
+  rv = storage_freaddir(fi->fh, offset, readdir_fill, &rb);
+  TRACE(TRACE_OPS, TR_READDIR, fi->fh, offset, 0, rv);
+  return rv;
 }
 
+
 // mknod makes a filesystem object like a file or directory
 // called for: man 2 open, man 2 link
 // Note, for this assignment, you can alternatively implement the create
 // function.
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
-  int rv = storage_mknod(path, mode);
-  printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
+  STATS_TIME(ST_FUSE_MKNOD);
+  int rv = vfile_owns(path) ? -EACCES : storage_mknod(path, mode);
+  TRACE(TRACE_OPS, TR_MKNOD, -1, 0, 0, rv);
   return rv;
 }
 
-// same thing as mknod
+// same thing as mknod, but also opens the new file
 int nufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-  int rv = storage_mknod(path, mode);
-  printf("create(%s, %04o) -> %d\n", path, mode, rv);
+  STATS_TIME(ST_FUSE_CREATE);
+  int rv = vfile_owns(path) ? -EACCES : storage_mknod(path, mode);
+  if (rv == 0) {
+    int inum = storage_open(path);
+    if (inum < 0) {
+      rv = inum;
+    } else {
+      fi->fh = inum;
+    }
+  }
+  TRACE(TRACE_OPS, TR_CREATE, rv == 0 ? (int) fi->fh : -1, 0, 0, rv);
   return rv;
 }
 
 // most of the following callbacks implement
 // another system call; see section 2 of the manual
 int nufs_mkdir(const char *path, mode_t mode) {
-  int rv = storage_mkdir(path, mode);
-  printf("mkdir(%s) -> %d\n", path, rv);
+  STATS_TIME(ST_FUSE_MKDIR);
+  int rv = vfile_owns(path) ? -EACCES : storage_mkdir(path, mode);
+  TRACE(TRACE_OPS, TR_MKDIR, -1, 0, 0, rv);
   return rv;
 }
 
 //removes files by delegating to storage unlink
 int nufs_unlink(const char *path) {
-  int rv = storage_unlink(path);
-  printf("unlink(%s) -> %d\n", path, rv);
+  STATS_TIME(ST_FUSE_UNLINK);
+  int rv = vfile_owns(path) ? -EACCES : storage_unlink(path);
+  TRACE(TRACE_OPS, TR_UNLINK, -1, 0, 0, rv);
   return rv;
 }
 
 int nufs_link(const char *from, const char *to) {
+  STATS_TIME(ST_FUSE_LINK);
   int rv = -1;
-  printf("link(%s => %s) -> %d\n", from, to, rv);
+  TRACE(TRACE_OPS, TR_LINK, -1, 0, 0, rv);
   return rv;
 }
 
 //removes a directory by delegating to storage rmdir
 int nufs_rmdir(const char *path) {
-  int rv = storage_rmdir(path);
-  printf("rmdir(%s) -> %d\n", path, rv);
+  STATS_TIME(ST_FUSE_RMDIR);
+  int rv = vfile_owns(path) ? -EACCES : storage_rmdir(path);
+  TRACE(TRACE_OPS, TR_RMDIR, -1, 0, 0, rv);
   return rv;
 }
 
 // implements: man 2 rename
 // called to move a file within the same filesystem
 int nufs_rename(const char *from, const char *to) {
-  int rv = storage_rename(from, to);
-  printf("rename(%s => %s) -> %d\n", from, to, rv);
+  STATS_TIME(ST_FUSE_RENAME);
+  int rv = vfile_owns(from) || vfile_owns(to) ? -EACCES
+                                              : storage_rename(from, to);
+  TRACE(TRACE_OPS, TR_RENAME, -1, 0, 0, rv);
   return rv;
 }
 
 int nufs_chmod(const char *path, mode_t mode) {
+  STATS_TIME(ST_FUSE_CHMOD);
   int rv = -1;
-  printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
+  TRACE(TRACE_OPS, TR_CHMOD, -1, 0, 0, rv);
   return rv;
 }
 
 //resizes the file by delegating to storage truncate
 int nufs_truncate(const char *path, off_t size) {
-  int rv = storage_truncate(path, size);
-  printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+  STATS_TIME(ST_FUSE_TRUNCATE);
+  int rv = vfile_owns(path) ? -EACCES : storage_truncate(path, size);
+  TRACE(TRACE_OPS, TR_TRUNCATE, -1, size, 0, rv);
   return rv;
 }
 
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible.
+// Resolve the path once and keep the inode number in fi->fh, so the
+// read/write/ftruncate/fgetattr calls on this handle skip path lookup.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
-  int rv = 0;
-  printf("open(%s) -> %d\n", path, rv);
+  STATS_TIME(ST_FUSE_OPEN);
+  if (vfile_owns(path)) {
+    // snapshot now, so every read on this handle sees the same text;
+    // direct_io keeps the kernel from cutting reads off at a stale size
+    vfile_t *vf = NULL;
+    int rv = (fi->flags & O_ACCMODE) != O_RDONLY ? -EACCES
+             : (vf = vfile_open(path)) ? 0 : -ENOENT;
+    if (vf) {
+      fi->fh = VFILE_FH | (uintptr_t) vf;
+      fi->direct_io = 1;
+    }
+    TRACE(TRACE_OPS, TR_OPEN, -1, 0, 0, rv);
+    return rv;
+  }
+  int rv = storage_open(path);
+  if (rv >= 0) {
+    fi->fh = rv;
+    rv = 0;
+  }
+  TRACE(TRACE_OPS, TR_OPEN, rv == 0 ? (int) fi->fh : -1, 0, 0, rv);
+  return rv;
+}
+
+// Drop the handle taken by open/create
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+  STATS_TIME(ST_FUSE_RELEASE);
+  if (fh_vfile(fi)) {
+    vfile_close(fh_vfile(fi));
+    return 0;
+  }
+  storage_release(fi->fh);
+  TRACE(TRACE_OPS, TR_RELEASE, fi->fh, 0, 0, 0);
+  return 0;
+}
+
+// Called on every close of a handle; starts writeback of the file's data
+// without waiting for it
+int nufs_flush(const char *path, struct fuse_file_info *fi) {
+  STATS_TIME(ST_FUSE_FLUSH);
+  if (!fh_vfile(fi)) {
+    storage_flush(fi->fh);
+  }
+  TRACE(TRACE_OPS, TR_FLUSH, fh_vfile(fi) ? -1 : (int) fi->fh, 0, 0, 0);
+  return 0;
+}
+
+// Make the file's data and metadata durable
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  STATS_TIME(ST_FUSE_FSYNC);
+  int rv = fh_vfile(fi) ? 0 : storage_fsync(fi->fh, datasync);
+  TRACE(TRACE_OPS, TR_FSYNC, fh_vfile(fi) ? -1 : (int) fi->fh, 0, 0, rv);
+  return rv;
+}
+
+// Make a directory's entries durable; they are all in the journal
+int nufs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+  STATS_TIME(ST_FUSE_FSYNCDIR);
+  int rv = storage_sync_meta();
+  TRACE(TRACE_OPS, TR_FSYNCDIR, -1, 0, 0, rv);
   return rv;
 }
 
 // Actually read data
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
-  int rv = storage_read(path, buf, size, offset);
-  printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  STATS_TIME(ST_FUSE_READ);
+  vfile_t *vf = fh_vfile(fi);
+  int rv = vf ? vfile_read(vf, buf, size, offset)
+              : storage_fread(fi->fh, buf, size, offset);
+  TRACE(TRACE_OPS, TR_READ, vf ? -1 : (int) fi->fh, offset, size, rv);
+  return rv;
+}
+
+// Read without copying: the reply points at the image ranges holding the
+// data, which FUSE splices into /dev/fuse when it can. FUSE frees memory
+// buffers in the vector, so only holes and /.nufs snapshots get those.
+int nufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                  off_t offset, struct fuse_file_info *fi) {
+  STATS_TIME(ST_FUSE_READ);
+  vfile_t *vf = fh_vfile(fi);
+  storage_seg_t *segs = NULL;
+  int n = 0;
+  int rv;
+  if (vf) {
+    char *mem = malloc(size);
+    rv = vfile_read(vf, mem, size, offset);
+    if (rv < 0) {
+      free(mem);
+    } else {
+      n = 1;
+      segs = malloc(sizeof(storage_seg_t));
+      segs[0].fd = -1;
+      segs[0].mem = mem;
+      segs[0].len = rv;
+    }
+  } else {
+    rv = storage_fread_segs(fi->fh, size, offset, &segs, &n);
+  }
+  if (rv >= 0) {
+    struct fuse_bufvec *bv =
+        malloc(sizeof(struct fuse_bufvec) + n * sizeof(struct fuse_buf));
+    *bv = FUSE_BUFVEC_INIT(0);
+    bv->count = n > 0 ? n : 1;
+    for (int i = 0; i < n; i++) {
+      struct fuse_buf *b = &bv->buf[i];
+      memset(b, 0, sizeof(struct fuse_buf));
+      b->size = segs[i].len;
+      if (segs[i].fd >= 0) {
+        b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        b->fd = segs[i].fd;
+        b->pos = segs[i].pos;
+      } else {
+        b->fd = -1;
+        b->mem = segs[i].mem ? segs[i].mem : calloc(1, segs[i].len);
+      }
+    }
+    *bufp = bv;
+  }
+  free(segs);
+  TRACE(TRACE_OPS, TR_READ, vf ? -1 : (int) fi->fh, offset, size, rv);
+  return rv < 0 ? rv : 0;
+}
+
+// Copy the request's buffers (memory, or a pipe FUSE spliced the data
+// into) straight into the image ranges storage_fwrite_segs hands over.
+static ssize_t copy_bufvec(void *arg, const storage_seg_t *segs, int n) {
+  struct fuse_bufvec *src = arg;
+  ssize_t done = 0;
+  for (int i = 0; i < n; i++) {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(segs[i].len);
+    if (segs[i].fd >= 0 &&
+        (!segs[i].mem || (src->idx < src->count &&
+                          (src->buf[src->idx].flags & FUSE_BUF_IS_FD)))) {
+      dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      dst.buf[0].fd = segs[i].fd;
+      dst.buf[0].pos = segs[i].pos;
+    } else {
+      dst.buf[0].mem = segs[i].mem; // a memcpy beats a pwrite
+    }
+    ssize_t rv = fuse_buf_copy(&dst, src, 0);
+    if (rv < 0) {
+      return done > 0 ? done : rv;
+    }
+    done += rv;
+    if ((size_t) rv < segs[i].len) {
+      break;
+    }
+  }
+  return done;
+}
+
+// Write from the request's buffers without an intermediate copy
+int nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                   struct fuse_file_info *fi) {
+  STATS_TIME(ST_FUSE_WRITE);
+  size_t size = fuse_buf_size(buf);
+  int rv = fh_vfile(fi) ? -EACCES
+                        : storage_fwrite_segs(fi->fh, size, offset,
+                                              copy_bufvec, buf);
+  TRACE(TRACE_OPS, TR_WRITE, fi->fh, offset, size, rv);
   return rv;
 }
 
 // Actually write data
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
-  int rv = storage_write(path, buf, size, offset);
-  printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  STATS_TIME(ST_FUSE_WRITE);
+  int rv = fh_vfile(fi) ? -EACCES : storage_fwrite(fi->fh, buf, size, offset);
+  TRACE(TRACE_OPS, TR_WRITE, fi->fh, offset, size, rv);
+  return rv;
+}
+
+// resizes an open file by its handle
+int nufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+  STATS_TIME(ST_FUSE_FTRUNCATE);
+  int rv = fh_vfile(fi) ? -EACCES : storage_ftruncate(fi->fh, size);
+  TRACE(TRACE_OPS, TR_FTRUNCATE, fi->fh, size, 0, rv);
+  return rv;
+}
+
+// gets the attributes of an open file by its handle
+int nufs_fgetattr(const char *path, struct stat *st,
+                  struct fuse_file_info *fi) {
+  STATS_TIME(ST_FUSE_FGETATTR);
+  vfile_t *vf = fh_vfile(fi);
+  int rv = 0;
+  if (vf) {
+    // the snapshot's length, not the live file's
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = 0100444;
+    st->st_nlink = 1;
+    st->st_size = vf->len;
+  } else {
+    rv = storage_fstat(fi->fh, st);
+  }
+  st->st_uid = getuid();
+  TRACE(TRACE_OPS, TR_FGETATTR, fi->fh, 0, rv == 0 ? st->st_size : 0, rv);
   return rv;
 }
 
@@ -176,19 +439,69 @@ int nufs_utimens(const char *path, const struct timespec ts[2]) {
   return 0;
 }
 
-// Extended operations
+// Extended operations: the inode flags, of which only the compression
+// flag (chattr +c) is supported, reflinks into the file (nufs-clone) and
+// defragmenting it (nufs-defrag)
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
-  int rv = -1;
-  printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+  STATS_TIME(ST_FUSE_IOCTL);
+  // the handle is the file's, or the directory's from opendir
+  int inum = fi->fh & VFILE_FH ? -1 : (int) fi->fh;
+  int rv = -ENOTTY;
+  if ((unsigned int) cmd == NUFS_IOC_TRACE) {
+    // not about the file: any handle in the filesystem will do
+    int level = *(int *) data;
+    rv = level < 0 ? -EINVAL : trace_set_level(level);
+  } else if (inum < 0) {
+    // not inodes
+  } else if ((unsigned int) cmd == NUFS_IOC_CLONE ||
+             (unsigned int) cmd == NUFS_IOC_CLONE_RANGE) {
+    struct nufs_clone *req = data;
+    req->src[NUFS_CLONE_PATH_MAX - 1] = 0;
+    rv = (unsigned int) cmd == NUFS_IOC_CLONE
+             ? storage_fclone(req->src, inum)
+             : storage_fclone_range(req->src, inum, req->src_offset,
+                                    req->src_length, req->dest_offset);
+  } else if ((unsigned int) cmd == NUFS_IOC_DEFRAG) {
+    rv = storage_fdefrag(inum, data);
+  }
+#ifdef FS_IOC_GETFLAGS
+  else if ((unsigned int) cmd == FS_IOC_GETFLAGS) {
+    rv = storage_fget_compress(inum);
+    if (rv >= 0) {
+      *(int *) data = rv ? FS_COMPR_FL : 0;
+      rv = 0;
+    }
+  } else if ((unsigned int) cmd == FS_IOC_SETFLAGS) {
+    int want = *(int *) data;
+    rv = want & ~FS_COMPR_FL ? -EOPNOTSUPP
+                             : storage_fset_compress(inum, want & FS_COMPR_FL);
+  }
+#endif
+  TRACE(TRACE_OPS, TR_IOCTL, inum, 0, cmd, rv);
   return rv;
 }
 
+// Runs in the process that serves requests, after FUSE has daemonized.
+void *nufs_init(struct fuse_conn_info *conn) {
+  (void) conn;
+  storage_start();
+  return NULL;
+}
+
+// Unmounted: write back dirty data and commit what is left in the journal.
+void nufs_destroy(void *private_data) {
+  (void) private_data;
+  storage_free();
+}
+
 void nufs_init_ops(struct fuse_operations *ops) {
   memset(ops, 0, sizeof(struct fuse_operations));
   ops->access = nufs_access;
   ops->getattr = nufs_getattr;
+  ops->opendir = nufs_opendir;
   ops->readdir = nufs_readdir;
+  ops->releasedir = nufs_releasedir;
   ops->mknod = nufs_mknod;
   ops->create   = nufs_create; // alternative to mknod
   ops->mkdir = nufs_mkdir;
@@ -199,10 +512,23 @@ void nufs_init_ops(struct fuse_operations *ops) {
   ops->chmod = nufs_chmod;
   ops->truncate = nufs_truncate;
   ops->open = nufs_open;
+  ops->release = nufs_release;
+  ops->flush = nufs_flush;
+  ops->fsync = nufs_fsync;
+  ops->fsyncdir = nufs_fsyncdir;
   ops->read = nufs_read;
   ops->write = nufs_write;
+  ops->read_buf = nufs_read_buf;
+  ops->write_buf = nufs_write_buf;
+  ops->ftruncate = nufs_ftruncate;
+  ops->fgetattr = nufs_fgetattr;
+  // handle-based calls don't need FUSE to build a path for them
+  ops->flag_nullpath_ok = 1;
+  ops->flag_nopath = 1;
   ops->utimens = nufs_utimens;
   ops->ioctl = nufs_ioctl;
+  ops->init = nufs_init;
+  ops->destroy = nufs_destroy;
 };
 
 struct fuse_operations nufs_ops;
@@ -210,6 +536,7 @@ struct fuse_operations nufs_ops;
 //main file to run everything
 int main(int argc, char *argv[]) {
   assert(argc > 2 && argc < 6);
+  trace_init();
   storage_init(argv[--argc]);
   nufs_init_ops(&nufs_ops);
   return fuse_main(argc, argv, &nufs_ops, NULL);
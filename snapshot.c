@@ -0,0 +1,160 @@
+// snapshot.c
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "blocks.h"
+#include "directory.h"
+#include "frag.h"
+#include "inode.h"
+#include "journal.h"
+#include "snapshot.h"
+
+static int snap_dir = -1; // inode number of /.snapshots
+
+int snapshot_init() {
+  inode_t *root = get_inode(0);
+  snap_dir = directory_lookup(root, SNAPSHOT_DIR);
+  if (snap_dir >= 0) {
+    return snap_dir;
+  }
+  int inum = alloc_inode();
+  if (inum < 0) {
+    return -ENOSPC;
+  }
+  inode_t *node = get_inode(inum);
+  journal_dirty(node);
+  node->mode = 040555;
+  node->flags = INODE_READONLY;
+  int rv = directory_put(root, SNAPSHOT_DIR, inum);
+  if (rv < 0) {
+    free_inode(inum);
+    return rv;
+  }
+  snap_dir = inum;
+  return inum;
+}
+
+int snapshot_dir() { return snap_dir; }
+
+// Free a copy that was never entered in /.snapshots, so nothing else can
+// reach it and it needs no locks.
+static void drop_tree(int inum);
+
+static int drop_entry(void *arg, const char *name, int inum, uint64_t next) {
+  (void) arg;
+  (void) name;
+  (void) next;
+  drop_tree(inum);
+  return 0;
+}
+
+static void drop_tree(int inum) {
+  inode_t *node = get_inode(inum);
+  if (S_ISDIR(node->mode)) {
+    directory_iterate(node, 0, drop_entry, NULL);
+  }
+  free_inode(inum);
+}
+
+// Give a read-only copy the data of the original: small files are copied,
+// files in blocks get an extent tree sharing the original's blocks.
+static int copy_data(inode_t *to, inode_t *from) {
+  to->size = from->size;
+  if (from->flags & INODE_INLINE) {
+    to->flags |= INODE_INLINE;
+    memcpy(to->inline_data, from->inline_data, sizeof(to->inline_data));
+    return 0;
+  }
+  if (from->flags & INODE_FRAG) {
+    int rv = frag_alloc(from->frag.units, &to->frag);
+    if (rv < 0) {
+      return rv;
+    }
+    to->flags |= INODE_FRAG;
+    memcpy(frag_data(&to->frag), frag_data(&from->frag),
+           (size_t) from->frag.units * FRAG_SIZE);
+    blocks_mark_dirty(inode_get_inum(to), to->frag.block, 1);
+    return 0;
+  }
+  if (from->blocks == 0) {
+    return 0;
+  }
+  return inode_clone(to, 0, from, 0, bytes_to_blocks(from->size));
+}
+
+static int copy_tree(int src, int *out);
+
+typedef struct copy_ctx {
+  int from; // directory being copied
+  int to;   // its copy
+  int rv;
+} copy_ctx_t;
+
+static int copy_entry(void *arg, const char *name, int inum, uint64_t next) {
+  (void) next;
+  copy_ctx_t *ctx = arg;
+  if (ctx->from == 0 && strcmp(name, SNAPSHOT_DIR) == 0) {
+    return 0; // snapshots don't hold the snapshots before them
+  }
+  int copy;
+  ctx->rv = copy_tree(inum, &copy);
+  if (ctx->rv == 0) {
+    ctx->rv = directory_put(get_inode(ctx->to), name, copy);
+    if (ctx->rv < 0) {
+      drop_tree(copy);
+      ctx->rv = -ENOSPC;
+    }
+  }
+  return ctx->rv;
+}
+
+// Copy the inode src and, for a directory, everything under it. Each
+// inode is a transaction point: the copy is only reachable once it is
+// entered in /.snapshots, so a crash before that leaves an orphan tree
+// behind but no damage.
+static int copy_tree(int src, int *out) {
+  inode_t *from = get_inode(src);
+  int inum = alloc_inode();
+  if (inum < 0) {
+    return -ENOSPC;
+  }
+  inode_t *to = get_inode(inum);
+  journal_dirty(to);
+  to->mode = from->mode;
+  to->flags = (from->flags & INODE_COMPRESS) | INODE_READONLY;
+  int rv;
+  if (S_ISDIR(from->mode)) {
+    copy_ctx_t ctx = {src, inum, 0};
+    directory_iterate(from, 0, copy_entry, &ctx);
+    rv = ctx.rv;
+  } else {
+    rv = copy_data(to, from);
+  }
+  if (rv < 0) {
+    drop_tree(inum);
+    return rv;
+  }
+  *out = inum;
+  journal_restart();
+  return 0;
+}
+
+int snapshot_take(const char *name) {
+  inode_t *dir = get_inode(snap_dir);
+  if (directory_lookup(dir, name) >= 0) {
+    return -EEXIST;
+  }
+  int root;
+  int rv = copy_tree(0, &root);
+  if (rv < 0) {
+    return rv;
+  }
+  rv = directory_put(dir, name, root);
+  if (rv < 0) {
+    drop_tree(root);
+    return rv == -EEXIST ? rv : -ENOSPC;
+  }
+  return 0;
+}
@@ -0,0 +1,45 @@
+/**
+ * Read-only snapshots of the whole filesystem.
+ *
+ * The directory /.snapshots is made at mount if it is missing. Making a
+ * directory in it takes a snapshot under that name: a copy of the tree as
+ * it stands at that moment, taken while every change waits
+ * (journal_freeze). Files in the copy share their data blocks with the
+ * originals (blocks_ref), so a snapshot costs inodes, directory blocks
+ * and extent trees, not a copy of the data; a later write to either side
+ * copies just the blocks it changes (inode_unshare). Everything in a
+ * snapshot, and /.snapshots itself, is INODE_READONLY. Removing a
+ * snapshot's directory deletes the snapshot whole.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "inode.h"
+
+#define SNAPSHOT_DIR ".snapshots" // in the root directory
+
+/**
+ * Find /.snapshots, making it if it is missing. Call from storage_init,
+ * inside a journal handle.
+ *
+ * @return Its inode number, or -ENOSPC.
+ */
+int snapshot_init();
+
+/**
+ * The inode number of /.snapshots.
+ */
+int snapshot_dir();
+
+/**
+ * Take a snapshot of the root directory's tree, /.snapshots left out, and
+ * enter it in /.snapshots. Call frozen (journal_freeze), inside a journal
+ * handle, with /.snapshots locked for writing.
+ *
+ * @param name Name of the snapshot.
+ *
+ * @return 0, -EEXIST, or -ENOSPC with nothing left behind.
+ */
+int snapshot_take(const char *name);
+
+#endif
@@ -0,0 +1,158 @@
+/**
+ * Operation counters and latency histograms.
+ *
+ * Histograms are log-linear: four buckets per power of two of
+ * nanoseconds, so a reported percentile is within 25% of the true value
+ * from 4ns up to about half an hour. Updates go to one of a few
+ * cache-line aligned shards picked per thread, so threads rarely write
+ * the same lines; a snapshot sums the shards.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define STATS_SUB 4 // buckets per power of two
+#define STATS_BUCKETS 160
+#define STATS_SHARDS 16
+
+typedef struct stats_shard {
+  uint64_t hist[ST_OP_COUNT][STATS_BUCKETS];
+  uint64_t total_ns[ST_OP_COUNT];
+  uint64_t max_ns[ST_OP_COUNT];
+  uint64_t counters[ST_COUNTER_COUNT];
+} __attribute__((aligned(64))) stats_shard_t;
+
+static stats_shard_t stats_shards[STATS_SHARDS];
+static int stats_next_shard;
+static __thread stats_shard_t *stats_my_shard;
+
+#define STATS_LABEL(name, label) label,
+static const char *op_labels[] = {STATS_OP_LIST(STATS_LABEL)};
+static const char *counter_labels[] = {STATS_COUNTER_LIST(STATS_LABEL)};
+#undef STATS_LABEL
+
+static stats_shard_t *stats_shard() {
+  if (!stats_my_shard) {
+    int i = __atomic_fetch_add(&stats_next_shard, 1, __ATOMIC_RELAXED);
+    stats_my_shard = &stats_shards[i % STATS_SHARDS];
+  }
+  return stats_my_shard;
+}
+
+// Histogram bucket for a latency
+static int stats_bucket(uint64_t ns) {
+  if (ns < STATS_SUB) {
+    return ns;
+  }
+  int msb = 63 - __builtin_clzll(ns);
+  int sub = (ns >> (msb - 2)) & (STATS_SUB - 1);
+  int b = (msb - 1) * STATS_SUB + sub;
+  return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+// Smallest latency above everything in bucket b
+static uint64_t stats_bucket_limit(int b) {
+  if (b < STATS_SUB) {
+    return b + 1;
+  }
+  int msb = b / STATS_SUB + 1;
+  return (uint64_t) (STATS_SUB + 1 + b % STATS_SUB) << (msb - 2);
+}
+
+// Monotonic clock in nanoseconds.
+uint64_t stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Record one op.
+void stats_op(int op, uint64_t start) {
+  uint64_t ns = stats_now() - start;
+  stats_shard_t *sh = stats_shard();
+  __atomic_fetch_add(&sh->hist[op][stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&sh->total_ns[op], ns, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&sh->max_ns[op], __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&sh->max_ns[op], &max, ns, 1,
+                                                  __ATOMIC_RELAXED,
+                                                  __ATOMIC_RELAXED)) {
+  }
+}
+
+void stats_timer_end(stats_timer_t *timer) {
+  stats_op(timer->op, timer->start);
+}
+
+// Add n to a counter.
+void stats_add(int counter, uint64_t n) {
+  __atomic_fetch_add(&stats_shard()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+// snprintf onto the end of what is already in buf
+static void stats_printf(char *buf, size_t cap, size_t *len, const char *fmt,
+                         ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(*len < cap ? buf + *len : NULL,
+                    *len < cap ? cap - *len : 0, fmt, ap);
+  va_end(ap);
+  *len += n;
+}
+
+// Latency below which a fraction q of the ops fell
+static uint64_t stats_quantile(uint64_t *hist, uint64_t count, double q) {
+  uint64_t want = (uint64_t) (q * count);
+  uint64_t seen = 0;
+  for (int b = 0; b < STATS_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen > want) {
+      return stats_bucket_limit(b);
+    }
+  }
+  return stats_bucket_limit(STATS_BUCKETS - 1);
+}
+
+// Format a snapshot of all counters and histograms.
+size_t stats_render(char *buf, size_t cap) {
+  size_t len = 0;
+  stats_printf(buf, cap, &len,
+               "# latencies in ns; percentiles are histogram bucket bounds\n");
+
+  for (int c = 0; c < ST_COUNTER_COUNT; c++) {
+    uint64_t n = 0;
+    for (int s = 0; s < STATS_SHARDS; s++) {
+      n += __atomic_load_n(&stats_shards[s].counters[c], __ATOMIC_RELAXED);
+    }
+    stats_printf(buf, cap, &len, "%s %llu\n", counter_labels[c],
+                 (unsigned long long) n);
+  }
+
+  for (int op = 0; op < ST_OP_COUNT; op++) {
+    uint64_t hist[STATS_BUCKETS] = {0};
+    uint64_t count = 0, total = 0, max = 0;
+    for (int s = 0; s < STATS_SHARDS; s++) {
+      stats_shard_t *sh = &stats_shards[s];
+      for (int b = 0; b < STATS_BUCKETS; b++) {
+        uint64_t n = __atomic_load_n(&sh->hist[op][b], __ATOMIC_RELAXED);
+        hist[b] += n;
+        count += n;
+      }
+      total += __atomic_load_n(&sh->total_ns[op], __ATOMIC_RELAXED);
+      uint64_t m = __atomic_load_n(&sh->max_ns[op], __ATOMIC_RELAXED);
+      max = m > max ? m : max;
+    }
+    stats_printf(buf, cap, &len,
+                 "%s count=%llu mean=%llu p50=%llu p90=%llu p99=%llu "
+                 "p999=%llu max=%llu\n",
+                 op_labels[op], (unsigned long long) count,
+                 (unsigned long long) (count ? total / count : 0),
+                 (unsigned long long) (count ? stats_quantile(hist, count, 0.5) : 0),
+                 (unsigned long long) (count ? stats_quantile(hist, count, 0.9) : 0),
+                 (unsigned long long) (count ? stats_quantile(hist, count, 0.99) : 0),
+                 (unsigned long long) (count ? stats_quantile(hist, count, 0.999) : 0),
+                 (unsigned long long) max);
+  }
+  return len;
+}
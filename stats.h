@@ -0,0 +1,127 @@
+/**
+ * Operation counters and latency histograms.
+ *
+ * Every FUSE callback and every storage_* call is timed into a
+ * log-linear histogram, and the layers below bump counters (bytes moved,
+ * blocks allocated, directory entries scanned, ...). Everything lives in
+ * memory; stats_render formats a snapshot as text, which nufs serves as
+ * the read-only file /.nufs/stats.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Timed operations; X(name, label) expands once per op.
+#define STATS_OP_LIST(X)                                                       \
+  X(FUSE_ACCESS, "fuse.access")                                                \
+  X(FUSE_GETATTR, "fuse.getattr")                                              \
+  X(FUSE_READDIR, "fuse.readdir")                                              \
+  X(FUSE_MKNOD, "fuse.mknod")                                                  \
+  X(FUSE_CREATE, "fuse.create")                                                \
+  X(FUSE_MKDIR, "fuse.mkdir")                                                  \
+  X(FUSE_UNLINK, "fuse.unlink")                                                \
+  X(FUSE_LINK, "fuse.link")                                                    \
+  X(FUSE_RMDIR, "fuse.rmdir")                                                  \
+  X(FUSE_RENAME, "fuse.rename")                                                \
+  X(FUSE_CHMOD, "fuse.chmod")                                                  \
+  X(FUSE_TRUNCATE, "fuse.truncate")                                            \
+  X(FUSE_OPEN, "fuse.open")                                                    \
+  X(FUSE_RELEASE, "fuse.release")                                              \
+  X(FUSE_OPENDIR, "fuse.opendir")                                              \
+  X(FUSE_RELEASEDIR, "fuse.releasedir")                                        \
+  X(FUSE_READ, "fuse.read")                                                    \
+  X(FUSE_WRITE, "fuse.write")                                                  \
+  X(FUSE_FTRUNCATE, "fuse.ftruncate")                                          \
+  X(FUSE_FGETATTR, "fuse.fgetattr")                                            \
+  X(FUSE_IOCTL, "fuse.ioctl")                                                  \
+  X(FUSE_FLUSH, "fuse.flush")                                                  \
+  X(FUSE_FSYNC, "fuse.fsync")                                                  \
+  X(FUSE_FSYNCDIR, "fuse.fsyncdir")                                            \
+  X(STORAGE_STAT, "storage.stat")                                              \
+  X(STORAGE_FSTAT, "storage.fstat")                                            \
+  X(STORAGE_OPEN, "storage.open")                                              \
+  X(STORAGE_RELEASE, "storage.release")                                        \
+  X(STORAGE_READ, "storage.read")                                              \
+  X(STORAGE_FREAD, "storage.fread")                                            \
+  X(STORAGE_WRITE, "storage.write")                                            \
+  X(STORAGE_FWRITE, "storage.fwrite")                                          \
+  X(STORAGE_TRUNCATE, "storage.truncate")                                      \
+  X(STORAGE_FTRUNCATE, "storage.ftruncate")                                    \
+  X(STORAGE_MKNOD, "storage.mknod")                                            \
+  X(STORAGE_MKDIR, "storage.mkdir")                                            \
+  X(STORAGE_UNLINK, "storage.unlink")                                          \
+  X(STORAGE_RMDIR, "storage.rmdir")                                            \
+  X(STORAGE_RENAME, "storage.rename")                                          \
+  X(STORAGE_READDIR, "storage.readdir")                                        \
+  X(STORAGE_FSYNC, "storage.fsync")                                            \
+  X(JOURNAL_COMMIT, "journal.commit")
+
+// Plain counters
+#define STATS_COUNTER_LIST(X)                                                  \
+  X(BYTES_READ, "bytes_read")                                                  \
+  X(BYTES_WRITTEN, "bytes_written")                                            \
+  X(BLOCKS_ALLOCATED, "blocks_allocated")                                      \
+  X(BLOCKS_FREED, "blocks_freed")                                              \
+  X(DIRENTS_SCANNED, "dirents_scanned")                                        \
+  X(PATH_COMPONENTS, "path_components")                                        \
+  X(DCACHE_HITS, "dcache_hits")                                                \
+  X(DCACHE_MISSES, "dcache_misses")                                            \
+  X(JOURNAL_BLOCKS, "journal_blocks")                                          \
+  X(WRITEBACK_BLOCKS, "writeback_blocks")                                      \
+  X(CLUSTERS_COMPRESSED, "clusters_compressed")                                \
+  X(CLUSTERS_EXPANDED, "clusters_expanded")                                    \
+  X(DEDUP_BLOCKS, "dedup_blocks")                                              \
+  X(COW_BLOCKS, "cow_blocks")                                                  \
+  X(DEFRAG_BLOCKS, "defrag_blocks")
+
+#define STATS_ENUM(name, label) ST_##name,
+enum { STATS_OP_LIST(STATS_ENUM) ST_OP_COUNT };
+enum { STATS_COUNTER_LIST(STATS_ENUM) ST_COUNTER_COUNT };
+#undef STATS_ENUM
+
+/**
+ * Monotonic clock in nanoseconds.
+ */
+uint64_t stats_now();
+
+/**
+ * Record one op that started at start (from stats_now) and ends now.
+ *
+ * @param op ST_* op.
+ * @param start Value of stats_now() when the op began.
+ */
+void stats_op(int op, uint64_t start);
+
+/**
+ * Add n to a counter.
+ *
+ * @param counter ST_* counter.
+ */
+void stats_add(int counter, uint64_t n);
+
+/**
+ * Format a snapshot of all counters and histograms.
+ *
+ * @param buf Output buffer, may be NULL if cap is 0.
+ * @param cap Size of buf.
+ *
+ * @return The length of the full text, which may exceed cap (as
+ *         snprintf); the text in buf is then cut short.
+ */
+size_t stats_render(char *buf, size_t cap);
+
+// Times the rest of the enclosing block as op, including every return.
+typedef struct stats_timer {
+  int op;
+  uint64_t start;
+} stats_timer_t;
+
+void stats_timer_end(stats_timer_t *timer);
+
+#define STATS_TIME(op)                                                         \
+  stats_timer_t _stats_timer __attribute__((cleanup(stats_timer_end))) = {   \
+      (op), stats_now()}
+
+#endif
@@ -6,24 +6,93 @@
 #include "blocks.h"
 #include "inode.h"
 #include "directory.h"
+#include "compress.h"
+#include "frag.h"
+#include "dcache.h"
+#include "dedup.h"
+#include "defrag.h"
+#include "snapshot.h"
+#include "ilock.h"
+#include "journal.h"
+#include "stats.h"
 #include <sys/stat.h>     
 #include <stdlib.h>      
+#include <pthread.h>
 #include "slist.h"       
 
 
 int path_lookup(const char *path);
 int path_parent(const char *path, char **name_out);
+static int file_write(inode_t *node, const char *buf, size_t size, off_t offset);
+static int file_read(inode_t *node, char *buf, size_t size, off_t offset);
+
+// Open file table: inodes that have live file handles. An inode unlinked
+// while open keeps its blocks until the last handle is released.
+#define OPEN_BUCKETS 1024
+
+typedef struct open_file {
+  int inum;
+  int count;    // number of live handles
+  int unlinked; // free the inode on the last release
+  struct open_file *next;
+} open_file_t;
+
+static open_file_t *open_files[OPEN_BUCKETS];
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER; // guards open_files
+
+// Serializes renames between two different directories; see ilock.h
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// find the open file table entry for inum, or NULL
+static open_file_t *open_file_find(int inum) {
+  for (open_file_t *of = open_files[inum % OPEN_BUCKETS]; of; of = of->next) {
+    if (of->inum == inum) {
+      return of;
+    }
+  }
+  return NULL;
+}
+
+// Get the inode for inum if it is in use (not freed by a racing unlink
+// or rmdir). The caller holds the inode's lock.
+static inode_t *live_inode(int inum) {
+  inode_t *node = get_inode(inum);
+  return node && node->refs > 0 ? node : NULL;
+}
+
+// Resolve the parent directory of path and lock it for writing. On
+// success the caller frees *name_out and unlocks the returned inode.
+static int lock_parent(const char *path, char **name_out) {
+  int parent = path_parent(path, name_out);
+  if (parent < 0) {
+    return parent;
+  }
+  inode_wrlock(parent);
+  inode_t *dir = live_inode(parent);
+  if (!dir || !S_ISDIR(dir->mode)) {
+    // removed after the path was resolved
+    inode_unlock(parent);
+    free(*name_out);
+    return -ENOENT;
+  }
+  return parent;
+}
 
 //Initialize the block from the file at path
 void storage_init(const char *path) {
+  ilock_init();
+  dcache_init();
   blocks_init(path);
+  frag_init();
+  dedup_init();
 
+  journal_start();
   inode_t *root = get_inode(0);
   if (root->refs == 0) {
+    journal_dirty(root);
     root->refs = 1;
     root->mode = 040755;
     root->size = 0;
-    root->direct[0] = alloc_block();
     printf("+ initialized root directory\n");
   }
 
@@ -36,18 +105,60 @@ void storage_init(const char *path) {
     int h_inum = alloc_inode();
     inode_t *h_node = get_inode(h_inum);
 
+    journal_dirty(h_node);
     h_node->refs  = 1;
     h_node->mode  = 0100644;     // regular file, rw-r--r--
-    h_node->size  = 6;           // length of "hello\n"
-    h_node->direct[0] = alloc_block();
+    h_node->size  = 0;
 
     // write the data
-    memcpy(blocks_get_block(h_node->direct[0]), "hello\n", 6);
+    storage_fwrite(h_inum, "hello\n", 6, 0);
 
     // link it into the root directory
     int rv = directory_put(root, "hello.txt", h_inum);
     printf("+ seeded hello.txt (inode %d) → dir put rv=%d\n", h_inum, rv);
   }  
+  snapshot_init();
+  journal_stop();
+  journal_sync();
+}
+
+// Start the journal's commit thread and the writeback thread; threads
+// don't survive the fork FUSE does when it daemonizes, so this runs
+// after it.
+void storage_start() {
+  journal_start_thread();
+  blocks_start_writeback();
+}
+
+// Flush all data, commit everything and close the image.
+void storage_free() {
+  blocks_stop_writeback();
+  journal_shutdown();
+  blocks_free();
+  frag_free_map();
+  dedup_free();
+}
+
+// Make a file's data and all metadata durable. Holds no locks: a thread
+// waiting for a commit must not keep a handle from closing.
+int storage_fsync(int inum, int datasync) {
+  STATS_TIME(ST_STORAGE_FSYNC);
+  // fdatasync needs the size and block map too, and those are committed
+  // with everything else, so it does the same work
+  (void) datasync;
+  int rv = blocks_flush_inode(inum);
+  int jrv = journal_sync();
+  return rv < 0 ? rv : jrv;
+}
+
+// A handle on inum was closed: start writing its data back.
+void storage_flush(int inum) {
+  blocks_expire_inode(inum);
+}
+
+// Commit all metadata, for fsync on a directory.
+int storage_sync_meta() {
+  return journal_sync();
 }
 
 /**
@@ -55,150 +166,985 @@ void storage_init(const char *path) {
  * stat struct st with its inode number, mode, size, and link count
  */
 int storage_stat(const char *path, struct stat *st) {
+  STATS_TIME(ST_STORAGE_STAT);
   int inum = path_lookup(path);
   if (inum < 0) {
     return -ENOENT;
   }
-  inode_t *node = get_inode(inum);
+  return storage_fstat(inum, st);
+}
+
+// Resolve path once and register a file handle for it; returns the inode
+// number to use with the storage_f* calls.
+int storage_open(const char *path) {
+  STATS_TIME(ST_STORAGE_OPEN);
+  int inum = path_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  // holding the inode keeps a racing unlink from freeing it before the
+  // handle is registered
+  inode_rdlock(inum);
+  if (!live_inode(inum)) {
+    inode_unlock(inum);
+    return -ENOENT;
+  }
+  pthread_mutex_lock(&open_lock);
+  open_file_t *of = open_file_find(inum);
+  if (!of) {
+    of = calloc(1, sizeof(open_file_t));
+    of->inum = inum;
+    of->next = open_files[inum % OPEN_BUCKETS];
+    open_files[inum % OPEN_BUCKETS] = of;
+  }
+  of->count++;
+  pthread_mutex_unlock(&open_lock);
+  inode_unlock(inum);
+  return inum;
+}
+
+// Drop a file handle returned by storage_open.
+void storage_release(int inum) {
+  STATS_TIME(ST_STORAGE_RELEASE);
+  pthread_mutex_lock(&open_lock);
+  open_file_t **link = &open_files[inum % OPEN_BUCKETS];
+  while (*link && (*link)->inum != inum) {
+    link = &(*link)->next;
+  }
+  open_file_t *of = *link;
+  if (!of || --of->count > 0) {
+    pthread_mutex_unlock(&open_lock);
+    return;
+  }
+  *link = of->next;
+  pthread_mutex_unlock(&open_lock);
+  if (of->unlinked) {
+    inode_wrlock(inum);
+    journal_start();
+    free_inode(inum);
+    journal_stop();
+    inode_unlock(inum);
+  }
+  free(of);
+}
+
+// Fill in st from inode inum, which the caller has locked.
+static void inode_stat(int inum, inode_t *node, struct stat *st) {
   st->st_ino   = inum;
   st->st_mode  = node->mode;
   st->st_size  = node->size;
   st->st_nlink = node->refs;
-  return 0;
+  st->st_blksize = BLOCK_SIZE;
+  st->st_blocks = (blkcnt_t) node->blocks * (BLOCK_SIZE / 512);
+  if (node->flags & INODE_FRAG) {
+    st->st_blocks += node->frag.units * (FRAG_SIZE / 512);
+  }
+}
+
+// fill in the stat struct st for an inode number
+int storage_fstat(int inum, struct stat *st) {
+  STATS_TIME(ST_STORAGE_FSTAT);
+  inode_rdlock(inum);
+  inode_t *node = live_inode(inum);
+  if (node) {
+    inode_stat(inum, node, st);
+  }
+  inode_unlock(inum);
+  return node ? 0 : -ENOENT;
 }
 
 //Create a new filesystem object at path with the
 // specified mode
 int storage_mknod(const char *path, int mode) {
+  STATS_TIME(ST_STORAGE_MKNOD);
   char *name;
-  int parent = path_parent(path, &name);
+  int parent = lock_parent(path, &name);
   if (parent < 0) {
     return parent;
   }
   inode_t *dir = get_inode(parent);
   if (directory_lookup(dir, name) >= 0) { 
+    inode_unlock(parent);
     free(name); 
     return -EEXIST; 
   }
+  if (dir->flags & INODE_READONLY) {
+    inode_unlock(parent);
+    free(name);
+    return -EROFS;
+  }
 
+  journal_start();
   int inum = alloc_inode();
   if (inum < 0) { 
+    journal_stop();
+    inode_unlock(parent);
     free(name); 
     return -ENOSPC; 
   }
 
+  // not reachable by anyone else until directory_put links it in
   inode_t *node = get_inode(inum);
+  journal_dirty(node);
   node->refs = 1;
   node->mode = mode;
   node->size = 0;
-  for(int i = 0; i < NDIRECT; i++) {
-    node->direct[i] = 0;
-  }
-  node->indirect = 0;
+  node->flags |= dir->flags & INODE_COMPRESS;
 
   int rv = directory_put(dir, name, inum);
+  if (rv < 0) {
+    free_inode(inum);
+  }
+  journal_stop();
+  inode_unlock(parent);
   free(name);
   return rv;
 }
 
 //Write size bytes from buf into the file at path starting at offset
 int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
-  struct stat st;
-  int rv = storage_stat(path, &st);
+  STATS_TIME(ST_STORAGE_WRITE);
+  int inum = path_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  return storage_fwrite(inum, buf, size, offset);
+}
+
+//Write size bytes from buf into the file with inode inum starting at offset
+int storage_fwrite(int inum, const char *buf, size_t size, off_t offset) {
+  STATS_TIME(ST_STORAGE_FWRITE);
+  blocks_unhold();
+  inode_wrlock(inum);
+  journal_start();
+  inode_t *node = live_inode(inum);
+  int rv = node ? file_write(node, buf, size, offset) : -ENOENT;
+  if (rv == -ENOSPC && blocks_frees_pending()) {
+    // blocks the running transaction freed come back once it commits;
+    // reusing them sooner could leave a committed file pointing at this
+    // data. Commit, with no handle open, and try once more (as ext4
+    // does).
+    journal_stop();
+    inode_unlock(inum);
+    journal_sync();
+    inode_wrlock(inum);
+    journal_start();
+    node = live_inode(inum);
+    rv = node ? file_write(node, buf, size, offset) : -ENOENT;
+  }
+  journal_stop();
+  inode_unlock(inum);
+  return rv;
+}
+
+// Ranges of the image one read or write moves, for a single blocks_read
+// or blocks_write call: the engine can have them all in flight at once.
+typedef struct io_batch {
+  blocks_io_t *io;
+  int n, cap;
+} io_batch_t;
+
+static void batch_add(io_batch_t *b, uint32_t bnum, size_t off, size_t len,
+                      void *buf) {
+  if (b->n == b->cap) {
+    b->cap = b->cap ? 2 * b->cap : 8;
+    b->io = realloc(b->io, b->cap * sizeof(blocks_io_t));
+  }
+  blocks_io_t io = {bnum, off, len, buf};
+  b->io[b->n++] = io;
+}
+
+// Mark what a batch wrote dirty, once it is written: a flush meanwhile
+// would miss it.
+static void batch_dirty(io_batch_t *b, int inum) {
+  for (int i = 0; i < b->n; i++) {
+    blocks_mark_dirty(inum, b->io[i].bnum,
+                      bytes_to_blocks(b->io[i].off + b->io[i].len));
+  }
+}
+
+// Write into node; the caller holds its lock for writing.
+static int file_write(inode_t *node, const char *buf, size_t size,
+                      off_t offset) {
+  if (offset < 0) {
+    return -EINVAL;
+  }
+  if (node->flags & INODE_READONLY) {
+    return -EROFS;
+  }
+  int64_t end = offset + (int64_t) size;
+  int rv = inode_prepare_write(node, offset, size);
   if (rv < 0) {
     return rv;
   }
-  inode_t *node = get_inode(st.st_ino);
-
-  // first grow the file to cover [offset, offset+size)
-  rv = grow_inode(node, (offset + size > node->size ? offset + size : node->size));
+  if (rv > 0) {
+    // inline or in a fragment
+    memcpy(inode_small_data(node) + offset, buf, size);
+    if (rv == INODE_FRAG) {
+      blocks_mark_dirty(inode_get_inum(node), node->frag.block, 1);
+    }
+    if (end > node->size) {
+      grow_inode(node, end);
+    }
+    stats_add(ST_BYTES_WRITTEN, size);
+    return size;
+  }
+  // allocate only the blocks [offset, offset+size) covers; a gap left
+  // before offset stays a hole
+  rv = compress_expand(node, offset, size);
+  if (rv == 0) {
+    rv = inode_unshare(node, offset, size);
+  }
+  if (rv == 0) {
+    rv = inode_fill_holes(node, offset, size);
+  }
   if (rv < 0) {
     return rv;
   }
+  // one range per extent: physically contiguous blocks are contiguous
+  // in the image too
+  io_batch_t batch = {NULL, 0, 0};
   size_t written = 0;
   while (written < size) {
-    int file_blk = (offset + written) / BLOCK_SIZE;
-    int blk_off = (offset + written) % BLOCK_SIZE;
-    int chunk = BLOCK_SIZE - blk_off;
+    uint32_t file_blk = (offset + written) / BLOCK_SIZE;
+    size_t blk_off = (offset + written) % BLOCK_SIZE;
+    uint32_t run;
+    uint32_t bnum = extent_lookup(&node->extents, file_blk, &run);
+    size_t chunk = (size_t) run * BLOCK_SIZE - blk_off;
     if (chunk > size - written) {
       chunk = size - written;
     }
-    int bnum = inode_get_bnum(node, file_blk);
-    char *block = blocks_get_block(bnum);
-    memcpy(block + blk_off, buf + written, chunk);
-
+    if (bnum == 0) {
+      free(batch.io);
+      return -EIO; // inode_fill_holes mapped the whole range
+    }
+    batch_add(&batch, bnum, blk_off, chunk, (char *) buf + written);
     written += chunk;
   }
+  rv = blocks_write(batch.io, batch.n);
+  batch_dirty(&batch, inode_get_inum(node));
+  free(batch.io);
+  if (rv < 0) {
+    return rv;
+  }
+  if (end > node->size) {
+    grow_inode(node, end);
+  }
+  dedup_write(node, offset, written);
+  compress_range(node, offset, written);
 
+  stats_add(ST_BYTES_WRITTEN, written);
   return written;
 }
 
 //Read up to size bytes from the file at path into buf starting at offset
 int storage_read(const char *path, char *buf, size_t size, off_t offset) {
-  struct stat st;
-  int rv = storage_stat(path, &st);
-  if (rv < 0) {
-    return rv;
+  STATS_TIME(ST_STORAGE_READ);
+  int inum = path_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
   }
-  inode_t *node = get_inode(st.st_ino);
+  return storage_fread(inum, buf, size, offset);
+}
+
+//Read up to size bytes from the file with inode inum into buf starting at offset
+int storage_fread(int inum, char *buf, size_t size, off_t offset) {
+  STATS_TIME(ST_STORAGE_FREAD);
+  blocks_unhold();
+  inode_rdlock(inum);
+  inode_t *node = live_inode(inum);
+  int rv = node ? file_read(node, buf, size, offset) : -ENOENT;
+  inode_unlock(inum);
+  return rv;
+}
 
+// Read from node; the caller holds its lock.
+static int file_read(inode_t *node, char *buf, size_t size, off_t offset) {
+  if (offset < 0) {
+    return -EINVAL;
+  }
   if (offset >= node->size) {
     return 0;
   }
   size_t to_read = size;
-  if (offset + to_read > node->size) {
+  if ((int64_t) to_read > node->size - offset) {
     to_read = node->size - offset;
   }
+  char *small = inode_small_data(node);
+  if (small) {
+    memcpy(buf, small + offset, to_read);
+    stats_add(ST_BYTES_READ, to_read);
+    return to_read;
+  }
+  // one range per extent, read together at the end; compressed clusters
+  // one at a time
+  char *cluster = NULL;
+  io_batch_t batch = {NULL, 0, 0};
   size_t done = 0;
   while (done < to_read) {
-    int file_blk = (offset + done) / BLOCK_SIZE;
-    int blk_off = (offset + done) % BLOCK_SIZE;
-    int chunk = BLOCK_SIZE - blk_off;
+    uint32_t file_blk = (offset + done) / BLOCK_SIZE;
+    size_t blk_off = (offset + done) % BLOCK_SIZE;
+    uint32_t run;
+    uint16_t flags;
+    uint32_t bnum = extent_lookup_flags(&node->extents, file_blk, &run, &flags);
+    size_t chunk = (size_t) run * BLOCK_SIZE - blk_off;
     if (chunk > to_read - done) {
       chunk = to_read - done;
     }
-    int bnum = inode_get_bnum(node, file_blk);
-    char *block = blocks_get_block(bnum);
-    memcpy(buf + done, block + blk_off, chunk);
+    if (bnum == 0) {
+      memset(buf + done, 0, chunk); // unmapped blocks read as zeros
+    } else if (flags & EXT_COMPRESSED) {
+      if (!cluster) {
+        cluster = malloc(CLUSTER_SIZE);
+      }
+      if (compress_read_cluster(bnum, flags, cluster) < 0) {
+        free(cluster);
+        free(batch.io);
+        return -EIO;
+      }
+      memcpy(buf + done, cluster + (offset + done) % CLUSTER_SIZE, chunk);
+    } else {
+      batch_add(&batch, bnum, blk_off, chunk, buf + done);
+    }
 
     done += chunk;
   }
+  free(cluster);
+  int rv = blocks_read(batch.io, batch.n);
+  free(batch.io);
+  if (rv < 0) {
+    return rv;
+  }
 
+  stats_add(ST_BYTES_READ, done);
   return done;
 }
 
+// Zero the mapped bytes of node in [from, to).
+static void file_zero(inode_t *node, int64_t from, int64_t to) {
+  io_batch_t batch = {NULL, 0, 0};
+  while (from < to) {
+    uint32_t run;
+    uint32_t bnum = extent_lookup(&node->extents, from / BLOCK_SIZE, &run);
+    size_t blk_off = from % BLOCK_SIZE;
+    int64_t chunk = (int64_t) run * BLOCK_SIZE - blk_off;
+    if (chunk > to - from) {
+      chunk = to - from;
+    }
+    if (bnum != 0) {
+      batch_add(&batch, bnum, blk_off, chunk, NULL);
+    }
+    from += chunk;
+  }
+  blocks_write(batch.io, batch.n);
+  batch_dirty(&batch, inode_get_inum(node));
+  free(batch.io);
+}
+
+// Free segments from file_segs along with the copies they own.
+static void free_segs(storage_seg_t *segs, int n) {
+  for (int i = 0; i < n; i++) {
+    if (segs[i].fd < 0) {
+      free(segs[i].mem);
+    }
+  }
+  free(segs);
+}
+
+// Describe [offset, offset+size) of node, which the caller has locked, as
+// one segment per extent or hole, or a single segment pointing into the
+// data of an inline or fragment file. A compressed cluster gets a
+// segment with a malloc'd copy of its decompressed data. Returns the
+// number of segments, or -EIO if a cluster is corrupt.
+static int file_segs(inode_t *node, off_t offset, size_t size,
+                     storage_seg_t **segs_out) {
+  int fd = blocks_get_fd();
+  int n = 0, cap = 4;
+  storage_seg_t *segs = malloc(cap * sizeof(storage_seg_t));
+  char *small = inode_small_data(node);
+  if (small) {
+    segs[0].fd = -1;
+    segs[0].pos = 0;
+    segs[0].mem = small + offset;
+    segs[0].len = size;
+    *segs_out = segs;
+    return 1;
+  }
+  size_t done = 0;
+  while (done < size) {
+    uint32_t file_blk = (offset + done) / BLOCK_SIZE;
+    size_t blk_off = (offset + done) % BLOCK_SIZE;
+    uint32_t run;
+    uint16_t flags;
+    uint32_t bnum = extent_lookup_flags(&node->extents, file_blk, &run, &flags);
+    size_t chunk = (size_t) run * BLOCK_SIZE - blk_off;
+    if (chunk > size - done) {
+      chunk = size - done;
+    }
+    if (n == cap) {
+      cap *= 2;
+      segs = realloc(segs, cap * sizeof(storage_seg_t));
+    }
+    storage_seg_t *sg = &segs[n++];
+    sg->len = chunk;
+    if (bnum == 0) {
+      sg->fd = -1;
+      sg->pos = 0;
+      sg->mem = NULL;
+    } else if (flags & EXT_COMPRESSED) {
+      char *cluster = malloc(CLUSTER_SIZE);
+      if (compress_read_cluster(bnum, flags, cluster) < 0) {
+        free(cluster);
+        free_segs(segs, n - 1);
+        *segs_out = NULL;
+        return -EIO;
+      }
+      sg->fd = -1;
+      sg->pos = 0;
+      sg->mem = malloc(chunk);
+      memcpy(sg->mem, cluster + (offset + done) % CLUSTER_SIZE, chunk);
+      free(cluster);
+    } else {
+      sg->fd = fd;
+      sg->pos = (off_t) bnum * BLOCK_SIZE + blk_off;
+      sg->mem = blocks_data_mapped() ? (char *) blocks_get_block(bnum) + blk_off
+                                     : NULL;
+    }
+    done += chunk;
+  }
+  *segs_out = segs;
+  return n;
+}
+
+// Describe up to size bytes of the file with inode inum from offset as
+// image ranges, for a reader that copies or splices them itself after
+// the lock is dropped. The ranges are held (blocks_hold) until the
+// thread's next read or write, so blocks freed meanwhile are not reused
+// and the reader can't see another file's data. Returns the number of
+// bytes described; the caller frees *segs.
+int storage_fread_segs(int inum, size_t size, off_t offset,
+                       storage_seg_t **segs, int *n) {
+  STATS_TIME(ST_STORAGE_FREAD);
+  // the reply to this thread's last read has gone out
+  blocks_unhold();
+  *segs = NULL;
+  *n = 0;
+  if (offset < 0) {
+    return -EINVAL;
+  }
+  inode_rdlock(inum);
+  inode_t *node = live_inode(inum);
+  int rv = node ? 0 : -ENOENT;
+  if (node && offset < node->size) {
+    if ((int64_t) size > node->size - offset) {
+      size = node->size - offset;
+    }
+    *n = file_segs(node, offset, size, segs);
+    if (*n < 0) {
+      rv = *n;
+      *n = 0;
+    } else if (inode_small_data(node)) {
+      // the inode may change, and the fragment move, once it is
+      // unlocked: hand out a copy
+      void *copy = malloc(size);
+      memcpy(copy, (*segs)[0].mem, size);
+      (*segs)[0].mem = copy;
+    }
+    for (int i = 0; i < *n; i++) {
+      storage_seg_t *sg = &(*segs)[i];
+      if (sg->fd >= 0) {
+        uint32_t first = sg->pos / BLOCK_SIZE;
+        blocks_hold(first, bytes_to_blocks(sg->pos + sg->len) - first);
+      }
+    }
+    if (rv == 0) {
+      rv = size;
+      stats_add(ST_BYTES_READ, size);
+    }
+  }
+  inode_unlock(inum);
+  return rv;
+}
+
+// Get [offset, offset+size) of node ready to be written in place.
+// Returns its layout (see inode_prepare_write) or -errno; for a file in
+// blocks, *holes describes the range as it was before its holes were
+// filled. The caller frees *holes.
+static int segs_prepare(inode_t *node, off_t offset, size_t size,
+                        storage_seg_t **holes, int *nholes) {
+  *holes = NULL;
+  *nholes = 0;
+  if (!node) {
+    return -ENOENT;
+  }
+  if (node->flags & INODE_READONLY) {
+    return -EROFS;
+  }
+  int layout = inode_prepare_write(node, offset, size);
+  if (layout != 0) {
+    return layout;
+  }
+  int rv = compress_expand(node, offset, size);
+  if (rv == 0) {
+    rv = inode_unshare(node, offset, size);
+  }
+  if (rv == 0) {
+    *nholes = file_segs(node, offset, size, holes);
+    rv = inode_fill_holes(node, offset, size);
+  }
+  return rv;
+}
+
+// Write size bytes at offset into the file with inode inum, letting copy
+// fill the image ranges directly (e.g. by splicing from a pipe).
+int storage_fwrite_segs(int inum, size_t size, off_t offset,
+                        storage_copy_t copy, void *arg) {
+  STATS_TIME(ST_STORAGE_FWRITE);
+  blocks_unhold();
+  if (offset < 0) {
+    return -EINVAL;
+  }
+  inode_wrlock(inum);
+  journal_start();
+  inode_t *node = live_inode(inum);
+  storage_seg_t *holes;
+  int nholes;
+  int layout = segs_prepare(node, offset, size, &holes, &nholes);
+  if (layout == -ENOSPC && blocks_frees_pending()) {
+    // as in storage_fwrite; nothing has been copied yet
+    free(holes);
+    journal_stop();
+    inode_unlock(inum);
+    journal_sync();
+    inode_wrlock(inum);
+    journal_start();
+    node = live_inode(inum);
+    layout = segs_prepare(node, offset, size, &holes, &nholes);
+  }
+  int rv = layout < 0 ? layout : 0;
+  if (rv == 0) {
+    storage_seg_t *segs;
+    int n = file_segs(node, offset, size, &segs);
+    ssize_t copied = copy(arg, segs, n);
+    rv = copied;
+    if (copied > 0 && layout == INODE_FRAG) {
+      blocks_mark_dirty(inum, node->frag.block, 1);
+    }
+    size_t left = copied > 0 && layout == 0 ? copied : 0;
+    for (int i = 0; i < n && left > 0; i++) {
+      size_t len = segs[i].len < left ? segs[i].len : left;
+      uint32_t first = segs[i].pos / BLOCK_SIZE;
+      blocks_mark_dirty(inum, first,
+                        bytes_to_blocks(segs[i].pos + len) - first);
+      left -= len;
+    }
+    free(segs);
+    if (copied > 0 && offset + copied > node->size) {
+      grow_inode(node, offset + copied);
+    }
+    if (copied < (ssize_t) size) {
+      // blocks just mapped for the part that wasn't written hold stale
+      // data: zero them, and drop those past the end
+      int64_t from = offset + (copied > 0 ? copied : 0);
+      int64_t at = offset;
+      for (int i = 0; i < nholes; i++) {
+        int64_t end = at + holes[i].len;
+        if (holes[i].fd < 0 && end > from) {
+          file_zero(node, at > from ? at : from, end);
+        }
+        at = end;
+      }
+      shrink_inode(node, node->size);
+    }
+    if (copied > 0 && layout == 0) {
+      dedup_write(node, offset, copied);
+    }
+    if (copied > 0) {
+      compress_range(node, offset, copied);
+      stats_add(ST_BYTES_WRITTEN, copied);
+    }
+  }
+  free(holes);
+  journal_stop();
+  inode_unlock(inum);
+  return rv;
+}
+
 // extend the file at path to exactly size bytes
 int storage_truncate(const char *path, off_t size) {
-  struct stat st;
-  int rv = storage_stat(path, &st);
+  STATS_TIME(ST_STORAGE_TRUNCATE);
+  int inum = path_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  return storage_ftruncate(inum, size);
+}
+
+// extend the file with inode inum to exactly size bytes
+int storage_ftruncate(int inum, off_t size) {
+  STATS_TIME(ST_STORAGE_FTRUNCATE);
+  if (size < 0) {
+    return -EINVAL;
+  }
+  inode_wrlock(inum);
+  journal_start();
+  inode_t *node = live_inode(inum);
+  int rv = !node ? -ENOENT : node->flags & INODE_READONLY ? -EROFS : 0;
+  if (rv == 0 && size < node->size) {
+    rv = shrink_inode(node, size);
+  } else if (rv == 0 && size > node->size) {
+    rv = grow_inode(node, size);
+  }
+  journal_stop();
+  inode_unlock(inum);
+  return rv;
+}
+
+// 1 if the file or directory at path has INODE_COMPRESS, else 0
+int storage_get_compress(const char *path) {
+  int inum = path_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  return storage_fget_compress(inum);
+}
+
+int storage_fget_compress(int inum) {
+  inode_rdlock(inum);
+  inode_t *node = live_inode(inum);
+  int rv = node ? !!(node->flags & INODE_COMPRESS) : -ENOENT;
+  inode_unlock(inum);
+  return rv;
+}
+
+// Turn compression on or off for data written from now on; clusters
+// already written stay as they are until they are rewritten
+int storage_set_compress(const char *path, int on) {
+  int inum = path_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  return storage_fset_compress(inum, on);
+}
+
+int storage_fset_compress(int inum, int on) {
+  inode_wrlock(inum);
+  journal_start();
+  inode_t *node = live_inode(inum);
+  int rv = node ? 0 : -ENOENT;
+  if (node && !S_ISREG(node->mode) && !S_ISDIR(node->mode)) {
+    rv = -EINVAL;
+  } else if (node && node->flags & INODE_READONLY) {
+    rv = -EROFS;
+  } else if (node) {
+    journal_dirty(node);
+    if (on) {
+      node->flags |= INODE_COMPRESS;
+    } else {
+      node->flags &= ~INODE_COMPRESS;
+    }
+  }
+  journal_stop();
+  inode_unlock(inum);
+  return rv;
+}
+
+// Copy [src_off, src_off+len) of src to dst_off in dst through a buffer,
+// for what can't share blocks.
+static int copy_range(inode_t *src, inode_t *dst, int64_t src_off,
+                      int64_t len, int64_t dst_off) {
+  int64_t chunk = len < (1 << 20) ? len : (1 << 20);
+  char *buf = malloc(chunk);
+  int rv = 0;
+  for (int64_t done = 0; rv >= 0 && done < len; done += chunk) {
+    int64_t n = len - done < chunk ? len - done : chunk;
+    rv = file_read(src, buf, n, src_off + done);
+    if (rv >= 0) {
+      // a short read is the end of src
+      memset(buf + rv, 0, n - rv);
+      rv = file_write(dst, buf, n, dst_off + done);
+    }
+    journal_restart();
+  }
+  free(buf);
+  return rv < 0 ? rv : 0;
+}
+
+// Make [dst_off, dst_off+len) of dst share the blocks of
+// [src_off, src_off+len) of src, with both locked (src for reading, dst
+// for writing) and inside a journal handle. Offsets are whole blocks; so
+// is len, unless the range ends at the end of src and reaches the end of
+// dst, when the tail block is shared too.
+static int clone_locked(inode_t *src, inode_t *dst, int64_t src_off,
+                        int64_t len, int64_t dst_off) {
+  if (!S_ISREG(src->mode) || !S_ISREG(dst->mode)) {
+    return -EINVAL;
+  }
+  if (dst->flags & INODE_READONLY) {
+    return -EROFS;
+  }
+  if (src_off < 0 || dst_off < 0 || len < 0 || src_off % BLOCK_SIZE != 0 ||
+      dst_off % BLOCK_SIZE != 0 || src_off > src->size) {
+    return -EINVAL;
+  }
+  if (len == 0) {
+    len = src->size - src_off;
+  }
+  int64_t src_end = src_off + len, dst_end = dst_off + len;
+  if (src_end > src->size ||
+      (len % BLOCK_SIZE != 0 && (src_end != src->size || dst_end < dst->size))) {
+    return -EINVAL;
+  }
+  if (src == dst && src_off < dst_end && dst_off < src_end) {
+    return -EINVAL;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  if (inode_small_data(src) || dst_end <= INODE_FRAG_MAX) {
+    // too little data to have blocks of its own
+    return copy_range(src, dst, src_off, len, dst_off);
+  }
+  uint32_t n = bytes_to_blocks(len);
+  int rv = inode_prepare_write(dst, dst_off, len);
+  if (rv == 0) {
+    // compressed clusters of dst inside the range go whole; ones cut by
+    // its ends can't
+    rv = compress_expand(dst, dst_off, 1);
+  }
+  if (rv == 0) {
+    rv = compress_expand(dst, dst_off + (int64_t) n * BLOCK_SIZE - 1, 1);
+  }
   if (rv < 0) {
     return rv;
   }
+  rv = inode_clone(dst, dst_off / BLOCK_SIZE, src, src_off / BLOCK_SIZE, n);
+  if (rv == -EINVAL) {
+    // it would split a compressed cluster of src
+    return copy_range(src, dst, src_off, len, dst_off);
+  }
+  if (rv == 0 && dst_end > dst->size) {
+    rv = grow_inode(dst, dst_end);
+  }
+  return rv;
+}
+
+// Lock the files of a clone, the lower inode number first; a file cloned
+// into itself is locked once, for writing.
+static void lock_clone(int from, int to) {
+  if (from == to) {
+    inode_wrlock(to);
+  } else if (from < to) {
+    inode_rdlock(from);
+    inode_wrlock(to);
+  } else {
+    inode_wrlock(to);
+    inode_rdlock(from);
+  }
+}
 
-  inode_t *node = get_inode(st.st_ino);
+static void unlock_clone(int from, int to) {
+  if (from != to) {
+    inode_unlock(from);
+  }
+  inode_unlock(to);
+}
 
-  if (size < node->size) {
-    return shrink_inode(node, size);
-  } else if (size > node->size) {
-    return grow_inode(node, size);
+int storage_clone_range(const char *from, const char *to, off_t src_offset,
+                        off_t len, off_t dst_offset) {
+  int dst = path_lookup(to);
+  if (dst < 0) {
+    return -ENOENT;
   }
+  return storage_fclone_range(from, dst, src_offset, len, dst_offset);
+}
 
-  return 0;
+int storage_fclone_range(const char *from, int dst, off_t src_offset,
+                         off_t len, off_t dst_offset) {
+  int src = path_lookup(from);
+  if (src < 0) {
+    return -ENOENT;
+  }
+  lock_clone(src, dst);
+  journal_start();
+  inode_t *s = live_inode(src), *d = live_inode(dst);
+  int rv = s && d ? clone_locked(s, d, src_offset, len, dst_offset) : -ENOENT;
+  journal_stop();
+  unlock_clone(src, dst);
+  return rv;
+}
+
+int storage_clone(const char *from, const char *to) {
+  int dst = path_lookup(to);
+  if (dst < 0) {
+    return -ENOENT;
+  }
+  return storage_fclone(from, dst);
 }
 
-//return a list of the names in the directory at path.
-slist_t *storage_list(const char *path) {
+int storage_fclone(const char *from, int dst) {
+  int src = path_lookup(from);
+  if (src < 0) {
+    return -ENOENT;
+  }
+  if (src == dst) {
+    return 0;
+  }
+  lock_clone(src, dst);
+  journal_start();
+  inode_t *s = live_inode(src), *d = live_inode(dst);
+  int rv = s && d ? 0 : -ENOENT;
+  if (rv == 0 && (!S_ISREG(s->mode) || !S_ISREG(d->mode))) {
+    rv = -EINVAL;
+  } else if (rv == 0 && d->flags & INODE_READONLY) {
+    rv = -EROFS;
+  }
+  if (rv == 0) {
+    // the whole file, tail block included
+    rv = shrink_inode(d, 0);
+  }
+  if (rv == 0) {
+    rv = clone_locked(s, d, 0, 0, 0);
+  }
+  journal_stop();
+  unlock_clone(src, dst);
+  return rv;
+}
+
+int storage_defrag(const char *path, struct nufs_defrag *rep) {
   int inum = path_lookup(path);
   if (inum < 0) {
-    return NULL;
+    return -ENOENT;
   }
-  return directory_list(get_inode(inum));
+  return storage_fdefrag(inum, rep);
+}
+
+int storage_fdefrag(int inum, struct nufs_defrag *rep) {
+  int measure = rep->flags & NUFS_DEFRAG_MEASURE;
+  if (measure) {
+    inode_rdlock(inum);
+  } else {
+    inode_wrlock(inum);
+    journal_start();
+  }
+  inode_t *node = live_inode(inum);
+  int rv = !node                          ? -ENOENT
+           : !S_ISREG(node->mode)         ? -EINVAL
+           : measure                      ? 0
+           : node->flags & INODE_READONLY ? -EROFS
+                                          : 0;
+  if (rv == 0) {
+    defrag_measure(node, &rep->extents_before, &rep->frags_before);
+    rep->moved = 0;
+    if (!measure) {
+      rv = defrag_file(node, &rep->moved);
+    }
+    defrag_measure(node, &rep->extents_after, &rep->frags_after);
+    rep->blocks = node->blocks;
+  }
+  if (!measure) {
+    journal_stop();
+  }
+  inode_unlock(inum);
+  return rv;
+}
+
+typedef struct readdir_ctx {
+  storage_dir_t fn;
+  void *arg;
+} readdir_ctx_t;
+
+static int readdir_entry(void *arg, const char *name, int inum,
+                         uint64_t next) {
+  readdir_ctx_t *ctx = arg;
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  // the entry can't be freed while its directory is locked
+  inode_rdlock(inum);
+  inode_stat(inum, get_inode(inum), &st);
+  inode_unlock(inum);
+  return ctx->fn(ctx->arg, name, &st, next + 2);
+}
+
+// List directory inum, with parent_st for "..".
+static int list_dir(int inum, const struct stat *parent_st, off_t offset,
+                    storage_dir_t fn, void *arg) {
+  inode_rdlock(inum);
+  inode_t *dir = live_inode(inum);
+  int rv = !dir ? -ENOENT : !S_ISDIR(dir->mode) ? -ENOTDIR : 0;
+  if (rv == 0) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    inode_stat(inum, dir, &st);
+    readdir_ctx_t ctx = {fn, arg};
+    if ((offset < 1 && fn(arg, ".", &st, 1)) ||
+        (offset < 2 && fn(arg, "..", parent_st, 2))) {
+      inode_unlock(inum);
+      return 0;
+    }
+    directory_iterate(dir, offset > 2 ? offset - 2 : 0, readdir_entry, &ctx);
+  }
+  inode_unlock(inum);
+  return rv;
+}
+
+// List the directory at path from offset on: "." (offset 0), ".." (1),
+// then its entries, each with a stat filled straight from its inode. fn
+// gets the offset that resumes after an entry and returns nonzero to stop,
+// e.g. when the reply is full. fn runs with the directory locked.
+int storage_readdir(const char *path, off_t offset, storage_dir_t fn,
+                    void *arg) {
+  STATS_TIME(ST_STORAGE_READDIR);
+  int inum = path_lookup(path);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  // stat the parent before locking the directory: it comes first in the
+  // lock order
+  struct stat parent_st;
+  memset(&parent_st, 0, sizeof(parent_st));
+  if (offset < 2) {
+    char *name;
+    int parent = path_parent(path, &name);
+    if (parent >= 0) {
+      free(name);
+    } else {
+      parent = inum; // the root is its own parent
+    }
+    storage_fstat(parent, &parent_st);
+  }
+  return list_dir(inum, &parent_st, offset, fn, arg);
+}
+
+// Directories don't record their parent, so ".." only gets its type.
+int storage_freaddir(int inum, off_t offset, storage_dir_t fn, void *arg) {
+  STATS_TIME(ST_STORAGE_READDIR);
+  struct stat parent_st;
+  memset(&parent_st, 0, sizeof(parent_st));
+  parent_st.st_mode = S_IFDIR;
+  return list_dir(inum, &parent_st, offset, fn, arg);
 }
 
 
 // unlink from directory and free its inode and block
+// Free an inode that has lost its name, or leave that to storage_release
+// while the file is open. Call with it locked, inside a journal handle.
+static void release_inode(int inum) {
+  pthread_mutex_lock(&open_lock);
+  open_file_t *of = open_file_find(inum);
+  if (of) {
+    // still open: storage_release frees it
+    of->unlinked = 1;
+  }
+  pthread_mutex_unlock(&open_lock);
+  if (!of) {
+    free_inode(inum);
+  }
+}
+
 int storage_unlink(const char *path) {
-  char *name;  int parent = path_parent(path,&name);
+  STATS_TIME(ST_STORAGE_UNLINK);
+  char *name;  int parent = lock_parent(path,&name);
   if (parent<0) {
     return parent;
   }
@@ -206,95 +1152,197 @@ int storage_unlink(const char *path) {
 
   int inum = directory_lookup(dir,name);
   if (inum<0) {
+     inode_unlock(parent);
      free(name); 
      return -ENOENT; 
     }
 
+  if (dir->flags & INODE_READONLY) {
+    inode_unlock(parent);
+    free(name);
+    return -EROFS;
+  }
+
+  inode_wrlock(inum);
+  journal_start();
   directory_delete(dir,name);
-  free_inode(inum);
+  release_inode(inum);
+  journal_stop();
+  inode_unlock(inum);
+  inode_unlock(parent);
   free(name);
   return 0;
 }
 
-// Rename a file at the root directory
-int storage_rename(const char *from, const char *to) {
-  char *oldname, *newname;
-  int p1 = path_parent(from, &oldname);
-  int p2 = path_parent(to,   &newname);
-  if (p1<0||p2<0) {
-    return -EINVAL;
+// Length of the parent directory part of path: the index of its last
+// slash, ignoring trailing ones (0 for entries in the root)
+static int parent_len(const char *path) {
+  int end = strlen(path);
+  while (end > 0 && path[end - 1] == '/') {
+    end--;
+  }
+  while (end > 0 && path[end - 1] != '/') {
+    end--;
   }
+  return end > 0 ? end - 1 : 0;
+}
 
-  inode_t *d1 = get_inode(p1), *d2 = get_inode(p2);
+// Is path inside the directory named by the first len bytes of dir?
+static int path_within(const char *dir, int len, const char *path) {
+  return len == 0 || (strncmp(dir, path, len) == 0 && path[len] == '/');
+}
+
+// Move an entry between two directories, both locked for writing
+static int rename_locked(int p1, const char *oldname, int p2,
+                         const char *newname) {
+  inode_t *d1 = live_inode(p1), *d2 = live_inode(p2);
+  if (!d1 || !d2 || !S_ISDIR(d1->mode) || !S_ISDIR(d2->mode)) {
+    return -ENOENT;
+  }
   int inum = directory_lookup(d1, oldname);
   if (inum<0) { 
-    free(oldname); free(newname); 
     return -ENOENT; 
   }
   if (directory_lookup(d2,newname)>=0) {
-     free(oldname); free(newname); 
      return -EEXIST; 
     }
+  if ((d1->flags | d2->flags | get_inode(inum)->flags) & INODE_READONLY) {
+    return -EROFS;
+  }
 
-  directory_put(d2, newname, inum);
+  // put and delete keep the dentry cache exact; entries cached under a
+  // renamed directory stay valid since they are keyed by its inode number
+  int rv = directory_put(d2, newname, inum);
+  if (rv < 0) {
+    return rv;
+  }
   directory_delete(d1, oldname);
-
-  free(oldname); free(newname);
   return 0;
 }
 
-// walk through the filesystem tree for path and return its inode number
-int path_lookup(const char *path) {
-  if (strcmp(path, "/")==0) {
-    return 0;
+// Rename a file at the root directory
+int storage_rename(const char *from, const char *to) {
+  STATS_TIME(ST_STORAGE_RENAME);
+  // moving a directory below itself would cut it off from the tree
+  if (path_within(from, strlen(from), to)) {
+    return -EINVAL;
+  }
+
+  // Only renames move directories. Holding rename_lock across a move
+  // between directories keeps the tree's shape fixed, so the paths tell
+  // which parent is the ancestor and must be locked first.
+  int l1 = parent_len(from), l2 = parent_len(to);
+  int same_dir = l1 == l2 && strncmp(from, to, l1) == 0;
+  if (!same_dir) {
+    pthread_mutex_lock(&rename_lock);
   }
-  slist_t *parts = s_explode(path+1, '/');  // skip leading slash
-  int inum = 0;                              // start at root
-  for (slist_t *p = parts; p; p = p->next) {
+
+  char *oldname = NULL, *newname = NULL;
+  int p1 = path_parent(from, &oldname);
+  int p2 = p1 < 0 ? p1 : path_parent(to, &newname);
+  int rv = p2 < 0 ? p2 : 0;
+  if (rv == 0) {
+    int first = p1, second = p2;
+    if (path_within(to, l2, from) ||
+        (!path_within(from, l1, to) && p2 < p1)) {
+      first = p2;
+      second = p1;
+    }
+    inode_wrlock(first);
+    if (second != first) {
+      inode_wrlock(second);
+    }
+    journal_start();
+    rv = rename_locked(p1, oldname, p2, newname);
+    journal_stop();
+    if (second != first) {
+      inode_unlock(second);
+    }
+    inode_unlock(first);
+  }
+
+  if (!same_dir) {
+    pthread_mutex_unlock(&rename_lock);
+  }
+  free(oldname); free(newname);
+  return rv;
+}
+
+// walk the first len bytes of path from the root and return the inode
+// number it names. Components are resolved through the dentry cache and
+// only fall back to a directory scan on a miss; nothing is allocated.
+static int path_walk(const char *path, int len) {
+  int inum = 0; // start at root
+  int i = 0;
+  while (i < len) {
+    while (i < len && path[i] == '/') {
+      i++;
+    }
+    if (i >= len) {
+      break;
+    }
+    int start = i;
+    while (i < len && path[i] != '/') {
+      i++;
+    }
+    if (i - start >= DIR_NAME_LENGTH) {
+      return -ENOENT;
+    }
+    char name[DIR_NAME_LENGTH];
+    memcpy(name, path + start, i - start);
+    name[i - start] = '\0';
+
     inode_t *dir = get_inode(inum);
-    inum = directory_lookup(dir, p->data);
-    if (inum < 0) { 
-      s_free(parts); 
+    if (!S_ISDIR(dir->mode)) {
+      return -ENOTDIR;
+    }
+    int child;
+    stats_add(ST_PATH_COMPONENTS, 1);
+    if (dcache_lookup(inum, name, &child)) {
+      stats_add(ST_DCACHE_HITS, 1);
+    } else {
+      stats_add(ST_DCACHE_MISSES, 1);
+      // fill the cache under the directory's lock, so the result can't
+      // overwrite what a concurrent change to the directory recorded
+      inode_rdlock(inum);
+      child = directory_lookup(dir, name);
+      dcache_insert(inum, name, child);
+      inode_unlock(inum);
+    }
+    if (child < 0) {
       return -ENOENT;
     }
+    inum = child;
   }
-  s_free(parts);
   return inum;
 }
 
+// walk through the filesystem tree for path and return its inode number
+int path_lookup(const char *path) {
+  return path_walk(path, strlen(path));
+}
+
 //gets the parent of a path
 // “/a/b/c” → returns parent inode (inum of /a/b) and malloc()’s *name
 int path_parent(const char *path, char **name_out) {
-  // explode components
-  slist_t *parts = s_explode(path+1, '/');
-  if (!parts) {
+  // ignore trailing slashes, then split at the last one
+  int end = strlen(path);
+  while (end > 0 && path[end - 1] == '/') {
+    end--;
+  }
+  if (end == 0) {
     return -EINVAL;
   }
-
-  // find last
-  slist_t *last = parts, *prev = NULL;
-  while (last->next) { 
-    prev = last; last=last->next; 
+  int slash = end - 1;
+  while (slash >= 0 && path[slash] != '/') {
+    slash--;
   }
-  *name_out = strdup(last->data);
 
-  // detach tail
-  if (prev) {
-    prev->next = NULL;
-  }
-  // rebuild parent path
-  int parent_inum;
-  if (!prev) {
-    parent_inum = 0;
-  } else {
-    char buf[256] = "/";
-    for (slist_t *p=parts; p; p=p->next) {
-      strcat(buf, p->data);
-      if (p->next) strcat(buf, "/");
-    }
-    parent_inum = path_lookup(buf);
+  int parent_inum = path_walk(path, slash < 0 ? 0 : slash);
+  if (parent_inum < 0) {
+    return parent_inum;
   }
-  s_free(parts);
+  *name_out = strndup(path + slash + 1, end - slash - 1);
   return parent_inum;
 }
 
@@ -302,39 +1350,92 @@ int path_parent(const char *path, char **name_out) {
 
 // Make a new directory at path
 int storage_mkdir(const char *path, mode_t mode) {
+  STATS_TIME(ST_STORAGE_MKDIR);
   char *name;
-  int parent = path_parent(path, &name);
+  int parent = lock_parent(path, &name);
   if (parent < 0) {
     return parent;
   }
 
   inode_t *dir = get_inode(parent);
   if (directory_lookup(dir, name) >= 0) {
+     inode_unlock(parent);
      free(name); 
      return -EEXIST; 
     }
+  if (dir->flags & INODE_READONLY) {
+    int rv = -EROFS;
+    if (parent == snapshot_dir()) {
+      // every other change waits until the copy is complete
+      journal_freeze();
+      journal_start();
+      rv = snapshot_take(name);
+      journal_stop();
+      journal_thaw();
+    }
+    inode_unlock(parent);
+    free(name);
+    return rv;
+  }
 
+  journal_start();
   int inum = alloc_inode();
   if (inum < 0) {
+     journal_stop();
+     inode_unlock(parent);
      free(name); 
      return -ENOSPC; 
     }
 
   inode_t *node = get_inode(inum);
+  journal_dirty(node);
   node->refs  = 1;
   node->mode  = mode | S_IFDIR;   // mark as directory
-  node->size  = 0;
-  node->direct[0] = alloc_block();    // allocate a block for its entries
+  node->size  = 0; // the first entry maps a block for the entries
+  node->flags |= dir->flags & INODE_COMPRESS;
 
   int rv = directory_put(dir, name, inum);
+  if (rv < 0) {
+    free_inode(inum);
+  }
+  journal_stop();
+  inode_unlock(parent);
   free(name);
   return rv;
 }
 
 // delete a directory
+static void remove_tree(int inum);
+
+static int remove_entry(void *arg, const char *name, int inum, uint64_t next) {
+  (void) arg;
+  (void) name;
+  (void) next;
+  remove_tree(inum);
+  return 0;
+}
+
+// Free a snapshot taken out of /.snapshots, a directory before what is in
+// it. Lookups that found a piece of it before it went may still be using
+// it, hence the locks; each inode is freed in a handle of its own.
+static void remove_tree(int inum) {
+  inode_wrlock(inum);
+  inode_t *node = get_inode(inum);
+  if (S_ISDIR(node->mode)) {
+    // read-only, so the entries can't change under the walk
+    directory_iterate(node, 0, remove_entry, NULL);
+    dcache_purge_dir(inum);
+  }
+  journal_start();
+  release_inode(inum);
+  journal_stop();
+  inode_unlock(inum);
+}
+
 int storage_rmdir(const char *path) {
+  STATS_TIME(ST_STORAGE_RMDIR);
   char *name;
-  int parent = path_parent(path, &name);
+  int parent = lock_parent(path, &name);
   if (parent < 0) {
     return parent;
   }
@@ -342,17 +1443,44 @@ int storage_rmdir(const char *path) {
   inode_t *dir = get_inode(parent);
   int inum = directory_lookup(dir, name);
   if (inum < 0) { 
+    inode_unlock(parent);
     free(name); 
     return -ENOENT; 
   }
 
+  if (parent == snapshot_dir()) {
+    // a snapshot goes whole, once nothing can find it any more
+    journal_start();
+    directory_delete(dir, name);
+    journal_stop();
+    remove_tree(inum);
+    inode_unlock(parent);
+    free(name);
+    return 0;
+  }
+
+  inode_wrlock(inum);
   inode_t *node = get_inode(inum);
   if (!S_ISDIR(node->mode))  {
+     inode_unlock(inum);
+     inode_unlock(parent);
      free(name); 
      return -ENOTDIR; 
     }
+  if ((dir->flags | node->flags) & INODE_READONLY) {
+    inode_unlock(inum);
+    inode_unlock(parent);
+    free(name);
+    return -EROFS;
+  }
+  journal_start();
   directory_delete(dir, name);
+  // the inode number may be reused, so forget what was cached under it
+  dcache_purge_dir(inum);
   free_inode(inum);
+  journal_stop();
+  inode_unlock(inum);
+  inode_unlock(parent);
   free(name);
   return 0;
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 #ifndef NUFS_STORAGE_H
 #define NUFS_STORAGE_H
 
+#include <stdint.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
@@ -12,9 +14,40 @@
 #include "slist.h"
 
 void storage_init(const char *path);
+void storage_start();
+void storage_free();
 int storage_stat(const char *path, struct stat *st);
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
+// File-handle variants: storage_open resolves the path once and returns an
+// inode number that the storage_f* calls use without touching the path.
+int storage_open(const char *path);
+void storage_release(int inum);
+int storage_fstat(int inum, struct stat *st);
+int storage_fread(int inum, char *buf, size_t size, off_t offset);
+int storage_fwrite(int inum, const char *buf, size_t size, off_t offset);
+int storage_ftruncate(int inum, off_t size);
+// Zero-copy variants: a file's contents as ranges of the image. A segment
+// is len bytes at pos in fd, also mapped at mem if the engine maps file
+// data (mem is NULL if not); fd is -1 and mem NULL for a hole, which
+// reads as zeros. The data of an inline or fragment
+// file, or of a compressed cluster, is a segment with fd -1 and mem set
+// (a malloc'd copy when reading).
+typedef struct storage_seg {
+  int fd;
+  off_t pos;
+  void *mem;
+  size_t len;
+} storage_seg_t;
+// Fills the segments passed to it, returning bytes copied or -errno
+typedef ssize_t (*storage_copy_t)(void *arg, const storage_seg_t *segs, int n);
+int storage_fread_segs(int inum, size_t size, off_t offset,
+                       storage_seg_t **segs, int *n);
+int storage_fwrite_segs(int inum, size_t size, off_t offset,
+                        storage_copy_t copy, void *arg);
+int storage_fsync(int inum, int datasync);
+void storage_flush(int inum);
+int storage_sync_meta();
 int storage_mkdir(const char *path, mode_t mode);
 int storage_rmdir(const char *path);
 int storage_truncate(const char *path, off_t size);
@@ -23,6 +56,50 @@ int storage_unlink(const char *path);
 int storage_link(const char *from, const char *to);
 int storage_rename(const char *from, const char *to);
 int storage_set_time(const char *path, const struct timespec ts[2]);
-slist_t *storage_list(const char *path);
+// Whether data written to a file, or to what is created in a directory,
+// is compressed (chattr +c)
+int storage_get_compress(const char *path);
+int storage_set_compress(const char *path, int on);
+int storage_fget_compress(int inum);
+int storage_fset_compress(int inum, int on);
+// Reflinks: make a file (or a block-aligned range of it) share the data of
+// another, until either side writes it. A length of 0 means to the end of
+// from. Through the filesystem these are ioctls on the destination, which
+// name the source by its path in the filesystem (see nufs-clone); the
+// storage_f* forms take the destination's handle.
+int storage_clone(const char *from, const char *to);
+int storage_clone_range(const char *from, const char *to, off_t src_offset,
+                        off_t len, off_t dst_offset);
+int storage_fclone(const char *from, int to);
+int storage_fclone_range(const char *from, int to, off_t src_offset,
+                         off_t len, off_t dst_offset);
+#define NUFS_CLONE_PATH_MAX 1024
+struct nufs_clone {
+  char src[NUFS_CLONE_PATH_MAX]; // from the root of the filesystem
+  uint64_t src_offset;           // NUFS_IOC_CLONE_RANGE only
+  uint64_t src_length;
+  uint64_t dest_offset;
+};
+#define NUFS_IOC_CLONE _IOW('N', 1, struct nufs_clone)
+#define NUFS_IOC_CLONE_RANGE _IOW('N', 2, struct nufs_clone)
+// Defragmentation (defrag.h): how fragmented a regular file is before and
+// after moving its blocks into contiguous runs. Also an ioctl on the file.
+#define NUFS_DEFRAG_MEASURE 0x1 // only measure, move nothing
+struct nufs_defrag {
+  uint32_t flags;   // in
+  uint32_t blocks;  // data blocks the file has
+  uint32_t extents_before, frags_before;
+  uint32_t extents_after, frags_after;
+  uint32_t moved;   // blocks moved
+};
+int storage_defrag(const char *path, struct nufs_defrag *rep);
+int storage_fdefrag(int inum, struct nufs_defrag *rep);
+#define NUFS_IOC_DEFRAG _IOWR('N', 3, struct nufs_defrag)
+// Called by storage_readdir for each entry; nonzero stops the listing
+typedef int (*storage_dir_t)(void *arg, const char *name,
+                             const struct stat *st, off_t next);
+int storage_readdir(const char *path, off_t offset, storage_dir_t fn,
+                    void *arg);
+int storage_freaddir(int inum, off_t offset, storage_dir_t fn, void *arg);
 
 #endif
\ No newline at end of file
@@ -2,7 +2,7 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 48;
 use IO::Handle;
 
 sub mount {
@@ -171,4 +171,104 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "#           == ioctl Tests ==";
+
+say "# Compression (chattr +c)";
+
+mkdir("mnt/packed");
+system("chattr +c mnt/packed");
+ok(`lsattr -d mnt/packed` =~ /^\S*c\S*\s/, "Directory marked compressed");
+my $text = "a" x (1 << 18);
+write_text("packed/a.txt", $text);
+ok(`lsattr mnt/packed/a.txt` =~ /^\S*c\S*\s/, "New file inherits the flag");
+my @st = stat("mnt/packed/a.txt");
+say "# Size: $st[7], blocks: $st[12]";
+ok($st[12] * 512 < $st[7] / 2, "Compressed file takes fewer blocks");
+ok(read_text("packed/a.txt") eq $text, "Read back compressed data");
+
+say "# Reflinks (nufs-clone)";
+
+my $orig = "0123456789abcdef" x 8192; # 32 blocks
+write_text("orig.txt", $orig);
+system("./nufs-clone mnt/orig.txt mnt/copy.txt");
+ok(read_text("copy.txt") eq $orig, "Clone has the same data");
+write_text("orig.txt", "changed");
+ok(read_text("copy.txt") eq $orig, "Clone keeps its data after the source changes");
+system("./nufs-clone mnt/copy.txt mnt/part.txt 4096 8192 0");
+ok(read_text("part.txt") eq substr($orig, 4096, 8192), "Clone a block range");
+
+say "# Defragmenting (nufs-defrag)";
+
+# two files written a block at a time, in turn, end up interleaved
+open my $fa, ">", "mnt/frag_a.txt";
+open my $fb, ">", "mnt/frag_b.txt";
+for (1 .. 16) {
+    print $fa "a" x 4095, "\n";
+    print $fb "b" x 4095, "\n";
+    $fa->flush;
+    $fb->flush;
+}
+close $fa;
+close $fb;
+my $report = `./nufs-defrag mnt/frag_a.txt`;
+print map { "# $_\n" } split /\n/, $report;
+ok($? == 0 && $report =~ /^1 files with blocks/m &&
+   $report =~ /fragmented -> 0,/, "Defragment a file into one run");
+ok(read_text("frag_a.txt") eq join("\n", ("a" x 4095) x 16),
+   "Read back defragmented data");
+
+say "# Tracing (nufs-trace -l)";
+
+system("rm -f nufs.trace");
+ok((system("./nufs-trace -l 1 mnt") == 0 and -f "nufs.trace"),
+   "Turn tracing on while mounted");
+read_text("frag_b.txt");
+system("./nufs-trace -l 0 mnt");
+ok(`./nufs-trace nufs.trace` =~ /\bOPEN\b/, "Trace records opens");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "#           == Snapshots ==";
+
+write_text("snap.txt", "before");
+ok((mkdir("mnt/.snapshots/s1") and -d "mnt/.snapshots/s1"), "Take a snapshot");
+write_text("snap.txt", "after");
+ok((read_text(".snapshots/s1/snap.txt") eq "before" and
+    read_text("snap.txt") eq "after"),
+   "Snapshot keeps its data after the original changes");
+my $sfh;
+my $append = open($sfh, ">>", "mnt/.snapshots/s1/snap.txt") &&
+             !defined(syswrite($sfh, "more")) && $!{EROFS};
+$sfh and close($sfh);
+my $create = !open($sfh, ">", "mnt/.snapshots/s1/new.txt") && $!{EROFS};
+ok(($append and $create), "Writing into a snapshot fails with EROFS");
+ok((rmdir("mnt/.snapshots/s1") and !-e "mnt/.snapshots/s1"), "Remove a snapshot");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+system("truncate -s 2G data.nufs");
+
+mount();
+
+say "# Cloning a large file";
+
+# long extents share thousands of refcounts each, more than one journal
+# transaction step can hold
+system("dd if=/dev/zero of=mnt/huge.bin bs=1M count=600 status=none");
+system("./nufs-clone mnt/huge.bin mnt/huge-copy.bin");
+ok($? == 0 && -s "mnt/huge-copy.bin" == 600 << 20, "Clone a 600MB file");
+ok(system("cmp -s mnt/huge.bin mnt/huge-copy.bin") == 0,
+   "Large clone has the same data");
+
 unmount()
\ No newline at end of file
@@ -0,0 +1,181 @@
+/**
+ * Binary trace of filesystem operations.
+ *
+ * The trace file is a trace_hdr_t followed by TRACE_MAX_RINGS rings. A
+ * thread claims a ring the first time it records something and gives it
+ * back when it exits; only the owner writes a ring, so appending needs no
+ * lock, just a release store of the new head for readers of a live file.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "trace.h"
+
+int trace_level = 0;
+
+static trace_hdr_t *trace_map; // NULL until the trace file exists
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key; // destructor hands rings back
+static int trace_free[TRACE_MAX_RINGS]; // rings released by exited threads
+static int trace_nfree;
+
+static __thread trace_ring_t *trace_my_ring;
+static __thread int trace_no_ring; // all rings taken; stop asking
+
+static uint64_t trace_now() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint64_t timespec_ns(struct timespec *ts) {
+  return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+// Measure how fast trace_now ticks.
+static uint64_t trace_calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+  struct timespec a, b, pause = {0, 20 * 1000 * 1000};
+  clock_gettime(CLOCK_MONOTONIC, &a);
+  uint64_t t0 = __rdtsc();
+  nanosleep(&pause, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &b);
+  uint64_t t1 = __rdtsc();
+  return (t1 - t0) * 1000000000 / (timespec_ns(&b) - timespec_ns(&a));
+#else
+  return 1000000000;
+#endif
+}
+
+static trace_ring_t *trace_ring(int i) {
+  return (trace_ring_t *) (trace_map + 1) + i;
+}
+
+// Thread exit: hand the ring back. Its records stay in the file.
+static void trace_release_ring(void *arg) {
+  trace_ring_t *ring = arg;
+  pthread_mutex_lock(&trace_lock);
+  trace_free[trace_nfree++] = ring - trace_ring(0);
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// Create and map the trace file. Called with trace_lock held.
+static int trace_open(int level) {
+  const char *path = getenv("NUFS_TRACE_FILE");
+  if (!path) {
+    path = "nufs.trace";
+  }
+  size_t len = sizeof(trace_hdr_t) + TRACE_MAX_RINGS * sizeof(trace_ring_t);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -errno;
+  }
+  if (ftruncate(fd, len) < 0) {
+    close(fd);
+    return -errno;
+  }
+  void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -errno;
+  }
+
+  trace_hdr_t *hdr = map;
+  hdr->magic = TRACE_MAGIC;
+  hdr->version = TRACE_VERSION;
+  hdr->rec_size = sizeof(trace_rec_t);
+  hdr->ring_recs = TRACE_RING_RECS;
+  hdr->max_rings = TRACE_MAX_RINGS;
+  hdr->nrings = 0;
+  hdr->tsc_hz = trace_calibrate();
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  hdr->start_tsc = trace_now();
+  hdr->start_ns = timespec_ns(&now);
+
+  pthread_key_create(&trace_key, trace_release_ring);
+  trace_map = hdr;
+  printf("+ tracing at level %d to %s\n", level, path);
+  return 0;
+}
+
+// Read the trace settings from the environment.
+void trace_init() {
+  const char *level = getenv("NUFS_TRACE");
+  if (level && atoi(level) > 0) {
+    int rv = trace_set_level(atoi(level));
+    if (rv < 0) {
+      fprintf(stderr, "nufs: can't create trace file: %s\n", strerror(-rv));
+    }
+  }
+}
+
+// Change the trace level, at mount or from NUFS_IOC_TRACE. The file is
+// mapped before the level is published, so a thread that sees the level
+// finds the rings.
+int trace_set_level(int level) {
+  int rv = 0;
+  pthread_mutex_lock(&trace_lock);
+  if (level > 0 && !trace_map) {
+    rv = trace_open(level);
+  }
+  if (rv == 0) {
+    __atomic_store_n(&trace_level, level, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&trace_lock);
+  return rv;
+}
+
+// Give the calling thread a ring, or NULL if none is left.
+static trace_ring_t *trace_claim() {
+  pthread_mutex_lock(&trace_lock);
+  trace_ring_t *ring = NULL;
+  if (trace_nfree > 0) {
+    ring = trace_ring(trace_free[--trace_nfree]);
+  } else if (trace_map && trace_map->nrings < TRACE_MAX_RINGS) {
+    ring = trace_ring(trace_map->nrings++);
+  }
+  if (ring) {
+    ring->tid = syscall(SYS_gettid);
+    pthread_setspecific(trace_key, ring);
+  }
+  pthread_mutex_unlock(&trace_lock);
+  return ring;
+}
+
+// Append a record to the calling thread's ring.
+void trace_rec(int op, int inum, int64_t offset, uint32_t size, int rv) {
+  trace_ring_t *ring = trace_my_ring;
+  if (!ring) {
+    if (trace_no_ring || !(ring = trace_claim())) {
+      trace_no_ring = 1;
+      return;
+    }
+    trace_my_ring = ring;
+  }
+  uint64_t head = ring->head;
+  trace_rec_t *r = &ring->recs[head % TRACE_RING_RECS];
+  r->tsc = trace_now();
+  r->offset = offset;
+  r->size = size;
+  r->inum = inum;
+  r->rv = rv;
+  r->op = op;
+  r->_reserved = 0;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
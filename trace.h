@@ -0,0 +1,116 @@
+/**
+ * Binary trace of filesystem operations.
+ *
+ * Each thread appends fixed-size records to its own ring buffer, with no
+ * locks and no formatting on the hot path. The rings live in a shared
+ * mapping of a trace file, so the records survive the process and
+ * nufs-trace can decode them offline, even after a crash.
+ *
+ * Tracing is off unless NUFS_TRACE is set to a level when mounting, or
+ * the level is changed while mounted with the NUFS_IOC_TRACE ioctl
+ * (nufs-trace -l):
+ *   1  FUSE operations
+ *   2  also block allocation and freeing
+ * NUFS_TRACE_FILE names the trace file (default nufs.trace), which is
+ * created the first time tracing is turned on. A disabled trace point
+ * costs one predictable branch.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define TRACE_MAGIC 0x4352544e // "NTRC"
+#define TRACE_VERSION 1
+#define TRACE_MAX_RINGS 64
+#define TRACE_RING_RECS 16384 // per ring; a power of two
+
+// Trace levels
+#define TRACE_OPS 1
+#define TRACE_ALLOC 2
+
+// Set the level of a mounted nufs: an ioctl on any file or directory in
+// it, taking the level as an int. 0 stops tracing.
+#define NUFS_IOC_TRACE _IOW('N', 4, int)
+
+// Record types. X(name) expands once per op, so the enum and the names
+// the dump tool prints can't drift apart.
+#define TRACE_OP_LIST(X)                                                       \
+  X(ACCESS) X(GETATTR) X(READDIR) X(MKNOD) X(CREATE) X(MKDIR) X(UNLINK)        \
+  X(LINK) X(RMDIR) X(RENAME) X(CHMOD) X(TRUNCATE) X(OPEN) X(RELEASE) X(READ)   \
+  X(WRITE) X(FTRUNCATE) X(FGETATTR) X(IOCTL) X(ALLOC) X(FREE) X(COMMIT)       \
+  X(FLUSH) X(FSYNC) X(FSYNCDIR) X(WRITEBACK) X(OPENDIR) X(RELEASEDIR)
+
+#define TRACE_OP_ENUM(name) TR_##name,
+enum { TRACE_OP_LIST(TRACE_OP_ENUM) TR_OP_COUNT };
+#undef TRACE_OP_ENUM
+
+typedef struct trace_rec {
+  uint64_t tsc;    // timestamp counter when the op finished
+  int64_t offset;  // file offset; first block for ALLOC/FREE; tid for COMMIT
+  uint32_t size;   // bytes; blocks for ALLOC/FREE/COMMIT/WRITEBACK
+  int32_t inum;    // inode number, -1 if not known
+  int32_t rv;      // return value; for ALLOC the blocks asked for, or -1
+  uint16_t op;     // TR_*
+  uint16_t _reserved;
+} trace_rec_t;
+
+_Static_assert(sizeof(trace_rec_t) == 32, "trace_rec_t must be 32 bytes");
+
+// Start of the trace file
+typedef struct trace_hdr {
+  uint32_t magic;     // TRACE_MAGIC
+  uint32_t version;   // TRACE_VERSION
+  uint32_t rec_size;  // sizeof(trace_rec_t)
+  uint32_t ring_recs; // TRACE_RING_RECS
+  uint32_t max_rings; // TRACE_MAX_RINGS
+  uint32_t nrings;    // rings handed out so far
+  uint64_t tsc_hz;    // timestamp counter ticks per second
+  uint64_t start_tsc; // counter value at start_ns
+  uint64_t start_ns;  // wall clock (CLOCK_REALTIME) when tracing started
+  char _reserved[16];
+} trace_hdr_t;
+
+// One thread's records. head counts every record ever written; the
+// newest is at (head - 1) % TRACE_RING_RECS.
+typedef struct trace_ring {
+  uint64_t head;
+  uint32_t tid; // thread that last owned the ring
+  char _reserved[52];
+  trace_rec_t recs[TRACE_RING_RECS];
+} trace_ring_t;
+
+// Current level; 0 disables tracing
+extern int trace_level;
+
+/**
+ * Read NUFS_TRACE and NUFS_TRACE_FILE and, if tracing is on, create the
+ * trace file. Call before any other thread starts.
+ */
+void trace_init();
+
+/**
+ * Change the trace level at run time, creating the trace file if needed.
+ * Called from trace_init and for NUFS_IOC_TRACE. If the file can't be
+ * created the level stays as it was.
+ *
+ * @return 0 on success or a negative error.
+ */
+int trace_set_level(int level);
+
+/**
+ * Append a record to the calling thread's ring. Use TRACE instead.
+ */
+void trace_rec(int op, int inum, int64_t offset, uint32_t size, int rv);
+
+// Record an op if tracing at lvl or above
+#define TRACE(lvl, op, inum, offset, size, rv)                                 \
+  do {                                                                         \
+    if (__builtin_expect(__atomic_load_n(&trace_level, __ATOMIC_RELAXED) >=    \
+                         (lvl), 0)) {                                          \
+      trace_rec((op), (inum), (offset), (size), (rv));                         \
+    }                                                                          \
+  } while (0)
+
+#endif
@@ -0,0 +1,416 @@
+// uring.c: the io_uring engine, on raw system calls
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#undef BLOCK_SIZE // linux/fs.h's, by way of linux/io_uring.h
+
+#include "backend.h"
+#include "blocks.h"
+
+#define UR_ENTRIES 64            // requests in flight per batch
+#define UR_BUFS 8                // buffers registered with each ring
+#define UR_BUF_SIZE (64 * 1024)  // bytes each; buffer 0 stays all zeros
+#define UR_MAX_LEN (1u << 30)    // longest single request
+
+// A request, and its result once it is done
+typedef struct ur_op {
+  uint8_t opcode;
+  int16_t buf_index; // the registered buffer addr is in, for _FIXED
+  uint32_t flags;    // fsync_flags or sync_range_flags
+  void *addr;
+  uint32_t len;
+  uint64_t off;
+  int res;
+} ur_op_t;
+
+typedef struct ring {
+  int fd;
+  void *sq_map, *cq_map, *sqe_map;
+  size_t sq_size, cq_size, sqe_size;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  char *bufs;    // UR_BUFS * UR_BUF_SIZE bytes
+  int fixed;     // whether bufs are registered with the ring
+  unsigned busy; // bufs handed out by ur_get
+} ring_t;
+
+static int ur_image = -1; // the image file
+static int ur_rings;      // 1 if rings can be set up here, -1 if not
+static pthread_key_t ur_key;
+static pthread_once_t ur_once = PTHREAD_ONCE_INIT;
+static __thread ring_t *ur_ring; // this thread's
+static char ur_zeros[UR_BUF_SIZE];
+
+static void ring_free(void *arg) {
+  ring_t *r = arg;
+  if (r->bufs) {
+    munmap(r->bufs, (size_t) UR_BUFS * UR_BUF_SIZE);
+  }
+  if (r->sqe_map) {
+    munmap(r->sqe_map, r->sqe_size);
+  }
+  if (r->cq_map && r->cq_map != r->sq_map) {
+    munmap(r->cq_map, r->cq_size);
+  }
+  if (r->sq_map) {
+    munmap(r->sq_map, r->sq_size);
+  }
+  close(r->fd);
+  free(r);
+}
+
+static void *ring_map(int fd, size_t size, off_t what) {
+  void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 fd, what);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+// Set up a ring, or return NULL with errno set.
+static ring_t *ring_new() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+  if (fd < 0) {
+    return NULL;
+  }
+  ring_t *r = calloc(1, sizeof(ring_t));
+  r->fd = fd;
+  // IORING_OP_READ and IORING_OP_WRITE came with this feature, in 5.6
+  int err = p.features & IORING_FEAT_RW_CUR_POS ? 0 : ENOSYS;
+
+  r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->sq_size = r->cq_size = r->sq_size > r->cq_size ? r->sq_size : r->cq_size;
+  }
+  r->sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  if (!err) {
+    r->sq_map = ring_map(fd, r->sq_size, IORING_OFF_SQ_RING);
+    r->cq_map = p.features & IORING_FEAT_SINGLE_MMAP
+                    ? r->sq_map
+                    : ring_map(fd, r->cq_size, IORING_OFF_CQ_RING);
+    r->sqe_map = ring_map(fd, r->sqe_size, IORING_OFF_SQES);
+    err = r->sq_map && r->cq_map && r->sqe_map ? 0 : errno;
+  }
+  if (err) {
+    ring_free(r);
+    errno = err;
+    return NULL;
+  }
+  char *sq = r->sq_map, *cq = r->cq_map;
+  r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) (sq + p.sq_off.array);
+  r->sqes = r->sqe_map;
+  r->cq_head = (unsigned *) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  // registered buffers save pinning the pages for every request; the
+  // ring works without them if the memlock limit says no
+  r->bufs = mmap(0, (size_t) UR_BUFS * UR_BUF_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r->bufs == MAP_FAILED) {
+    r->bufs = NULL;
+    ring_free(r);
+    errno = ENOMEM;
+    return NULL;
+  }
+  struct iovec iov[UR_BUFS];
+  for (int i = 0; i < UR_BUFS; i++) {
+    iov[i].iov_base = r->bufs + (size_t) i * UR_BUF_SIZE;
+    iov[i].iov_len = UR_BUF_SIZE;
+  }
+  r->fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov,
+                     UR_BUFS) == 0;
+  return r;
+}
+
+static void ur_key_init() { pthread_key_create(&ur_key, ring_free); }
+
+// This thread's ring, or NULL to use plain system calls.
+static ring_t *my_ring() {
+  if (!ur_ring && ur_rings > 0) {
+    ur_ring = ring_new();
+    if (ur_ring) {
+      pthread_setspecific(ur_key, ur_ring);
+    }
+  }
+  return ur_ring;
+}
+
+// Submit the requests, a queue's worth at a time, and wait for them all.
+static void ring_run(ring_t *r, ur_op_t *ops, int n) {
+  for (int first = 0; first < n; first += UR_ENTRIES) {
+    int k = n - first < UR_ENTRIES ? n - first : UR_ENTRIES;
+    unsigned tail = *r->sq_tail; // only this thread adds to the queue
+    for (int i = 0; i < k; i++) {
+      ur_op_t *op = &ops[first + i];
+      unsigned idx = (tail + i) & *r->sq_mask;
+      struct io_uring_sqe *sqe = &r->sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = op->opcode;
+      sqe->fd = ur_image;
+      sqe->off = op->off;
+      sqe->addr = (uintptr_t) op->addr;
+      sqe->len = op->len;
+      sqe->fsync_flags = op->flags; // shares a union with sync_range_flags
+      sqe->buf_index = op->buf_index > 0 ? op->buf_index : 0;
+      sqe->user_data = first + i;
+      r->sq_array[idx] = idx;
+    }
+    __atomic_store_n(r->sq_tail, tail + k, __ATOMIC_RELEASE);
+    int submitted = 0, done = 0;
+    while (done < k) {
+      int rv = syscall(__NR_io_uring_enter, r->fd, k - submitted, k - done,
+                       IORING_ENTER_GETEVENTS, NULL, 0);
+      if (rv < 0) {
+        // the queue is ours alone and never overfull: anything but a
+        // signal or a short wait for kernel memory is a bug
+        assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+        rv = 0;
+      }
+      submitted += rv;
+      unsigned head = *r->cq_head;
+      unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != ctail; head++, done++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        ops[cqe->user_data].res = cqe->res;
+      }
+      __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+// Finish a read or write a request left short (or, with no ring, do all
+// of it) with plain system calls.
+static int finish(ur_op_t *op) {
+  if (op->res < 0) {
+    return op->res;
+  }
+  int write = op->opcode == IORING_OP_WRITE || op->opcode == IORING_OP_WRITE_FIXED;
+  for (uint32_t done = op->res; done < op->len;) {
+    char *addr = (char *) op->addr + done;
+    ssize_t rv = write ? pwrite(ur_image, addr, op->len - done, op->off + done)
+                       : pread(ur_image, addr, op->len - done, op->off + done);
+    if (rv <= 0) {
+      return rv < 0 ? -errno : -EIO;
+    }
+    done += rv;
+  }
+  return 0;
+}
+
+// Run the requests on this thread's ring, or with plain system calls.
+static int run(ur_op_t *ops, int n) {
+  ring_t *r = my_ring();
+  if (r) {
+    ring_run(r, ops, n);
+  }
+  int rv = 0;
+  for (int i = 0; i < n; i++) {
+    if (!r) {
+      ops[i].res = 0;
+    }
+    int err = finish(&ops[i]);
+    rv = rv < 0 ? rv : err;
+  }
+  return rv;
+}
+
+// Split a range into requests of at most piece bytes each, added to ops
+// if it isn't NULL. Returns how many.
+static int add_ops(ur_op_t *ops, uint8_t opcode, int buf_index, char *addr,
+                   uint64_t off, size_t len, size_t piece, int step) {
+  int n = 0;
+  for (size_t done = 0; done < len; done += piece, n++) {
+    if (ops) {
+      ur_op_t op = {opcode, buf_index, 0, addr + (step ? done : 0),
+                    len - done < piece ? len - done : piece, off + done, 0};
+      ops[n] = op;
+    }
+  }
+  return n;
+}
+
+static int ur_rw(uint8_t opcode, const blocks_io_t *io, int n) {
+  ring_t *r = my_ring();
+  int fixed = r && r->fixed;
+  ur_op_t *ops = NULL;
+  int m = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    m = 0;
+    for (int i = 0; i < n; i++) {
+      uint64_t off = (uint64_t) io[i].bnum * BLOCK_SIZE + io[i].off;
+      if (io[i].buf) {
+        m += add_ops(ops ? ops + m : NULL, opcode, -1, io[i].buf, off,
+                     io[i].len, UR_MAX_LEN, 1);
+      } else {
+        // zeros: the same buffer again and again
+        m += add_ops(ops ? ops + m : NULL,
+                     fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE,
+                     fixed ? 0 : -1, fixed ? r->bufs : ur_zeros, off,
+                     io[i].len, UR_BUF_SIZE, 0);
+      }
+    }
+    if (!ops) {
+      ops = malloc(m * sizeof(ur_op_t));
+    }
+  }
+  int rv = run(ops, m);
+  free(ops);
+  return rv;
+}
+
+static int ur_read(const blocks_io_t *io, int n) {
+  return ur_rw(IORING_OP_READ, io, n);
+}
+
+static int ur_write(const blocks_io_t *io, int n) {
+  return ur_rw(IORING_OP_WRITE, io, n);
+}
+
+// The registered buffer data is, or -1 if it is memory of its own.
+static int buf_index(ring_t *r, void *data) {
+  char *p = data;
+  if (!r || p < r->bufs || p >= r->bufs + (size_t) UR_BUFS * UR_BUF_SIZE) {
+    return -1;
+  }
+  return (p - r->bufs) / UR_BUF_SIZE;
+}
+
+// Read or write n blocks at bnum from or into data.
+static int ur_transfer(int write, void *data, uint32_t bnum, uint32_t n) {
+  ring_t *r = my_ring();
+  int index = r && r->fixed ? buf_index(r, data) : -1;
+  uint8_t opcode = write ? (index > 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE)
+                         : (index > 0 ? IORING_OP_READ_FIXED : IORING_OP_READ);
+  size_t size = (size_t) n * BLOCK_SIZE;
+  ur_op_t *ops = malloc(add_ops(NULL, 0, 0, NULL, 0, size, UR_MAX_LEN, 1) *
+                        sizeof(ur_op_t));
+  int m = add_ops(ops, opcode, index, data, (uint64_t) bnum * BLOCK_SIZE, size,
+                  UR_MAX_LEN, 1);
+  int rv = run(ops, m);
+  free(ops);
+  return rv;
+}
+
+static void release(void *data) {
+  int index = buf_index(ur_ring, data);
+  if (index > 0) {
+    ur_ring->busy &= ~(1u << index);
+  } else {
+    free(data);
+  }
+}
+
+static void *ur_get(uint32_t bnum, uint32_t n) {
+  ring_t *r = my_ring();
+  size_t size = (size_t) n * BLOCK_SIZE;
+  char *data = NULL;
+  for (int i = 1; r && size <= UR_BUF_SIZE && i < UR_BUFS && !data; i++) {
+    if (!(r->busy & (1u << i))) {
+      r->busy |= 1u << i;
+      data = r->bufs + (size_t) i * UR_BUF_SIZE;
+    }
+  }
+  if (!data) {
+    data = malloc(size);
+  }
+  if (ur_transfer(0, data, bnum, n) < 0) {
+    release(data);
+    return NULL;
+  }
+  return data;
+}
+
+static int ur_put(void *data, uint32_t bnum, uint32_t n, int dirty) {
+  int rv = dirty ? ur_transfer(1, data, bnum, n) : 0;
+  release(data);
+  return rv;
+}
+
+// Start writing every range, then wait for each: the waits overlap with
+// the writes still going.
+static int ur_flush(const blocks_io_t *io, int n) {
+  ring_t *r = my_ring();
+  if (!r) {
+    return backend_mmap.flush(io, n);
+  }
+  int m = 0;
+  for (int i = 0; i < n; i++) {
+    m += add_ops(NULL, 0, 0, NULL, 0, io[i].len, UR_MAX_LEN, 0);
+  }
+  ur_op_t *ops = malloc(m * sizeof(ur_op_t));
+  for (int pass = 0; pass < 2; pass++) {
+    uint8_t opcode = pass == 0 ? IORING_OP_SYNC_FILE_RANGE : IORING_OP_FSYNC;
+    for (int i = 0, k = 0; i < n; i++) {
+      k += add_ops(ops + k, opcode, -1, NULL,
+                   (uint64_t) io[i].bnum * BLOCK_SIZE, io[i].len, UR_MAX_LEN, 0);
+    }
+    for (int i = 0; i < m; i++) {
+      ops[i].flags = pass == 0 ? SYNC_FILE_RANGE_WRITE : IORING_FSYNC_DATASYNC;
+    }
+    ring_run(r, ops, m);
+  }
+  // only the waits count: starting the writes early is just a head start
+  int rv = 0;
+  for (int i = 0; i < m; i++) {
+    rv = rv < 0 ? rv : ops[i].res < 0 ? ops[i].res : 0;
+  }
+  free(ops);
+  return rv;
+}
+
+static int ur_init(int fd) {
+  ur_image = fd;
+  pthread_once(&ur_once, ur_key_init);
+  if (ur_rings == 0) {
+    // try once, on this thread; the others set up theirs when they need one
+    ur_ring = ring_new();
+    ur_rings = ur_ring ? 1 : -1;
+    if (ur_ring) {
+      pthread_setspecific(ur_key, ur_ring);
+    } else {
+      printf("+ io_uring unavailable (%s): using pread and pwrite\n",
+             strerror(errno));
+    }
+  }
+  return 0;
+}
+
+// Other threads' rings go when the threads exit.
+static void ur_free() {
+  if (ur_ring) {
+    pthread_setspecific(ur_key, NULL);
+    ring_free(ur_ring);
+    ur_ring = NULL;
+  }
+  ur_image = -1;
+}
+
+const backend_t backend_uring = {
+    .name = "uring",
+    .mapped = 0,
+    .init = ur_init,
+    .free = ur_free,
+    .get = ur_get,
+    .put = ur_put,
+    .read = ur_read,
+    .write = ur_write,
+    .flush = ur_flush,
+};
@@ -0,0 +1,112 @@
+/**
+ * Synthetic read-only files under /.nufs.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "vfile.h"
+
+// Writes a file's contents into buf and returns the full length, as
+// snprintf does
+typedef size_t (*vfile_render_t)(char *buf, size_t cap);
+
+static const struct {
+  const char *name;
+  vfile_render_t render;
+} vfiles[] = {
+    {"stats", stats_render},
+};
+
+#define VFILE_COUNT ((int) (sizeof(vfiles) / sizeof(vfiles[0])))
+
+// Index in vfiles of the file at path, -1 for /.nufs itself, -2 if none
+static int vfile_find(const char *path) {
+  size_t dlen = strlen(VFILE_DIR);
+  if (strncmp(path, VFILE_DIR, dlen) != 0) {
+    return -2;
+  }
+  if (path[dlen] == '\0') {
+    return -1;
+  }
+  if (path[dlen] != '/') {
+    return -2;
+  }
+  for (int i = 0; i < VFILE_COUNT; i++) {
+    if (strcmp(path + dlen + 1, vfiles[i].name) == 0) {
+      return i;
+    }
+  }
+  return -2;
+}
+
+// Is path /.nufs or inside it?
+int vfile_owns(const char *path) {
+  size_t dlen = strlen(VFILE_DIR);
+  return strncmp(path, VFILE_DIR, dlen) == 0 &&
+         (path[dlen] == '\0' || path[dlen] == '/');
+}
+
+// Fill in st for /.nufs or a file in it.
+int vfile_stat(const char *path, struct stat *st) {
+  int i = vfile_find(path);
+  if (i == -2) {
+    return -ENOENT;
+  }
+  memset(st, 0, sizeof(struct stat));
+  st->st_uid = getuid();
+  st->st_nlink = 1;
+  if (i == -1) {
+    st->st_mode = 040555;
+  } else {
+    st->st_mode = 0100444;
+    st->st_size = vfiles[i].render(NULL, 0);
+  }
+  return 0;
+}
+
+// Take a snapshot of a synthetic file.
+vfile_t *vfile_open(const char *path) {
+  int i = vfile_find(path);
+  if (i < 0) {
+    return NULL;
+  }
+  vfile_t *vf = malloc(sizeof(vfile_t));
+  size_t cap = 4096;
+  vf->data = malloc(cap);
+  // the contents may grow between sizing and rendering; retry until it fits
+  while ((vf->len = vfiles[i].render(vf->data, cap)) >= cap) {
+    cap = vf->len + 1024;
+    vf->data = realloc(vf->data, cap);
+  }
+  return vf;
+}
+
+// Read from a snapshot.
+int vfile_read(vfile_t *vf, char *buf, size_t size, off_t offset) {
+  if (offset < 0 || (size_t) offset >= vf->len) {
+    return 0;
+  }
+  if (size > vf->len - offset) {
+    size = vf->len - offset;
+  }
+  memcpy(buf, vf->data + offset, size);
+  return size;
+}
+
+// Free a snapshot.
+void vfile_close(vfile_t *vf) {
+  free(vf->data);
+  free(vf);
+}
+
+// List the names in /.nufs.
+slist_t *vfile_list() {
+  slist_t *names = NULL;
+  for (int i = VFILE_COUNT - 1; i >= 0; i--) {
+    names = s_cons(vfiles[i].name, names);
+  }
+  return names;
+}
@@ -0,0 +1,60 @@
+/**
+ * Synthetic read-only files under /.nufs.
+ *
+ * Their contents are generated from in-memory state when they are opened
+ * and never touch the image. A directory named .nufs on the image is
+ * hidden behind them.
+ */
+#ifndef VFILE_H
+#define VFILE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "slist.h"
+
+#define VFILE_DIR "/.nufs"
+
+// Snapshot of a synthetic file, taken at open
+typedef struct vfile {
+  char *data;
+  size_t len;
+} vfile_t;
+
+/**
+ * Is path /.nufs or inside it?
+ */
+int vfile_owns(const char *path);
+
+/**
+ * Fill in st for /.nufs or a file in it.
+ *
+ * @return 0, or -ENOENT if there is no such synthetic file.
+ */
+int vfile_stat(const char *path, struct stat *st);
+
+/**
+ * Take a snapshot of a synthetic file.
+ *
+ * @return The snapshot, or NULL if there is no such file.
+ */
+vfile_t *vfile_open(const char *path);
+
+/**
+ * Read from a snapshot.
+ *
+ * @return Number of bytes copied to buf.
+ */
+int vfile_read(vfile_t *vf, char *buf, size_t size, off_t offset);
+
+/**
+ * Free a snapshot.
+ */
+void vfile_close(vfile_t *vf);
+
+/**
+ * List the names in /.nufs.
+ */
+slist_t *vfile_list();
+
+#endif